@@ -3,8 +3,11 @@ if exist ..\emsdk\emsdk_env.bat call ..\emsdk\emsdk_env
 ::: emcc zippast.c
 ::: node a.out.js
 
-::: -s EXPORTED_FUNCTIONS=["_run"]
+::: Direct API (no argument parsing or file system needed): zippast_process() / zippast_malloc() / zippast_free()
+set EXPORTS=-s EXPORTED_FUNCTIONS=["_main","_zippast_process","_zippast_malloc","_zippast_free","_zippast_extension","_zippast_threads","_zippast_crc32"] -s EXPORTED_RUNTIME_METHODS=["callMain","ccall","cwrap","UTF8ToString","getValue"]
 
-::: -O2
+::: Single-threaded, SIMD128 kernels
+emcc zippast.c -O3 -msimd128 -s ALLOW_MEMORY_GROWTH=1 %EXPORTS% -o docs/zippast.html
 
-emcc zippast.c -s ALLOW_MEMORY_GROWTH=1 -s EXPORTED_RUNTIME_METHODS=["callMain"] -o docs/zippast.html
+::: Multi-threaded worker pool (requires SharedArrayBuffer: page must be served cross-origin isolated, COOP/COEP headers)
+emcc zippast.c -O3 -msimd128 -pthread -s PTHREAD_POOL_SIZE=navigator.hardwareConcurrency -s ALLOW_MEMORY_GROWTH=1 %EXPORTS% -o docs/zippast-mt.html
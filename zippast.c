@@ -13,16 +13,111 @@
 
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
+#else
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
 
 #ifdef _MSC_VER
 #define strcasecmp _stricmp
 #define strdup _strdup
+#define fdopen _fdopen
+#define dup _dup
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#if !defined(__EMSCRIPTEN__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <fcntl.h>
+#endif
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#define ZIPPAST_EXPORT EMSCRIPTEN_KEEPALIVE
+#else
+#define ZIPPAST_EXPORT
+#endif
+
+// SIMD kernels (WebAssembly SIMD128, or SSE2 on x86)
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ZIPPAST_SSE2
+#endif
+
+// Byte order (multi-byte loads/stores of little-endian fields can be done directly)
+#if defined(_WIN32) || defined(__EMSCRIPTEN__) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define ZIPPAST_LITTLE_ENDIAN 1
+#else
+#define ZIPPAST_LITTLE_ENDIAN 0
+#endif
+
+// Threading (Win32 or pthreads; single-threaded WebAssembly builds have none)
+#if defined(_WIN32)
+#define ZIPPAST_THREADS 1
+typedef HANDLE zippast_thread_t;
+typedef CRITICAL_SECTION zippast_mutex_t;
+typedef CONDITION_VARIABLE zippast_cond_t;
+typedef INIT_ONCE zippast_once_t;
+#define ZIPPAST_ONCE_INIT INIT_ONCE_STATIC_INIT
+#elif !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define ZIPPAST_THREADS 1
+#include <pthread.h>
+typedef pthread_t zippast_thread_t;
+typedef pthread_mutex_t zippast_mutex_t;
+typedef pthread_cond_t zippast_cond_t;
+typedef pthread_once_t zippast_once_t;
+#define ZIPPAST_ONCE_INIT PTHREAD_ONCE_INIT
+#else
+#define ZIPPAST_THREADS 0
+typedef int zippast_thread_t;
+typedef int zippast_mutex_t;
+typedef int zippast_cond_t;
+typedef int zippast_once_t;
+#define ZIPPAST_ONCE_INIT 0
+#endif
+
+// Daemon mode (local socket job interface), and watch mode (inotify)
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define ZIPPAST_DAEMON
+#if defined(__linux__)
+#define ZIPPAST_WATCH
+#endif
 #endif
 
 typedef enum {
@@ -111,651 +206,2926 @@ int WavWriteHeader(void *buffer, unsigned int bitsPerSample, unsigned int chans,
 	return headerSize;
 }
 
-unsigned char *readFile(const char *filename, size_t *outLength)
+// Large file (64-bit) positioning
+bool fileSeek(FILE *fp, uint64_t offset)
 {
-	FILE *fp = fopen(filename, "rb");
-	if (fp == NULL) { perror("ERROR: Problem opening input file"); return NULL; }
-	if (fseek(fp, 0, SEEK_END) != 0) { perror("ERROR: Problem seeking input file to end"); fclose(fp); return NULL; }
-	long length = ftell(fp);
-	if (length < 0) { perror("ERROR: Problem determining file length"); fclose(fp); return NULL; }
-	if (fseek(fp, 0, SEEK_SET) != 0) { perror("ERROR: Problem seeking input file to start"); fclose(fp); return NULL; }
-	unsigned char *buffer = (unsigned char *)malloc((size_t)length);
-	if (buffer == NULL) { perror("ERROR: Problem allocating memory for input file"); fclose(fp); return NULL; }
-	size_t lengthRead = fread(buffer, 1, (size_t)length, fp);
-	fclose(fp);
-	if (lengthRead != length) { perror("ERROR: Problem reading input file"); free(buffer); return NULL; }
-	*outLength = lengthRead;
-	return buffer;
+#if defined(_WIN32)
+	return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET) == 0;
+#endif
 }
 
-
-// Buffer sizes required (user must add 'alignment' bytes if they want padding)
-#define ZIP_WRITER_MAX_PATH 256
-#define ZIP_WRITER_SIZE_HEADER (46 + ZIP_WRITER_MAX_PATH)
-#define ZIP_WRITER_SIZE_MAX    (ZIP_WRITER_SIZE_HEADER + 4) //// max(header, footer, directory) +4 bytes for "extra field" padding header, user must add 'alignment' bytes to this length
-
-// ZIP Timestamp
-#define ZIP_DATETIME(_year, _month, _day, _hours, _minutes, _seconds) ( (((unsigned long)((_year) - 1980) & 0x7f) << 25) | (((unsigned long)(_month) & 0x0f) << 21) | (((unsigned long)(_day) & 0x1f) << 16) | (((unsigned long)(_hours) & 0x1f) << 11) | (((unsigned long)(_minutes) & 0x3f) << 5) | (((unsigned long)(_seconds) & 0x3f) >> 1))
-
-// File state tracking
-typedef struct zipwriter_file_tag_t
+// Length of an open file (leaves the position at the end), or UINT64_MAX on error
+uint64_t fileLength(FILE *fp)
 {
-//private:
-	const char *filename;				// pointer to filename (must be valid when central directory entry is written)
-	unsigned long offset;				// start file offset
-	unsigned long modified;				// modified date
-	unsigned long length;				// file length
-	int extraFieldLength;				// extra field length
-	unsigned long crc;					// CRC
-	struct zipwriter_file_tag_t *next;	// next element in linked list
-} zipwriter_file_t;
+#if defined(_WIN32)
+	if (_fseeki64(fp, 0, SEEK_END) != 0) return UINT64_MAX;
+	__int64 length = _ftelli64(fp);
+#else
+	if (fseeko(fp, 0, SEEK_END) != 0) return UINT64_MAX;
+	off_t length = ftello(fp);
+#endif
+	return length < 0 ? UINT64_MAX : (uint64_t)length;
+}
 
-// ZIP writer state tracking
-typedef struct
+// Read a span of an open file
+bool fileRead(FILE *fp, uint64_t offset, void *buffer, size_t length)
 {
-//private:
-	unsigned long length;				// overall ZIP file length
-	int numFiles;						// number of files
-	zipwriter_file_t *files;			// linked list of files
-	zipwriter_file_t *lastFile;			// tail of linked list
-	zipwriter_file_t *currentFile;		// current file being written
-	zipwriter_file_t *centralDirectoryFile;	// current central directory file entry being written
-	int centralDirectoryEntries;
-	unsigned long centralDirectoryOffset;
-	unsigned long centralDirectorySize;
-} zipwriter_t;
+	return fileSeek(fp, offset) && fread(buffer, 1, length, fp) == length;
+}
 
-// Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/
-// This implementation by Rich Geldreich <richgel99@gmail.com> from miniz.c (public domain zlib-subset - "This is free and unencumbered software released into the public domain")
-#define CRC32_INIT (0)
-static unsigned long crc32(unsigned long crc, const unsigned char *ptr, size_t buf_len)
+// Write a span of an open file
+bool fileWrite(FILE *fp, uint64_t offset, const void *buffer, size_t length)
 {
-	static const unsigned long s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
-	unsigned long crcu32 = (unsigned long)crc;
-	if (!ptr) return CRC32_INIT;
-	crcu32 = (~crcu32) & 0xfffffffful;
-	while (buf_len--)
-	{
-		unsigned char b = *ptr++;
-		crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b & 0xF)];
-		crcu32 = (crcu32 >> 4) ^ s_crc32[(crcu32 & 0xF) ^ (b >> 4)];
-	}
-	return (~crcu32) & 0xfffffffful;
+	return fileSeek(fp, offset) && fwrite(buffer, 1, length, fp) == length;
 }
 
-void ZIPWriterInitialize(zipwriter_t *context)
+// Flush an open file through to the storage device
+bool fileSync(FILE *fp)
 {
-	// Clear context
-	memset(context, 0, sizeof(zipwriter_t));
+	if (fflush(fp) != 0) return false;
+#if defined(_WIN32)
+	return _commit(_fileno(fp)) == 0;
+#else
+	return fsync(fileno(fp)) == 0;
+#endif
 }
 
-// Generate the ZIP local header for a file
-int ZIPWriterStartFile(zipwriter_t *context, zipwriter_file_t *file, const char *filename, unsigned long modified, int alignment, void *buffer)
+// Replace a file with another (e.g. a completed temporary file)
+bool fileReplace(const char *fromFile, const char *toFile)
 {
-	// Start writing header
-	unsigned char *p = buffer;
+#if defined(_WIN32)
+	return MoveFileExA(fromFile, toFile, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(fromFile, toFile) == 0;
+#endif
+}
 
-	// Initialize file structure
-	memset(file, 0, sizeof(zipwriter_file_t));
-	file->filename = filename;		// TODO: Check length
-	file->modified = modified;
-	file->offset = context->length;
-	file->extraFieldLength = 0;
 
-	// Calculate extra field length to match alignment
-	if (alignment > 0)
+// Create a directory and any missing parents
+bool makeDirectories(const char *path)
+{
+	char *dir = strdup(path);
+	if (dir == NULL) return false;
+	bool result = true;
+	for (char *p = dir; result; p++)
 	{
-		size_t contentOffset = file->offset + 30 + strlen(file->filename);
-		size_t alignedOffset = (contentOffset + alignment - 1) / alignment * alignment;
-		if (contentOffset != alignedOffset)
+		if (*p == '/' || *p == '\\' || *p == '\0')
 		{
-			file->extraFieldLength = (int)(alignedOffset - contentOffset);
+			char c = *p;
+			*p = '\0';
+#ifdef _WIN32
+			bool exists = dir[0] != '\0' && _mkdir(dir) != 0;
+#else
+			bool exists = dir[0] != '\0' && mkdir(dir, 0777) != 0;
+#endif
+			if (exists && errno != EEXIST) result = false;
+			// (an existing path must be a directory)
+			struct stat st;
+			if (exists && result && (stat(dir, &st) != 0 || (st.st_mode & S_IFMT) != S_IFDIR)) { errno = ENOTDIR; result = false; }
+			*p = c;
+			if (c == '\0') break;
 		}
 	}
+	free(dir);
+	return result;
+}
 
-	// Start file list, or append if we've already got one
-	if (context->centralDirectoryFile == NULL) { context->centralDirectoryFile = file; }
-	if (context->files == NULL)
-	{
-		context->files = file;
-	}
-	else
-	{
-		context->lastFile->next = file;
-	}
-
-	// Update file pointer
-	context->currentFile = file;
-	context->lastFile = file;
-	context->numFiles++;
-
-	// Local header
-	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x03; p[3] = 0x04; // Local file header signature
-	p[4] = 0x14; p[5] = 0x00;					// Version needed to extract
-	p[6] = 0x00 | (1 << 3); p[7] = 0x00;			// Flags (b3 = data descriptor)
-	p[8] = 0; p[9] = 0;							// Compression method (0=store, 8=deflated)
-	p[10] = (unsigned char)(context->currentFile->modified); p[11] = (unsigned char)(context->currentFile->modified >> 8);					// Modification time
-	p[12] = (unsigned char)(context->currentFile->modified >> 16); p[13] = (unsigned char)(context->currentFile->modified >> 24);			// Modification date
-	p[14] = 0; p[15] = 0; p[16] = 0; p[17] = 0;	// CRC32
-	p[18] = 0; p[19] = 0; p[20] = 0; p[21] = 0;	// Compressed size
-	p[22] = 0; p[23] = 0; p[24] = 0; p[25] = 0;	// Uncompressed size
-	p[26] = (unsigned char)strlen(context->currentFile->filename); p[27] = (unsigned char)(strlen(context->currentFile->filename) >> 8);		// Filename length
-	p[28] = (unsigned char)(context->currentFile->extraFieldLength); p[29] = (unsigned char)(context->currentFile->extraFieldLength >> 8);	// Extra field length
-	memcpy(p + 30, context->currentFile->filename, strlen(context->currentFile->filename));
-	p += 30 + strlen(context->currentFile->filename);
-
-	// Extra field (padding)
-	if (file->extraFieldLength > 0)
-	{
-		memset(p, 0, file->extraFieldLength);
-		p += file->extraFieldLength;
-	}
 
-	context->currentFile->crc = CRC32_INIT;
+// Thread wrappers
+typedef void *(*thread_fn_t)(void *arg);
 
-	context->length += (int)((char *)p - (char *)buffer);
-	return (int)((char *)p - (char *)buffer);
+#if defined(_WIN32)
+typedef struct { thread_fn_t fn; void *arg; } thread_start_t;
+static DWORD WINAPI ThreadStart(LPVOID param)
+{
+	thread_start_t start = *(thread_start_t *)param;
+	free(param);
+	start.fn(start.arg);
+	return 0;
 }
+#endif
 
-// Update the context with the ZIP file data
-void ZIPWriterFileContent(zipwriter_t *context, const void *data, size_t length)
+bool ThreadCreate(zippast_thread_t *thread, thread_fn_t fn, void *arg)
 {
-	// Update CRC
-	context->currentFile->crc = crc32(context->currentFile->crc, data, length);
-
-	// Update file and archive lengths
-	context->currentFile->length += (unsigned long)length;
-	context->length += (unsigned long)length;
+#if defined(_WIN32)
+	thread_start_t *start = (thread_start_t *)malloc(sizeof(thread_start_t));
+	if (start == NULL) return false;
+	start->fn = fn; start->arg = arg;
+	*thread = CreateThread(NULL, 0, ThreadStart, start, 0, NULL);
+	if (*thread == NULL) { free(start); return false; }
+	return true;
+#elif ZIPPAST_THREADS
+	return pthread_create(thread, NULL, fn, arg) == 0;
+#else
+	(void)thread; (void)fn; (void)arg;
+	return false;
+#endif
 }
 
-// Generate the ZIP local header for a file
-int ZIPWriterEndFile(zipwriter_t *context, void *buffer)
+void ThreadJoin(zippast_thread_t thread)
 {
-	// Start writing header
-	unsigned char *p = (unsigned char *)buffer;
+#if defined(_WIN32)
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#elif ZIPPAST_THREADS
+	pthread_join(thread, NULL);
+#else
+	(void)thread;
+#endif
+}
 
-	// Extended local header
-	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x07; p[3] = 0x08; // Extended local file header signature
-	p[4] = (unsigned char)(context->currentFile->crc); p[5] = (unsigned char)(context->currentFile->crc >> 8); p[6] = (unsigned char)(context->currentFile->crc >> 16); p[7] = (unsigned char)(context->currentFile->crc >> 24);	// CRC32
-	p[8] = (unsigned char)(context->currentFile->length); p[9] = (unsigned char)(context->currentFile->length >> 8); p[10] = (unsigned char)(context->currentFile->length >> 16); p[11] = (unsigned char)(context->currentFile->length >> 24);	// Compressed size
-	p[12] = (unsigned char)(context->currentFile->length); p[13] = (unsigned char)(context->currentFile->length >> 8); p[14] = (unsigned char)(context->currentFile->length >> 16); p[15] = (unsigned char)(context->currentFile->length >> 24);	// Uncompressed size
-	p += 16;
+#if defined(_WIN32)
+void MutexInit(zippast_mutex_t *mutex) { InitializeCriticalSection(mutex); }
+void MutexDestroy(zippast_mutex_t *mutex) { DeleteCriticalSection(mutex); }
+void MutexLock(zippast_mutex_t *mutex) { EnterCriticalSection(mutex); }
+void MutexUnlock(zippast_mutex_t *mutex) { LeaveCriticalSection(mutex); }
+void CondInit(zippast_cond_t *cond) { InitializeConditionVariable(cond); }
+void CondDestroy(zippast_cond_t *cond) { (void)cond; }
+void CondWait(zippast_cond_t *cond, zippast_mutex_t *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void CondSignal(zippast_cond_t *cond) { WakeConditionVariable(cond); }
+void CondBroadcast(zippast_cond_t *cond) { WakeAllConditionVariable(cond); }
+static BOOL CALLBACK OnceStart(PINIT_ONCE once, PVOID fn, PVOID *context) { (void)once; (void)context; ((void (*)(void))fn)(); return TRUE; }
+void Once(zippast_once_t *once, void (*fn)(void)) { InitOnceExecuteOnce(once, OnceStart, (PVOID)fn, NULL); }
+#elif ZIPPAST_THREADS
+void MutexInit(zippast_mutex_t *mutex) { pthread_mutex_init(mutex, NULL); }
+void MutexDestroy(zippast_mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void MutexLock(zippast_mutex_t *mutex) { pthread_mutex_lock(mutex); }
+void MutexUnlock(zippast_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+void CondInit(zippast_cond_t *cond) { pthread_cond_init(cond, NULL); }
+void CondDestroy(zippast_cond_t *cond) { pthread_cond_destroy(cond); }
+void CondWait(zippast_cond_t *cond, zippast_mutex_t *mutex) { pthread_cond_wait(cond, mutex); }
+void CondSignal(zippast_cond_t *cond) { pthread_cond_signal(cond); }
+void CondBroadcast(zippast_cond_t *cond) { pthread_cond_broadcast(cond); }
+void Once(zippast_once_t *once, void (*fn)(void)) { pthread_once(once, fn); }
+#else
+void MutexInit(zippast_mutex_t *mutex) { (void)mutex; }
+void MutexDestroy(zippast_mutex_t *mutex) { (void)mutex; }
+void MutexLock(zippast_mutex_t *mutex) { (void)mutex; }
+void MutexUnlock(zippast_mutex_t *mutex) { (void)mutex; }
+void CondInit(zippast_cond_t *cond) { (void)cond; }
+void CondDestroy(zippast_cond_t *cond) { (void)cond; }
+void CondWait(zippast_cond_t *cond, zippast_mutex_t *mutex) { (void)cond; (void)mutex; }
+void CondSignal(zippast_cond_t *cond) { (void)cond; }
+void CondBroadcast(zippast_cond_t *cond) { (void)cond; }
+void Once(zippast_once_t *once, void (*fn)(void)) { if (!*once) { *once = 1; fn(); } }
+#endif
 
-	context->length += (int)((char *)p - (char *)buffer);
-	return (int)((char *)p - (char *)buffer);
+// Number of logical processors available
+int cpuCount(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#elif defined(__EMSCRIPTEN_PTHREADS__)
+	return emscripten_num_logical_cores();
+#elif ZIPPAST_THREADS && defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#else
+	return 1;
+#endif
 }
 
-// Generate a ZIP central directory entry
-int ZIPWriterCentralDirectoryEntry(zipwriter_t *context, void *buffer)
+// Monotonic time in microseconds
+uint64_t timeMicroseconds(void)
 {
-	// Start writing header
-	unsigned char *p = (unsigned char *)buffer;
+#if defined(_WIN32)
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
 
-	// Is this the start of the central directory?
-	if (context->centralDirectoryEntries <= 0)
-	{
-		context->centralDirectoryOffset = context->length;
-		context->centralDirectorySize = 0;
-		//context->centralDirectoryFile = context->files;
-	}
+// Run fn(context, index) for each index in [0, count), spread over up to 'threads' threads (including the caller)
+typedef void (*parallel_fn_t)(void *context, int index);
 
-	// Are there any remaining entries?
-	if (context->centralDirectoryEntries >= context->numFiles || context->centralDirectoryFile == NULL)
+typedef struct
+{
+	zippast_mutex_t mutex;
+	int next;
+	int count;
+	parallel_fn_t fn;
+	void *context;
+} parallel_t;
+
+static void *ParallelWorker(void *arg)
+{
+	parallel_t *parallel = (parallel_t *)arg;
+	for (;;)
 	{
-		return 0;
+		MutexLock(&parallel->mutex);
+		int index = parallel->next++;
+		MutexUnlock(&parallel->mutex);
+		if (index >= parallel->count) break;
+		parallel->fn(parallel->context, index);
 	}
+	return NULL;
+}
 
-	// Starting this entry
-	context->centralDirectoryEntries++;
-
-	// Central directory
-	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x01; p[3] = 0x02; // Central directory
-	p[4] = 0x14; p[5] = 0x00;					// Version made by
-	p[6] = 0x14; p[7] = 0x00;					// Version needed to extract
-	p[8] = (1 << 3); p[9] = 0x00;				// General purpose bit flag
-	p[10] = 0; p[11] = 0;						// Compression method (0=store, 8=deflated)
-	p[12] = (unsigned char)(context->centralDirectoryFile->modified); p[13] = (unsigned char)(context->centralDirectoryFile->modified >> 8);					// Modification time
-	p[14] = (unsigned char)(context->centralDirectoryFile->modified >> 16); p[15] = (unsigned char)(context->centralDirectoryFile->modified >> 24);			// Modification date
-	p[16] = (unsigned char)(context->centralDirectoryFile->crc); p[17] = (unsigned char)(context->centralDirectoryFile->crc >> 8); p[18] = (unsigned char)(context->centralDirectoryFile->crc >> 16); p[19] = (unsigned char)(context->centralDirectoryFile->crc >> 24);	// CRC32
-	p[20] = (unsigned char)(context->centralDirectoryFile->length); p[21] = (unsigned char)(context->centralDirectoryFile->length >> 8); p[22] = (unsigned char)(context->centralDirectoryFile->length >> 16); p[23] = (unsigned char)(context->centralDirectoryFile->length >> 24);	// Compressed size
-	p[24] = (unsigned char)(context->centralDirectoryFile->length); p[25] = (unsigned char)(context->centralDirectoryFile->length >> 8); p[26] = (unsigned char)(context->centralDirectoryFile->length >> 16); p[27] = (unsigned char)(context->centralDirectoryFile->length >> 24);	// Uncompressed size
-	p[28] = (unsigned char)strlen(context->centralDirectoryFile->filename); p[29] = (unsigned char)(strlen(context->centralDirectoryFile->filename) >> 8);	// Filename length
-	p[30] = (unsigned char)(context->centralDirectoryFile->extraFieldLength); p[31] = (unsigned char)(context->centralDirectoryFile->extraFieldLength >> 8);// Extra field length
-	p[32] = 0; p[33] = 0;						// File comment length
-	p[34] = 0; p[35] = 0;						// Disk number start
-	p[36] = 0; p[37] = 0;						// Internal file attributes
-	p[38] = 0; p[39] = 0; p[40] = 0; p[41] = 0;	// External file attributes
-	p[42] = (unsigned char)(context->centralDirectoryFile->offset); p[43] = (unsigned char)(context->centralDirectoryFile->offset >> 8); p[44] = (unsigned char)(context->centralDirectoryFile->offset >> 16); p[45] = (unsigned char)(context->centralDirectoryFile->offset >> 24);	// Relative offset of local header
-	memcpy(p + 46, context->centralDirectoryFile->filename, strlen(context->centralDirectoryFile->filename));
-	p += 46 + strlen(context->centralDirectoryFile->filename);
-
-	// Extra field (padding)
-	if (context->centralDirectoryFile->extraFieldLength > 0)
-	{
-		memset(p, 0, context->centralDirectoryFile->extraFieldLength);
-		p += context->centralDirectoryFile->extraFieldLength;
+void parallelFor(int count, int threads, parallel_fn_t fn, void *context)
+{
+	if (threads > count) threads = count;
+	if (threads <= 1 || !ZIPPAST_THREADS)
+	{
+		for (int i = 0; i < count; i++) fn(context, i);
+		return;
 	}
 
-	// Advance to the next entry
-	context->centralDirectoryFile = context->centralDirectoryFile->next;
+	parallel_t parallel;
+	MutexInit(&parallel.mutex);
+	parallel.next = 0;
+	parallel.count = count;
+	parallel.fn = fn;
+	parallel.context = context;
 
-	context->centralDirectorySize += (int)((char *)p - (char *)buffer);
-	context->length += (int)((char *)p - (char *)buffer);
-	return (int)((char *)p - (char *)buffer);
+	zippast_thread_t *workers = (zippast_thread_t *)malloc((threads - 1) * sizeof(zippast_thread_t));
+	int started = 0;
+	while (workers != NULL && started < threads - 1 && ThreadCreate(&workers[started], ParallelWorker, &parallel)) started++;
+	ParallelWorker(&parallel);
+	for (int i = 0; i < started; i++) ThreadJoin(workers[i]);
+	free(workers);
+	MutexDestroy(&parallel.mutex);
 }
 
-// Generate the ZIP central directory end
-int ZIPWriterCentralDirectoryEnd(zipwriter_t *context, void *buffer)
-{
-	// Start writing header
-	unsigned char *p = buffer;
 
-	// Local header
-	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x05; p[3] = 0x06; // End of central directory header
-	p[4] = 0x00; p[5] = 0x00;					// Number of this disk
-	p[6] = 0x00; p[7] = 0x00;					// Number of the disk with the start of the central directory
-	p[8] = context->numFiles; p[9] = 0;			// Number of entries in the central directory on this disk
-	p[10] = context->numFiles; p[11] = 0;		// Total number of entries in the central directory
-	
-	p[12] = (unsigned char)(context->centralDirectorySize); p[13] = (unsigned char)(context->centralDirectorySize >> 8); p[14] = (unsigned char)(context->centralDirectorySize >> 16); p[15] = (unsigned char)(context->centralDirectorySize >> 24);			// Size of the central directory
-	p[16] = (unsigned char)(context->centralDirectoryOffset); p[17] = (unsigned char)(context->centralDirectoryOffset >> 8); p[18] = (unsigned char)(context->centralDirectoryOffset >> 16); p[19] = (unsigned char)(context->centralDirectoryOffset >> 24);	// Offset of the start of the central directory from the starting disk
-	p[20] = 0; p[21] = 0;						// ZIP file comment length
-	p += 22;
+// Bounded queue of jobs between threads: producers block while it is full, consumers while it is empty
+typedef struct
+{
+	zippast_mutex_t mutex;
+	zippast_cond_t notEmpty;
+	zippast_cond_t notFull;
+	void **items;
+	int capacity;
+	int head;
+	int count;
+	bool closed;
+} jobqueue_t;
 
-	context->length += (int)((char *)p - (char *)buffer);
-	return (int)((char *)p - (char *)buffer);
+bool JobQueueInit(jobqueue_t *queue, int capacity)
+{
+	memset(queue, 0, sizeof(jobqueue_t));
+	queue->items = (void **)malloc(capacity * sizeof(void *));
+	if (queue->items == NULL) return false;
+	queue->capacity = capacity;
+	MutexInit(&queue->mutex);
+	CondInit(&queue->notEmpty);
+	CondInit(&queue->notFull);
+	return true;
 }
 
-#define ZIP_READ_WORD(p) ((p)[0] | ((p)[1] << 8))
-#define ZIP_READ_DWORD(p) ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((p)[3] << 24))
-#define ZIP_WRITE_WORD(p, v) (((p)[0]) = ((v) & 0xff), ((p)[1]) = (((v) >> 8) & 0xff))
-#define ZIP_WRITE_DWORD(p, v) (((p)[0]) = ((v) & 0xff), ((p)[1]) = (((v) >> 8) & 0xff), ((p)[2]) = (((v) >> 16) & 0xff), ((p)[3]) = (((v) >> 24) & 0xff))
-
-bool isZip(unsigned char *data, size_t length)
+void JobQueueDestroy(jobqueue_t *queue)
 {
-	// Check End of central directory record (EOCD) -- only works if no file comment (could scan)
-	if (length < 22) { return false; }
-	unsigned char *eocd = data + length - 22;
-	if (ZIP_READ_DWORD(eocd) != 0x06054b50) { return false; }
-	return true;
+	CondDestroy(&queue->notFull);
+	CondDestroy(&queue->notEmpty);
+	MutexDestroy(&queue->mutex);
+	free(queue->items);
+	queue->items = NULL;
 }
 
-// Convert entries to data descriptor/extended local header.
-bool zipConvert(unsigned char **data, size_t *length)
+// Add a job, waiting while the queue is full (returns false if the queue has been closed)
+bool JobQueuePush(jobqueue_t *queue, void *item)
 {
-	// Check End of central directory record (EOCD) -- only works if no file comment (could scan)
-	if (*length < 22) { fprintf(stderr, "ERROR: ZIP file too small.\n"); return false; }
-	size_t eocd = *length - 22;
-	if (ZIP_READ_DWORD(*data + eocd) != 0x06054b50)
+	MutexLock(&queue->mutex);
+	while (queue->count >= queue->capacity && !queue->closed) CondWait(&queue->notFull, &queue->mutex);
+	bool accepted = !queue->closed;
+	if (accepted)
 	{
-		fprintf(stderr, "ERROR: ZIP file not valid or not supported (ZIP files with whole-file comment are not currently supported).\n");
-		return false;
+		queue->items[(queue->head + queue->count) % queue->capacity] = item;
+		queue->count++;
+		CondSignal(&queue->notEmpty);
 	}
-	int numRecords = ZIP_READ_WORD(*data + eocd + 8);	// Number of central directory records on this disk
-	size_t cd = ZIP_READ_DWORD(*data + eocd + 16);		// Offset of start of central directory
-
-	typedef struct
-	{
-		bool patch;
-		size_t entry;
-		size_t localFile;
-		size_t crc32;
-		size_t compressedSize;
-		size_t uncompressedSize;
-		size_t filenameSize;
-		size_t extraFieldSize;
-	} fileinfo_t;
+	MutexUnlock(&queue->mutex);
+	return accepted;
+}
 
-	fileinfo_t *files = (fileinfo_t *)malloc(numRecords * sizeof(fileinfo_t));
-	memset(files, 0x00, numRecords * sizeof(fileinfo_t));
-	size_t entryPosition = 0;
-	int countPatched = 0;
-	for (int i = 0; i < numRecords; i++)
+// Add a job without waiting (returns false if the queue is full or has been closed)
+bool JobQueueTryPush(jobqueue_t *queue, void *item)
+{
+	MutexLock(&queue->mutex);
+	bool accepted = !queue->closed && queue->count < queue->capacity;
+	if (accepted)
 	{
-		unsigned char *entry = *data + cd + entryPosition;
-		if (entry < *data || entry + 46 > *data + *length)
-		{
-			fprintf(stderr, "ERROR: Convert ZIP internal file positions are not valid (while scanning entry #%d).\n", i + 1);
-			return false;
-		}
-		if (ZIP_READ_DWORD(entry) != 0x02014b50)
-		{
-			fprintf(stderr, "ERROR: Convert ZIP file central directory entry #%d not valid.\n", i + 1);
-			return false;
-		}
-
-		int fileNameLength = ZIP_READ_WORD(entry + 28);		// File name length (NOTE: 7-Zip uses local name, while Windows uses central name)
-		int extraFieldLength = ZIP_READ_WORD(entry + 30);	// Extra field length
-		int fileCommentLength = ZIP_READ_WORD(entry + 32);	// File comment length
-
-		files[i].patch = !(entry[8] & (1 << 3));
-		if (files[i].patch) { countPatched++; }
-		files[i].entry = cd + entryPosition;
-		files[i].localFile = (size_t)ZIP_READ_DWORD(entry + 42);			// Relative offset of local file header
-		files[i].filenameSize = fileNameLength;
-		files[i].extraFieldSize = extraFieldLength;
-
-		// Advance to next central directory entry
-		entryPosition += 46 + fileNameLength + extraFieldLength + fileCommentLength;
+		queue->items[(queue->head + queue->count) % queue->capacity] = item;
+		queue->count++;
+		CondSignal(&queue->notEmpty);
 	}
+	MutexUnlock(&queue->mutex);
+	return accepted;
+}
 
-	if (countPatched <= 0)
+// Take the next job, waiting while the queue is empty (returns NULL once the queue is closed and drained)
+void *JobQueuePop(jobqueue_t *queue)
+{
+	MutexLock(&queue->mutex);
+	while (queue->count <= 0 && !queue->closed) CondWait(&queue->notEmpty, &queue->mutex);
+	void *item = NULL;
+	if (queue->count > 0)
 	{
-		fprintf(stderr, "INFO: No entries to convert (of %d)\n", numRecords);
-		return true;
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		CondSignal(&queue->notFull);
 	}
-	fprintf(stderr, "INFO: Converting %d/%d entries(s)\n", countPatched, numRecords);
-	size_t overallOffset = countPatched * 16;
-	size_t newLength = *length + overallOffset;
-	unsigned char *newBuffer = malloc(newLength);
-	memset(newBuffer, 0, newLength);
+	MutexUnlock(&queue->mutex);
+	return item;
+}
 
-	for (int i = 0; i < numRecords; i++)
-	{
-		fileinfo_t *file = &files[i];
+int JobQueueDepth(jobqueue_t *queue)
+{
+	MutexLock(&queue->mutex);
+	int count = queue->count;
+	MutexUnlock(&queue->mutex);
+	return count;
+}
 
-		// Eek, O(n^2) algorithm, should sort entries (central directory entries may unordered).
-		int offset = 0;
-		for (int j = 0; j < numRecords; j++)
-		{
-			if (file[j].localFile < file->localFile && file[j].patch)
-			{
-				offset += 16;
-			}
-		}
+// No more jobs will be added: wakes all waiting threads
+void JobQueueClose(jobqueue_t *queue)
+{
+	MutexLock(&queue->mutex);
+	queue->closed = true;
+	CondBroadcast(&queue->notEmpty);
+	CondBroadcast(&queue->notFull);
+	MutexUnlock(&queue->mutex);
+}
 
-		// Adjust central directory local file offset
-fprintf(stderr, "INFO: Converting entry %d: adjusting by offset %u (altering this entry: %s)\n", i + 1, (unsigned int)offset, file->patch ? "yes" : "no");
-		ZIP_WRITE_DWORD(*data + file->entry + 42, file->localFile + offset);
-		if (file->patch)
-		{
-			// Patching: add to general purpose bit flag
-			*(*data + file->entry + 8) |= (1 << 3);  // General purpose bit flag
-		}
+// I/O pacing and priority, so that a bulk conversion can run alongside latency-sensitive services.  Bulk reads and writes are made in
+// chunks (operations), each waiting for its turn under the optional bandwidth ('-io-rate') and operation ('-io-ops') limits shared by all
+// threads.  Input is read with a sequential access hint and, optionally ('-io-nocache'), read and written pages are dropped from the page cache.
+#define IO_CHUNK (1024 * 1024)
 
-		unsigned char *localEntry = *data + file->localFile;
-		if (ZIP_READ_DWORD(localEntry) != 0x04034b50)
-		{
-			fprintf(stderr, "ERROR: Convert ZIP file local file header #%d not valid.\n", i + 1);
-			return false;
-		}
+static struct
+{
+	bool initialized;
+	zippast_mutex_t mutex;
+	uint64_t bytesPerSecond;	// bandwidth limit (read and written bytes, 0=unlimited)
+	uint64_t opsPerSecond;		// operation limit (0=unlimited)
+	bool dropCache;				// drop pages behind the read/write position from the page cache
+	uint64_t start;				// time of the first operation (us)
+	uint64_t next;				// time the next operation may start
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t ops;
+	uint64_t waited;			// total time spent waiting (us)
+} s_io;
 
-		file->crc32 = ZIP_READ_DWORD(localEntry + 14);
-		file->compressedSize = ZIP_READ_DWORD(localEntry + 18);
-		file->uncompressedSize = ZIP_READ_DWORD(localEntry + 22);
-		file->filenameSize = ZIP_READ_WORD(localEntry + 26);
-		file->extraFieldSize = ZIP_READ_WORD(localEntry + 28);
+void IoInit(uint64_t bytesPerSecond, uint64_t opsPerSecond, bool dropCache)
+{
+	if (!s_io.initialized) { MutexInit(&s_io.mutex); }
+	s_io.initialized = true;
+	s_io.bytesPerSecond = bytesPerSecond;
+	s_io.opsPerSecond = opsPerSecond;
+	s_io.dropCache = dropCache;
+}
 
-		if (file->patch)
-		{
-			localEntry[6] |= (1 << 3); 				// Flags (b3 = data descriptor)			
-			ZIP_WRITE_DWORD(localEntry + 14, 0);	// clear CRC
-			ZIP_WRITE_DWORD(localEntry + 18, 0);	// clear compressed size
-			ZIP_WRITE_DWORD(localEntry + 22, 0);	// clear uncompressed size
-		}
+// Largest single operation (smaller chunks when paced, so that the rate is smooth)
+static size_t ioChunkLimit(void)
+{
+	return (s_io.bytesPerSecond || s_io.opsPerSecond) ? IO_CHUNK : 0x40000000;
+}
 
-		// Copy entry and file
-		size_t entrySize = 30 + file->filenameSize + file->extraFieldSize + file->compressedSize;
-		memcpy(newBuffer + file->localFile + offset, *data + file->localFile, entrySize);
+static void sleepMicroseconds(uint64_t us)
+{
+#if defined(_WIN32)
+	Sleep((DWORD)((us + 999) / 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)(us / 1000000);
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { ; }
+#endif
+}
 
-		// Add extended local file header
-		if (file->patch)
-		{
-			unsigned char *extHeader = newBuffer + file->localFile + offset + entrySize;
-			ZIP_WRITE_DWORD(extHeader + 0, 0x08074b50); // Extended local file header signature
-			ZIP_WRITE_DWORD(extHeader + 4, file->crc32);
-			ZIP_WRITE_DWORD(extHeader + 8, file->compressedSize);
-			ZIP_WRITE_DWORD(extHeader + 12, file->uncompressedSize);
-		}
-	}
+// Account for an operation reading and/or writing the given number of bytes, waiting for its turn under the limits
+void IoThrottle(uint64_t read, uint64_t written)
+{
+	if (!s_io.initialized) return;
+	uint64_t now = timeMicroseconds();
+	MutexLock(&s_io.mutex);
+	if (s_io.start == 0) s_io.start = now;
+	if (s_io.next < now) s_io.next = now;
+	uint64_t wait = s_io.next - now;
+	uint64_t cost = 0;
+	if (s_io.bytesPerSecond) cost = (read + written) * 1000000 / s_io.bytesPerSecond;
+	if (s_io.opsPerSecond && 1000000 / s_io.opsPerSecond > cost) cost = 1000000 / s_io.opsPerSecond;
+	s_io.next += cost;
+	s_io.bytesRead += read;
+	s_io.bytesWritten += written;
+	s_io.ops++;
+	s_io.waited += wait;
+	MutexUnlock(&s_io.mutex);
+	if (wait > 0) sleepMicroseconds(wait);
+}
 
-fprintf(stderr, "INFO: Post-conversion adjustment of EOCD CD position by %u\n", (unsigned int)overallOffset);
-	ZIP_WRITE_DWORD(*data + eocd + 16, cd + overallOffset);	// Patch central directory position
-	// Copy CD
-	memcpy(newBuffer + cd + overallOffset, *data + cd, *length - cd);
-	free(*data);
-	*data = newBuffer;
-	*length = newLength;
-	return true;
+// Lower the scheduling priority ('nice', 0=unchanged) and/or the I/O priority ('ioClass': 0=unchanged, 1=idle, 2=best-effort at 'ioLevel' 0-7)
+bool IoPriority(int nice, int ioClass, int ioLevel)
+{
+	bool result = true;
+#if defined(_WIN32)
+	if (nice > 0) result &= SetPriorityClass(GetCurrentProcess(), nice >= 10 ? IDLE_PRIORITY_CLASS : BELOW_NORMAL_PRIORITY_CLASS) != 0;
+	if (ioClass == 1) result &= SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN) != 0;		// low I/O (and memory) priority
+	else if (ioClass != 0) fprintf(stderr, "WARNING: Only the idle I/O priority is supported on this platform.\n");
+#elif !defined(__EMSCRIPTEN__)
+	if (nice != 0 && setpriority(PRIO_PROCESS, 0, nice) != 0) { perror("WARNING: Problem setting the scheduling priority"); result = false; }
+#if defined(__linux__)
+	// ioprio_set(IOPRIO_WHO_PROCESS, self, IOPRIO_PRIO_VALUE(class, level)), with IOPRIO_CLASS_BE=2, IOPRIO_CLASS_IDLE=3 (inherited by threads created later)
+	if (ioClass != 0 && syscall(SYS_ioprio_set, 1, 0, ((ioClass == 1 ? 3 : 2) << 13) | (ioClass == 1 ? 0 : (ioLevel & 7))) != 0) { perror("WARNING: Problem setting the I/O priority"); result = false; }
+#else
+	if (ioClass != 0) fprintf(stderr, "WARNING: I/O priority is not supported on this platform.\n");
+#endif
+#else
+	if (nice != 0 || ioClass != 0) fprintf(stderr, "WARNING: Priority is not supported on this platform.\n");
+#endif
+	return result;
 }
 
+// Progress of a long-running job (per stage: "read", "wrap", "convert", "write"), for a callback that may also cancel the job
+typedef struct
+{
+	const char *stage;
+	uint64_t bytes;				// bytes processed in the stage
+	uint64_t totalBytes;
+	uint32_t entries;			// entries completed in the stage (where known)
+	uint32_t totalEntries;
+	uint64_t elapsed;			// time in the stage (us)
+	uint64_t rate;				// bytes per second in the stage
+} zippast_progress_t;
 
-// Patch the offsets in the specified ZIP file data's central directory
-bool zipOffsets(unsigned char **data, size_t *length, size_t headerSize, size_t commentPad)
+// Progress callback: return false to cancel the job
+typedef bool (*zippast_progress_fn)(void *context, const zippast_progress_t *progress);
+
+// Progress tracking for a job (the callback may be NULL, in which case only cancellation is checked)
+#define PROGRESS_INTERVAL 250000	// minimum time between reports (us)
+typedef struct
 {
-	size_t offset = headerSize; 
+	zippast_progress_fn callback;
+	void *context;
+	zippast_progress_t state;
+	uint64_t start;				// start time of the stage
+	uint64_t last;				// time of the last report
+	uint32_t (*entriesAt)(const void *table, uint64_t position);	// entries completed at a position in the stage (optional)
+	const void *table;
+	bool cancelled;
+} progress_t;
 
-	fprintf(stderr, "INFO: Offsetting .ZIP by %u (+%u end comment)\n", (unsigned int)headerSize, (unsigned int)commentPad);
+// Set (from a signal handler) to cancel the jobs in progress
+static volatile sig_atomic_t s_cancel = 0;
+static void cancelSignal(int sig) { (void)sig; s_cancel = 1; }
 
-	// Check End of central directory record (EOCD) -- only works if no file comment (could scan)
-	if (*length < 22) { fprintf(stderr, "ERROR: ZIP file too small.\n"); return false; }
-	size_t eocd = *length - 22;
-	if (ZIP_READ_DWORD(*data + eocd) != 0x06054b50)
-	{
-		fprintf(stderr, "ERROR: ZIP file not valid or not supported (ZIP files with whole-file comment are not currently supported).\n");
-		return false;
-	}
-	int numRecords = ZIP_READ_WORD(*data + eocd + 8);	// Number of central directory records on this disk
-	size_t cd = ZIP_READ_DWORD(*data + eocd + 16);		// Offset of start of central directory
+void ProgressInit(progress_t *progress, zippast_progress_fn callback, void *context)
+{
+	memset(progress, 0, sizeof(progress_t));
+	progress->callback = callback;
+	progress->context = context;
+}
 
-	size_t entryPosition = 0;
-	for (int i = 0; i < numRecords; i++)
-	{
-		unsigned char *entry = *data + cd + entryPosition;
-		if (entry < *data || entry + 46 > *data + *length)
-		{
-			fprintf(stderr, "ERROR: ZIP internal file positions are not valid (while scanning entry #%d).\n", i + 1);
-			return false;
-		}
-		if (ZIP_READ_DWORD(entry) != 0x02014b50)
-		{
-			fprintf(stderr, "ERROR: ZIP file central directory entry #%d not valid.\n", i + 1);
-			return false;
-		}
+static void progressReport(progress_t *progress, uint64_t now)
+{
+	progress->last = now;
+	progress->state.elapsed = now - progress->start;
+	progress->state.rate = progress->state.elapsed > 0 ? progress->state.bytes * 1000000 / progress->state.elapsed : 0;
+	if (progress->entriesAt != NULL) progress->state.entries = progress->entriesAt(progress->table, progress->state.bytes);
+	if (progress->callback != NULL && !progress->callback(progress->context, &progress->state)) progress->cancelled = true;
+}
 
-		int fileNameLength = ZIP_READ_WORD(entry + 28);		// File name length (NOTE: 7-Zip uses local name, while Windows uses central name)
-		int extraFieldLength = ZIP_READ_WORD(entry + 30);	// Extra field length
-		int fileCommentLength = ZIP_READ_WORD(entry + 32);	// File comment length
-		int localFile = ZIP_READ_DWORD(entry + 42);			// Relative offset of local file header
+void ProgressStart(progress_t *progress, const char *stage, uint64_t totalBytes, uint32_t totalEntries)
+{
+	if (progress == NULL) return;
+	progress->state.stage = stage;
+	progress->state.bytes = 0;
+	progress->state.totalBytes = totalBytes;
+	progress->state.entries = 0;
+	progress->state.totalEntries = totalEntries;
+	progress->entriesAt = NULL;
+	progress->table = NULL;
+	progress->start = progress->last = timeMicroseconds();
+}
 
-		// Patch local file offset position
-		ZIP_WRITE_DWORD(entry + 42, localFile + offset);
+// Account for bytes processed in the stage, returns false (with errno=ECANCELED) if the job has been cancelled
+bool ProgressUpdate(progress_t *progress, uint64_t bytes)
+{
+	if (progress == NULL) return true;
+	progress->state.bytes += bytes;
+	uint64_t now = timeMicroseconds();
+	if (now - progress->last >= PROGRESS_INTERVAL) progressReport(progress, now);
+	if (s_cancel) progress->cancelled = true;
+	if (progress->cancelled) errno = ECANCELED;
+	return !progress->cancelled;
+}
 
-		// Advance to next central directory entry
-		entryPosition += 46 + fileNameLength + extraFieldLength + fileCommentLength;
-	}
+// Final report for the stage
+bool ProgressEnd(progress_t *progress)
+{
+	if (progress == NULL) return true;
+	if (!progress->cancelled) progressReport(progress, timeMicroseconds());
+	return !progress->cancelled;
+}
 
-	ZIP_WRITE_DWORD(*data + eocd + 16, cd + offset);	// Patch central directory position
-	ZIP_WRITE_WORD(*data + eocd + 20, commentPad);		// Add comment length
+#if defined(__linux__)
+// Drop the pages behind the position in a file from the page cache: the latest chunk is queued for write-back, and the chunk before it is
+// waited for (it has usually already been written) and dropped, so that writing is not stalled and the cache is not filled with the output
+static void ioDropBehind(int fd, uint64_t position, bool written)
+{
+	uint64_t start = position > IO_CHUNK ? position - IO_CHUNK : 0;
+	if (written) sync_file_range(fd, (off_t)start, (off_t)(position - start), SYNC_FILE_RANGE_WRITE);
+	if (start == 0) return;
+	uint64_t behind = start > IO_CHUNK ? start - IO_CHUNK : 0;
+	if (written) sync_file_range(fd, (off_t)behind, (off_t)(start - behind), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, (off_t)behind, (off_t)(start - behind), POSIX_FADV_DONTNEED);
+}
+#endif
 
+// Read data from the position of an open file (paced, with progress if not NULL)
+bool fileReadData(FILE *fp, void *buffer, size_t length, progress_t *progress)
+{
+#if defined(__linux__)
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	unsigned char *p = (unsigned char *)buffer;
+	while (length > 0)
+	{
+		size_t chunk = length < ioChunkLimit() ? length : ioChunkLimit();
+		IoThrottle(chunk, 0);
+		if (fread(p, 1, chunk, fp) != chunk || !ProgressUpdate(progress, chunk)) return false;
+#if defined(__linux__)
+		if (s_io.dropCache) ioDropBehind(fileno(fp), (uint64_t)ftello(fp), false);
+#endif
+		p += chunk;
+		length -= chunk;
+	}
 	return true;
 }
 
+// Write data at the position of an open file (paced, with progress if not NULL)
+bool fileWriteData(FILE *fp, const void *buffer, size_t length, progress_t *progress)
+{
+	const unsigned char *p = (const unsigned char *)buffer;
+	while (length > 0)
+	{
+		size_t chunk = length < ioChunkLimit() ? length : ioChunkLimit();
+		IoThrottle(0, chunk);
+		if (fwrite(p, 1, chunk, fp) != chunk || !ProgressUpdate(progress, chunk)) return false;
+#if defined(__linux__)
+		if (s_io.dropCache && fflush(fp) == 0) ioDropBehind(fileno(fp), (uint64_t)ftello(fp), true);
+#endif
+		p += chunk;
+		length -= chunk;
+	}
+	return true;
+}
 
-unsigned char *generateBmp(size_t contentsLength, size_t *outHeaderSize)
+// Truncate (or extend) an open file to a length
+bool fileTruncate(FILE *fp, uint64_t length)
 {
-	// Fixed width and bits-per-pixel
-	int width = 1024;
-	int bpp = 24;
-	int span = 4 * ((width * ((bpp + 7) / 8) + 3) / 4);
+	if (fflush(fp) != 0) return false;
+#if defined(_WIN32)
+	return _chsize_s(_fileno(fp), (__int64)length) == 0;
+#else
+	return ftruncate(fileno(fp), (off_t)length) == 0;
+#endif
+}
 
-	// Determine height from file size
-	int height = (((int)contentsLength + span - 1) / span);
-	size_t fileSize = BMP_WRITER_SIZE_HEADER + height * span;
-	size_t headerSize = fileSize - contentsLength;
-	fprintf(stderr, "ZIPPAST: BMP: Read %u, Header %u, Total %u, Image %ux%u (span %u).\n", (unsigned int)contentsLength, (unsigned int)headerSize, (unsigned int)(contentsLength + headerSize), width, height, span);
+// Copy a span between files: copy_file_range() where available (no copy through user space), otherwise read/write
+bool copyFileRange(FILE *in, uint64_t inOffset, FILE *out, uint64_t outOffset, uint64_t length)
+{
+#if defined(__linux__)
+	fflush(out);
+	loff_t inPos = (loff_t)inOffset, outPos = (loff_t)outOffset;
+	while (length > 0)
+	{
+		size_t chunk = length > ioChunkLimit() ? ioChunkLimit() : (size_t)length;
+		IoThrottle(chunk, chunk);
+		ssize_t copied = copy_file_range(fileno(in), &inPos, fileno(out), &outPos, chunk, 0);
+		if (copied <= 0) break;		// e.g. not supported between these file systems: fall back for the remainder
+		length -= (uint64_t)copied;
+	}
+	inOffset = (uint64_t)inPos;
+	outOffset = (uint64_t)outPos;
+	if (length == 0) return true;
+#endif
+	const size_t chunkSize = IO_CHUNK;
+	unsigned char *buffer = (unsigned char *)malloc(chunkSize);
+	if (buffer == NULL) return false;
+	bool result = true;
+	while (result && length > 0)
+	{
+		size_t chunk = length < chunkSize ? (size_t)length : chunkSize;
+		IoThrottle(chunk, chunk);
+		result = fileRead(in, inOffset, buffer, chunk) && fileWrite(out, outOffset, buffer, chunk);
+		inOffset += chunk;
+		outOffset += chunk;
+		length -= chunk;
+	}
+	free(buffer);
+	return result;
+}
 
-	// Create header
-	unsigned char *header = (unsigned char *)malloc(headerSize);
-	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
-	memset(header, 0, headerSize);
-	BitmapWriteHeader(header, width, -height, bpp);
-	*outHeaderSize = headerSize;
-	return header;
+// Report the I/O throughput (to tune the limits)
+void IoReport(void)
+{
+	uint64_t elapsed = s_io.start ? timeMicroseconds() - s_io.start : 0;
+	double seconds = elapsed > 0 ? elapsed / 1000000.0 : 1.0;
+	fprintf(stderr, "ZIPPAST: I/O: read %.1f MiB, wrote %.1f MiB in %.2f s (%.1f MiB/s, %.0f ops/s), waited %.2f s for the limits\n", s_io.bytesRead / 1048576.0, s_io.bytesWritten / 1048576.0, elapsed / 1000000.0, (s_io.bytesRead + s_io.bytesWritten) / 1048576.0 / seconds, s_io.ops / seconds, s_io.waited / 1000000.0);
 }
 
-unsigned char *generateWav(size_t contentsLength, size_t *outHeaderSize)
+// Large buffers (file contents and generated ZIP data).  Heap allocations are counted against an optional memory budget ('-max-memory'):
+// beyond it, buffers are instead backed by an unlinked temporary spill file, and input files are mapped (copy-on-write) rather than read,
+// so that the kernel can write back or drop the pages under memory pressure rather than the process being killed.
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define ZIPPAST_MMAP
+#endif
+
+typedef struct buffer_map_tag_t
 {
-	unsigned int bitsPerSample = 8;
-	unsigned int chans = 1;
-	unsigned int freq = 44100;
-	unsigned int bytesPerSample = (bitsPerSample + 7) / 8;
-	unsigned int align = bytesPerSample * chans;
-	unsigned int numSamples = (((unsigned int)contentsLength + align - 1) / align) * align;
-	if (numSamples & 1) { numSamples++; }	// instead of trailing padding byte (as we are 1-channel, 8-bit samples)
-	unsigned int dataSize = numSamples * chans * bytesPerSample;
-	//if (dataSize & 1) dataSize++;		// trailing padding byte
-	size_t fileSize = WAV_WRITER_SIZE_HEADER + dataSize;
-	size_t headerSize = fileSize - contentsLength;
+	void *ptr;
+	size_t length;
+	void *base;					// whole mapping (may be larger than the buffer, for alignment)
+	size_t baseLength;
+	bool heap;					// a large heap buffer (anonymous memory, counted against the budget)
+	struct buffer_map_tag_t *next;
+} buffer_map_t;
 
-	fprintf(stderr, "ZIPPAST: WAV: Read %u, Header %u, Total %u, Samples %u.\n", (unsigned int)contentsLength, (unsigned int)headerSize, (unsigned int)(contentsLength + headerSize), numSamples);
+static struct
+{
+	bool initialized;
+	zippast_mutex_t mutex;
+	uint64_t limit;				// heap budget (0=unlimited)
+	uint64_t heap;				// current heap buffer bytes
+	uint64_t heapPeak;
+	uint64_t mapped;			// current mapped (spill file or input file) bytes
+	uint64_t mappedPeak;
+	buffer_map_t *maps;			// current mappings
+	bool prefault;				// large heap buffers are mapped directly (huge pages, prefaulted)
+	uint64_t largeCount;		// large heap buffers allocated
+	uint64_t hugeTlbCount;		// ...of which from reserved (explicit) huge pages
+} s_buffers;
 
-	// Create header
-	unsigned char *header = (unsigned char *)malloc(headerSize);
-	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
-	memset(header, 0, headerSize);
-	WavWriteHeader(header, bitsPerSample, chans, freq, numSamples);
-	*outHeaderSize = headerSize;
-	return header;
-}
+// Per-allocation header for heap buffers (so that the size is known when freed)
+#define BUFFER_HEADER 16
 
-// TODO: The attached .ZIP file has incorrect offsets in the central directory -- try to solve this with a second central directory within the main part of the .ZIP file
-unsigned char *generateEml(size_t contentsLength, size_t *outHeaderSize, unsigned char *comment, size_t commentPad)
+// Heap buffers from this size are mapped directly (on huge pages where possible, and prefaulted) rather than from malloc()
+#define BUFFER_LARGE (32 << 20)
+#define BUFFER_HUGE_PAGE (2 << 20)
+
+void BufferInit(uint64_t limit, bool prefault)
 {
-	const char *emlHeader =
-		"From: <zippast>\r\n"
-		//"Snapshot-Content-Location: zippast\r\n"
-		"Subject: ZIP File Attached\r\n"
-		//"Date: Thu, 01 Jan 1970 00:00:00 +0000\r\n"
-		//"MIME-Version: 1.0\r\n"
-		"Content-Type: multipart/related; type=\"text/html\"; boundary=\"" MULTIPART_BOUNDARY "\"\r\n"
-		"\r\n"
-		"--" MULTIPART_BOUNDARY "\r\n"
-		"Content-Type: text/html\r\n"
-		//"Content-ID: <_index>\r\n"
-		//"Content-Transfer-Encoding: binary\r\n"
-		//"Content-Location: index.html\r\n"
-		"\r\n"
-		"<!doctype html>\r\n"
-		"<html>\r\n"
-		"<head>\r\n"
-		"<meta charset='ISO-8859-1'>\r\n"
-		"</head>\r\n"
-		"<body>\r\n"
-		"Please open the attachment (or rename this .eml file to .zip)\r\n"
-		"</body>\r\n"
-		"</html>\r\n"
-		"\r\n"
-		"--" MULTIPART_BOUNDARY "\r\n"
-		"Content-Type: application/zip\r\n"
-		//"Content-ID: <_zip>\r\n"
-		"Content-Disposition: attachment; filename=\"file.zip\"\r\n"
-		"Content-Transfer-Encoding: binary\r\n"
-		"Content-Length: %u\r\n"
-		"\r\n"
-	;
+	if (!s_buffers.initialized) { MutexInit(&s_buffers.mutex); }
+	s_buffers.initialized = true;
+	s_buffers.limit = limit;
+	s_buffers.prefault = prefault;
+}
 
-	const char *emlFooterStart = ""
-		// "\r\n"
-		// "\r\n"
-		// "--" MULTIPART_BOUNDARY "\r\n"
-		// "Content-Type: text/plain\r\n"
-		// "\r\n"
-	;
-	const char *emlFooterEnd =
-		//"\r\n"
-		//"\r\n"
-		"--" MULTIPART_BOUNDARY "--\r\n"
-	;
+static void bufferLock(void) { if (s_buffers.initialized) MutexLock(&s_buffers.mutex); }
+static void bufferUnlock(void) { if (s_buffers.initialized) MutexUnlock(&s_buffers.mutex); }
 
-	if (commentPad >= strlen(emlFooterStart)) {
-		memcpy(comment, emlFooterStart, strlen(emlFooterStart));
-		size_t ofs = strlen(emlFooterStart), count = commentPad - strlen(emlFooterStart), mod = strlen(TEXT_STRING);
-		if (mod > 0) {
-			for (size_t i = 0; i < count; i++) {
-				comment[ofs + i] = TEXT_STRING[i % mod];
-			}
-		}
+// Reserve heap budget, false if it would be exceeded
+static bool bufferReserve(size_t size)
+{
+	bufferLock();
+	bool fits = s_buffers.limit == 0 || s_buffers.heap + size <= s_buffers.limit;
+	if (fits)
+	{
+		s_buffers.heap += size;
+		if (s_buffers.heap > s_buffers.heapPeak) s_buffers.heapPeak = s_buffers.heap;
 	}
-	if (commentPad >= strlen(emlFooterStart) + strlen(emlFooterEnd)) {
-		memcpy(comment + commentPad - strlen(emlFooterEnd), emlFooterEnd, strlen(emlFooterEnd));
+	bufferUnlock();
+	return fits;
+}
+
+#ifdef ZIPPAST_MMAP
+// Track a mapping (the whole of 'base', containing the buffer at 'ptr'), counted as mapped unless it is a large heap buffer
+static void *bufferAddMapping(void *ptr, size_t length, void *base, size_t baseLength, bool heap)
+{
+	buffer_map_t *map = (buffer_map_t *)malloc(sizeof(buffer_map_t));
+	if (map == NULL) { munmap(base, baseLength); return NULL; }
+	map->ptr = ptr;
+	map->length = length;
+	map->base = base;
+	map->baseLength = baseLength;
+	map->heap = heap;
+	bufferLock();
+	map->next = s_buffers.maps;
+	s_buffers.maps = map;
+	if (!heap)
+	{
+		s_buffers.mapped += length;
+		if (s_buffers.mapped > s_buffers.mappedPeak) s_buffers.mappedPeak = s_buffers.mapped;
 	}
+	bufferUnlock();
+	return ptr;
+}
 
-	unsigned char *header = (unsigned char *)malloc(strlen(emlHeader) + 512);
-	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
-	*outHeaderSize = sprintf((char *)header, emlHeader, contentsLength);
-	return header;
+static void *bufferAddMap(void *ptr, size_t length)
+{
+	return bufferAddMapping(ptr, length, ptr, length, false);
 }
 
-// TODO: Find a way of downloading the attached file (e.g. represent as a BMP and render to canvas if not tainted?), also solve the offset issue as with .eml files (e.g. a second central directory?)
-unsigned char *generateMhtml(size_t contentsLength, size_t *outHeaderSize, unsigned char *comment, size_t commentPad)
+// A large heap buffer: anonymous memory (already zero-filled by the kernel, so not cleared again), from reserved huge pages if there are
+// enough, otherwise aligned for transparent huge pages; prefaulted in one call, rather than taking a page fault for each page when first written
+static void *bufferLarge(size_t size)
 {
-	const char *mhtmlHeader =
-		//"From: <zippast>\r\n"
-		//"Snapshot-Content-Location: zippast\r\n"
-		//"Subject: ZIP File Attached\r\n"
-		//"Date: Thu, 01 Jan 1970 00:00:00 +0000\r\n"
-		//"MIME-Version: 1.0\r\n"
-		"Content-Type: multipart/related; type=\"text/html\"; boundary=\"" MULTIPART_BOUNDARY "\"\r\n"
-		"\r\n"
-		"--" MULTIPART_BOUNDARY "\r\n"
-		"Content-Type: text/html\r\n"
-		//"Content-ID: <_index>\r\n"
-		//"Content-Transfer-Encoding: binary\r\n"
-		//"Content-Location: index.html\r\n"
-		"\r\n"
-		"<!doctype html>\r\n"
-		"<html>\r\n"
-		"<head>\r\n"
-		"<meta charset='ISO-8859-1'>\r\n"
-		"</head>\r\n"
-		"<body>\r\n"
-		"<embed type='application/zip' src='cid:_zip'>...</embed>\r\n"
-		"</body>\r\n"
-		"</html>\r\n"
-		"\r\n"
-		"--" MULTIPART_BOUNDARY "\r\n"
-		"Content-Type: application/zip\r\n"
-		"Content-ID: <_zip>\r\n"
-		"Content-Disposition: attachment; filename=\"file.zip\"\r\n"
-		"Content-Transfer-Encoding: binary\r\n"
-		"Content-Length: %u\r\n"
-		"\r\n"
-	;
+#if defined(MAP_HUGETLB) && defined(MAP_POPULATE)
+	size_t hugeLength = (size + BUFFER_HUGE_PAGE - 1) & ~(size_t)(BUFFER_HUGE_PAGE - 1);
+	void *huge = mmap(NULL, hugeLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (huge != MAP_FAILED)
+	{
+		bufferLock(); s_buffers.largeCount++; s_buffers.hugeTlbCount++; bufferUnlock();
+		return bufferAddMapping(huge, size, huge, hugeLength, true);
+	}
+#endif
+	size_t baseLength = size + BUFFER_HUGE_PAGE;
+	unsigned char *base = (unsigned char *)mmap(NULL, baseLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == (unsigned char *)MAP_FAILED) return NULL;
+	unsigned char *ptr = (unsigned char *)(((uintptr_t)base + BUFFER_HUGE_PAGE - 1) & ~(uintptr_t)(BUFFER_HUGE_PAGE - 1));
+#if defined(MADV_HUGEPAGE)
+	madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+#if defined(MADV_POPULATE_WRITE)
+	madvise(ptr, size, MADV_POPULATE_WRITE);		// (not supported before Linux 5.14: the pages are then faulted in as they are used)
+#endif
+	bufferLock(); s_buffers.largeCount++; bufferUnlock();
+	return bufferAddMapping(ptr, size, base, baseLength, true);
+}
 
-	const char *mhtmlFooterStart = ""
-		// "\r\n"
-		// "\r\n"
-		// "--" MULTIPART_BOUNDARY "\r\n"
-		// "Content-Type: text/plain\r\n"
-		// "\r\n"
-	;
-	const char *mhtmlFooterEnd =
-		//"\r\n"
-		//"\r\n"
-		"--" MULTIPART_BOUNDARY "--\r\n"
-	;
+// A buffer backed by an unlinked temporary file
+static void *bufferSpill(size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[512];
+	snprintf(path, sizeof(path), "%s/zippast-spill-XXXXXX", (dir != NULL && dir[0] != '\0') ? dir : "/tmp");
+	int fd = mkstemp(path);
+	if (fd < 0) { perror("WARNING: Problem creating spill file"); return NULL; }
+	unlink(path);
+	void *ptr = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0) { ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); }
+	close(fd);
+	if (ptr == MAP_FAILED) { perror("WARNING: Problem mapping spill file"); return NULL; }
+	return bufferAddMap(ptr, size);
+}
+#endif
 
-	if (commentPad >= strlen(mhtmlFooterStart)) {
-		memcpy(comment, mhtmlFooterStart, strlen(mhtmlFooterStart));
-		size_t ofs = strlen(mhtmlFooterStart), count = commentPad - strlen(mhtmlFooterStart), mod = strlen(TEXT_STRING);
-		if (mod > 0) {
-			for (size_t i = 0; i < count; i++) {
-				comment[ofs + i] = TEXT_STRING[i % mod];
-			}
+void *BufferAlloc(size_t size)
+{
+	if (size == 0) size = 1;
+	if (bufferReserve(size))
+	{
+#ifdef ZIPPAST_MMAP
+		if (s_buffers.prefault && size >= BUFFER_LARGE)
+		{
+			void *large = bufferLarge(size);
+			if (large != NULL) return large;
 		}
+#endif
+		unsigned char *p = (unsigned char *)malloc(BUFFER_HEADER + size);
+		if (p != NULL) { memcpy(p, &size, sizeof(size)); return p + BUFFER_HEADER; }
+		bufferLock(); s_buffers.heap -= size; bufferUnlock();
+		return NULL;
 	}
-	if (commentPad >= strlen(mhtmlFooterStart) + strlen(mhtmlFooterEnd)) {
-		memcpy(comment + commentPad - strlen(mhtmlFooterEnd), mhtmlFooterEnd, strlen(mhtmlFooterEnd));
-	}
+#ifdef ZIPPAST_MMAP
+	return bufferSpill(size);
+#else
+	fprintf(stderr, "ERROR: Buffer of %llu bytes exceeds the memory limit.\n", (unsigned long long)size);
+	return NULL;
+#endif
+}
 
-	unsigned char *header = (unsigned char *)malloc(strlen(mhtmlHeader) + 512);
-	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
-	*outHeaderSize = sprintf((char *)header, mhtmlHeader, contentsLength);
-	return header;
+// Is the buffer mapped (rather than on the heap)?
+bool BufferIsMapped(const void *ptr)
+{
+	bool found = false;
+	bufferLock();
+	for (buffer_map_t *map = s_buffers.maps; map != NULL && !found; map = map->next) found = (map->ptr == ptr && !map->heap);
+	bufferUnlock();
+	return found;
 }
 
-unsigned char *generateHtml(size_t contentsLength, size_t *outHeaderSize)
+void BufferFree(void *ptr)
+{
+	if (ptr == NULL) return;
+#ifdef ZIPPAST_MMAP
+	bufferLock();
+	buffer_map_t **link = &s_buffers.maps;
+	while (*link != NULL && (*link)->ptr != ptr) link = &(*link)->next;
+	buffer_map_t *map = *link;
+	if (map != NULL)
+	{
+		*link = map->next;
+		if (map->heap) s_buffers.heap -= map->length;
+		else s_buffers.mapped -= map->length;
+	}
+	bufferUnlock();
+	if (map != NULL)
+	{
+		munmap(map->base, map->baseLength);
+		free(map);
+		return;
+	}
+#endif
+	unsigned char *p = (unsigned char *)ptr - BUFFER_HEADER;
+	size_t size;
+	memcpy(&size, p, sizeof(size));
+	bufferLock(); s_buffers.heap -= size; bufferUnlock();
+	free(p);
+}
+
+// Contents of an open file: read into a heap buffer if it is within the budget, otherwise mapped (copy-on-write, so it may still be modified)
+void *BufferReadFile(FILE *fp, size_t length, progress_t *progress)
+{
+#ifdef ZIPPAST_MMAP
+	bufferLock();
+	bool fits = s_buffers.limit == 0 || s_buffers.heap + length <= s_buffers.limit;
+	bufferUnlock();
+	if (!fits && length > 0)
+	{
+		void *ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+		if (ptr != MAP_FAILED)
+		{
+			madvise(ptr, length, MADV_SEQUENTIAL);
+			ProgressUpdate(progress, length);
+			return bufferAddMap(ptr, length);
+		}
+	}
+#endif
+	void *buffer = BufferAlloc(length);
+	if (buffer != NULL && (!fileSeek(fp, 0) || !fileReadData(fp, buffer, length, progress))) { perror("ERROR: Problem reading input file"); BufferFree(buffer); return NULL; }
+	return buffer;
+}
+
+// Report the peak memory used
+void BufferReport(void)
+{
+	fprintf(stderr, "ZIPPAST: Memory: peak heap buffers %.1f MiB", s_buffers.heapPeak / 1048576.0);
+	if (s_buffers.limit) fprintf(stderr, " (limit %.1f MiB)", s_buffers.limit / 1048576.0);
+	fprintf(stderr, ", peak mapped/spilled %.1f MiB", s_buffers.mappedPeak / 1048576.0);
+#ifdef ZIPPAST_MMAP
+	if (s_buffers.largeCount > 0) fprintf(stderr, ", %llu large buffer(s) (%llu on reserved huge pages)", (unsigned long long)s_buffers.largeCount, (unsigned long long)s_buffers.hugeTlbCount);
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) fprintf(stderr, ", peak RSS %.1f MiB, page faults %ld minor %ld major", usage.ru_maxrss / 1024.0, (long)usage.ru_minflt, (long)usage.ru_majflt);
+#endif
+	fprintf(stderr, "\n");
+}
+
+// Read the whole of an open file into a buffer, reusing the existing buffer if its capacity is large enough (with progress if not NULL)
+unsigned char *readStream(FILE *fp, unsigned char **buffer, size_t *capacity, size_t *outLength, progress_t *progress)
+{
+	uint64_t length = fileLength(fp);
+	if (length == UINT64_MAX) { perror("ERROR: Problem determining file length"); return NULL; }
+	ProgressStart(progress, "read", length, 0);
+	if (*buffer == NULL || *capacity < (size_t)length)
+	{
+		BufferFree(*buffer);
+		*capacity = 0;
+		*buffer = (unsigned char *)BufferReadFile(fp, (size_t)length, progress);
+		if (*buffer == NULL) { perror("ERROR: Problem allocating memory for input file"); return NULL; }
+		*capacity = (size_t)length;
+	}
+	else if (!fileSeek(fp, 0) || !fileReadData(fp, *buffer, (size_t)length, progress)) { perror("ERROR: Problem reading input file"); return NULL; }
+	if (!ProgressEnd(progress)) return NULL;
+	*outLength = (size_t)length;
+	return *buffer;
+}
+
+unsigned char *readFile(const char *filename, size_t *outLength)
+{
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) { perror("ERROR: Problem opening input file"); return NULL; }
+	unsigned char *buffer = NULL;
+	size_t capacity = 0;
+	if (readStream(fp, &buffer, &capacity, outLength, NULL) == NULL) { BufferFree(buffer); buffer = NULL; }
+	fclose(fp);
+	return buffer;
+}
+
+// Buffer sizes required (user must add 'alignment' bytes if they want padding)
+#define ZIP_WRITER_MAX_PATH 256
+#define ZIP_WRITER_SIZE_HEADER (46 + ZIP_WRITER_MAX_PATH)
+#define ZIP_WRITER_SIZE_MAX    (ZIP_WRITER_SIZE_HEADER + 6) //// max(header, footer, directory) +6 bytes for "extra field" padding header, user must add 'alignment' bytes to this length
+
+// ZIP Timestamp
+#define ZIP_DATETIME(_year, _month, _day, _hours, _minutes, _seconds) ( (((unsigned long)((_year) - 1980) & 0x7f) << 25) | (((unsigned long)(_month) & 0x0f) << 21) | (((unsigned long)(_day) & 0x1f) << 16) | (((unsigned long)(_hours) & 0x1f) << 11) | (((unsigned long)(_minutes) & 0x3f) << 5) | (((unsigned long)(_seconds) & 0x3f) >> 1))
+
+// File state tracking
+typedef struct zipwriter_file_tag_t
+{
+//private:
+	const char *filename;				// pointer to filename (must be valid when central directory entry is written)
+	int filenameLength;					// cached filename length
+	unsigned long offset;				// start file offset
+	unsigned long modified;				// modified date
+	unsigned long length;				// file length
+	int extraFieldLength;				// extra field length
+	unsigned long crc;					// CRC
+	struct zipwriter_file_tag_t *next;	// next element in linked list
+} zipwriter_file_t;
+
+// ZIP writer state tracking
+typedef struct
+{
+//private:
+	unsigned long length;				// overall ZIP file length
+	int numFiles;						// number of files
+	zipwriter_file_t *files;			// linked list of files
+	zipwriter_file_t *lastFile;			// tail of linked list
+	zipwriter_file_t *currentFile;		// current file being written
+	zipwriter_file_t *centralDirectoryFile;	// current central directory file entry being written
+	int centralDirectoryEntries;
+	unsigned long centralDirectoryOffset;
+	unsigned long centralDirectorySize;
+	int existingEntries;				// central directory entries already written by the caller (appending)
+	unsigned long alignmentBase;		// position of the ZIP data within the eventual output (for alignment)
+} zipwriter_t;
+
+// CRC-32 (reflected polynomial 0xedb88320), "slice-by-8" table-driven: eight bytes per step.
+// (There is no carry-less multiply in WebAssembly SIMD128, so large buffers are instead split across threads and recombined with crc32Combine())
+#define CRC32_INIT (0)
+static uint32_t s_crc32[8][256];
+static zippast_once_t s_crc32Once = ZIPPAST_ONCE_INIT;
+
+static void crc32Tables(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0xedb88320 & (0 - (c & 1)));
+		s_crc32[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (int t = 1; t < 8; t++) s_crc32[t][i] = (s_crc32[t - 1][i] >> 8) ^ s_crc32[0][s_crc32[t - 1][i] & 0xff];
+	}
+}
+
+// Build the tables once (the first CRC may be on any thread, e.g. extract or watch workers)
+static void crc32Init(void)
+{
+	Once(&s_crc32Once, crc32Tables);
+}
+
+static unsigned long crc32(unsigned long crc, const unsigned char *ptr, size_t buf_len)
+{
+	if (!ptr) return CRC32_INIT;
+	crc32Init();
+	uint32_t c = (~(uint32_t)crc) & 0xffffffff;
+	while (buf_len > 0 && ((uintptr_t)ptr & 7) != 0) { c = (c >> 8) ^ s_crc32[0][(c ^ *ptr++) & 0xff]; buf_len--; }
+	while (buf_len >= 8)
+	{
+		uint32_t lo = c ^ ((uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+		uint32_t hi = (uint32_t)ptr[4] | ((uint32_t)ptr[5] << 8) | ((uint32_t)ptr[6] << 16) | ((uint32_t)ptr[7] << 24);
+		c = s_crc32[7][lo & 0xff] ^ s_crc32[6][(lo >> 8) & 0xff] ^ s_crc32[5][(lo >> 16) & 0xff] ^ s_crc32[4][lo >> 24]
+		  ^ s_crc32[3][hi & 0xff] ^ s_crc32[2][(hi >> 8) & 0xff] ^ s_crc32[1][(hi >> 16) & 0xff] ^ s_crc32[0][hi >> 24];
+		ptr += 8;
+		buf_len -= 8;
+	}
+	while (buf_len--) { c = (c >> 8) ^ s_crc32[0][(c ^ *ptr++) & 0xff]; }
+	return (unsigned long)(~c & 0xffffffff);
+}
+
+// Combine CRC-32 values of two adjacent blocks, given the length of the second block (method from zlib's crc32_combine)
+static uint32_t gf2MatrixTimes(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	while (vec) { if (vec & 1) sum ^= *mat; vec >>= 1; mat++; }
+	return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++) square[n] = gf2MatrixTimes(mat, mat[n]);
+}
+
+static unsigned long crc32Combine(unsigned long crc1, unsigned long crc2, uint64_t len2)
+{
+	uint32_t even[32], odd[32];
+	if (len2 == 0) return crc1;
+
+	// Operator for one zero bit in odd, then two zero bits in even, then four zero bits in odd
+	odd[0] = 0xedb88320;
+	uint32_t row = 1;
+	for (int n = 1; n < 32; n++) { odd[n] = row; row <<= 1; }
+	gf2MatrixSquare(even, odd);
+	gf2MatrixSquare(odd, even);
+
+	// Apply len2 zeros to crc1 (first square will put the operator for one zero byte, eight zero bits, in even)
+	uint32_t c = (uint32_t)crc1;
+	do
+	{
+		gf2MatrixSquare(even, odd);
+		if (len2 & 1) c = gf2MatrixTimes(even, c);
+		len2 >>= 1;
+		if (len2 == 0) break;
+		gf2MatrixSquare(odd, even);
+		if (len2 & 1) c = gf2MatrixTimes(odd, c);
+		len2 >>= 1;
+	} while (len2 != 0);
+	return (unsigned long)(c ^ (uint32_t)crc2);
+}
+
+// CRC-32 of a large buffer, calculated in chunks across threads
+#define CRC32_PARALLEL_CHUNK (4 * 1024 * 1024)
+typedef struct
+{
+	const unsigned char *ptr;
+	size_t length;
+	unsigned long *chunkCrc;
+} crc32_parallel_t;
+
+static void crc32ParallelChunk(void *context, int index)
+{
+	crc32_parallel_t *job = (crc32_parallel_t *)context;
+	size_t start = (size_t)index * CRC32_PARALLEL_CHUNK;
+	size_t length = job->length - start < CRC32_PARALLEL_CHUNK ? job->length - start : CRC32_PARALLEL_CHUNK;
+	job->chunkCrc[index] = crc32(CRC32_INIT, job->ptr + start, length);
+}
+
+static unsigned long crc32Parallel(unsigned long crc, const unsigned char *ptr, size_t buf_len, int threads)
+{
+	int chunks = (int)((buf_len + CRC32_PARALLEL_CHUNK - 1) / CRC32_PARALLEL_CHUNK);
+	crc32_parallel_t job;
+	job.chunkCrc = (threads > 1 && chunks > 1) ? (unsigned long *)malloc(chunks * sizeof(unsigned long)) : NULL;
+	if (job.chunkCrc == NULL) return crc32(crc, ptr, buf_len);
+	crc32Init();
+	job.ptr = ptr;
+	job.length = buf_len;
+	parallelFor(chunks, threads, crc32ParallelChunk, &job);
+	for (int i = 0; i < chunks; i++)
+	{
+		size_t length = buf_len - (size_t)i * CRC32_PARALLEL_CHUNK < CRC32_PARALLEL_CHUNK ? buf_len - (size_t)i * CRC32_PARALLEL_CHUNK : CRC32_PARALLEL_CHUNK;
+		crc = crc32Combine(crc, job.chunkCrc[i], length);
+	}
+	free(job.chunkCrc);
+	return crc;
+}
+
+// Digests of the output (and optionally input), so that a separate pass to hash the written file is not needed
+#define DIGEST_SHA256 0x01
+#define DIGEST_XXH3 0x02
+
+// SHA-256 (FIPS 180-4)
+typedef struct
+{
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t blockLength;
+} sha256_t;
+
+static const uint32_t s_sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Blocks(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	for (; blocks > 0; blocks--, p += 64)
+	{
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) | ((uint32_t)p[4 * i + 2] << 8) | (uint32_t)p[4 * i + 3];
+		for (int i = 16; i < 64; i++)
+		{
+			uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++)
+		{
+			uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) + s_sha256K[i] + w[i];
+			uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+void Sha256Init(sha256_t *sha)
+{
+	static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(sha->state, initial, sizeof(initial));
+	sha->length = 0;
+	sha->blockLength = 0;
+}
+
+void Sha256Update(sha256_t *sha, const unsigned char *data, size_t length)
+{
+	sha->length += length;
+	if (sha->blockLength > 0)
+	{
+		size_t count = 64 - sha->blockLength < length ? 64 - sha->blockLength : length;
+		memcpy(sha->block + sha->blockLength, data, count);
+		sha->blockLength += count; data += count; length -= count;
+		if (sha->blockLength < 64) return;
+		sha256Blocks(sha->state, sha->block, 1);
+		sha->blockLength = 0;
+	}
+	sha256Blocks(sha->state, data, length / 64);
+	memcpy(sha->block, data + (length & ~(size_t)63), length & 63);
+	sha->blockLength = length & 63;
+}
+
+void Sha256Final(sha256_t *sha, unsigned char hash[32])
+{
+	uint64_t bits = sha->length * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t padLength = (sha->blockLength < 56 ? 56 : 120) - sha->blockLength;
+	for (int i = 0; i < 8; i++) pad[padLength + i] = (unsigned char)(bits >> (56 - 8 * i));
+	Sha256Update(sha, pad, padLength + 8);
+	for (int i = 0; i < 32; i++) hash[i] = (unsigned char)(sha->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+// XXH3 (64-bit, default secret, seed 0), streaming: each 64-byte stripe is processed once it is known not to be the final one
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH3_STRIPE 64
+#define XXH3_SECRET_SIZE 192
+#define XXH3_STRIPES_PER_BLOCK ((XXH3_SECRET_SIZE - XXH3_STRIPE) / 8)
+#define XXH3_MIDSIZE_MAX 240
+
+static const unsigned char s_xxh3Secret[XXH3_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21, 0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb, 0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+typedef struct
+{
+	uint64_t acc[8];
+	uint64_t length;
+	unsigned int stripes;					// stripes processed in the current block
+	size_t pendingLength;
+	unsigned char pending[XXH3_STRIPE];		// input not yet processed (1-64 bytes, once any stripe has been processed)
+	unsigned char last[XXH3_STRIPE];		// the most recently processed stripe
+	unsigned char start[XXH3_MIDSIZE_MAX];	// the start of the input (for short inputs)
+} xxh3_t;
+
+#if ZIPPAST_LITTLE_ENDIAN
+static inline uint32_t xxhRead32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t xxhRead64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+#else
+static inline uint32_t xxhRead32(const unsigned char *p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+static inline uint64_t xxhRead64(const unsigned char *p) { return (uint64_t)xxhRead32(p) | ((uint64_t)xxhRead32(p + 4) << 32); }
+#endif
+
+static inline uint64_t xxhRotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t xxhMul128Fold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+	uint64_t lolo = (a & 0xffffffff) * (b & 0xffffffff), hilo = (a >> 32) * (b & 0xffffffff), lohi = (a & 0xffffffff) * (b >> 32), hihi = (a >> 32) * (b >> 32);
+	uint64_t cross = (lolo >> 32) + (hilo & 0xffffffff) + lohi;
+	uint64_t upper = (hilo >> 32) + (cross >> 32) + hihi;
+	uint64_t lower = (cross << 32) | (lolo & 0xffffffff);
+	return lower ^ upper;
+#endif
+}
+
+static uint64_t xxh64Avalanche(uint64_t h)
+{
+	h ^= h >> 33; h *= XXH_PRIME64_2; h ^= h >> 29; h *= XXH_PRIME64_3; h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh3Avalanche(uint64_t h)
+{
+	h ^= h >> 37; h *= 0x165667919E3779F9ULL; h ^= h >> 32;
+	return h;
+}
+
+static uint64_t xxh3Mix16(const unsigned char *p, const unsigned char *secret)
+{
+	return xxhMul128Fold64(xxhRead64(p) ^ xxhRead64(secret), xxhRead64(p + 8) ^ xxhRead64(secret + 8));
+}
+
+// Inputs of up to 240 bytes
+static uint64_t xxh3Short(const unsigned char *p, size_t len)
+{
+	const unsigned char *secret = s_xxh3Secret;
+	if (len == 0) return xxh64Avalanche(xxhRead64(secret + 56) ^ xxhRead64(secret + 64));
+	if (len <= 3)
+	{
+		uint32_t combined = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) | (uint32_t)p[len - 1] | ((uint32_t)len << 8);
+		return xxh64Avalanche((uint64_t)combined ^ (uint64_t)(xxhRead32(secret) ^ xxhRead32(secret + 4)));
+	}
+	if (len <= 8)
+	{
+		uint64_t input = (uint64_t)xxhRead32(p + len - 4) + ((uint64_t)xxhRead32(p) << 32);
+		uint64_t h = input ^ (xxhRead64(secret + 8) ^ xxhRead64(secret + 16));
+		h ^= xxhRotl64(h, 49) ^ xxhRotl64(h, 24);
+		h *= 0x9FB21C651E98DF25ULL; h ^= (h >> 35) + len;
+		h *= 0x9FB21C651E98DF25ULL; h ^= h >> 28;
+		return h;
+	}
+	if (len <= 16)
+	{
+		uint64_t lo = xxhRead64(p) ^ (xxhRead64(secret + 24) ^ xxhRead64(secret + 32));
+		uint64_t hi = xxhRead64(p + len - 8) ^ (xxhRead64(secret + 40) ^ xxhRead64(secret + 48));
+		uint64_t swapped = 0;
+		for (int i = 0; i < 8; i++) swapped = (swapped << 8) | ((lo >> (8 * i)) & 0xff);
+		return xxh3Avalanche(len + swapped + hi + xxhMul128Fold64(lo, hi));
+	}
+	uint64_t acc = len * XXH_PRIME64_1;
+	if (len <= 128)
+	{
+		if (len > 32)
+		{
+			if (len > 64)
+			{
+				if (len > 96) { acc += xxh3Mix16(p + 48, secret + 96); acc += xxh3Mix16(p + len - 64, secret + 112); }
+				acc += xxh3Mix16(p + 32, secret + 64); acc += xxh3Mix16(p + len - 48, secret + 80);
+			}
+			acc += xxh3Mix16(p + 16, secret + 32); acc += xxh3Mix16(p + len - 32, secret + 48);
+		}
+		acc += xxh3Mix16(p, secret); acc += xxh3Mix16(p + len - 16, secret + 16);
+		return xxh3Avalanche(acc);
+	}
+	for (int i = 0; i < 8; i++) acc += xxh3Mix16(p + 16 * i, secret + 16 * i);
+	acc = xxh3Avalanche(acc);
+	for (int i = 8; i < (int)(len / 16); i++) acc += xxh3Mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+	acc += xxh3Mix16(p + len - 16, secret + 136 - 17);
+	return xxh3Avalanche(acc);
+}
+
+// One stripe into the eight 64-bit lanes (a loop the compiler can vectorize)
+static inline void xxh3Accumulate(uint64_t *acc, const unsigned char *p, const unsigned char *secret)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		uint64_t value = xxhRead64(p + 8 * i);
+		uint64_t key = value ^ xxhRead64(secret + 8 * i);
+		acc[i ^ 1] += value;
+		acc[i] += (key & 0xffffffff) * (key >> 32);
+	}
+}
+
+static inline void xxh3Scramble(uint64_t *acc)
+{
+	const unsigned char *secret = s_xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE;
+	for (int i = 0; i < 8; i++)
+	{
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= xxhRead64(secret + 8 * i);
+		acc[i] = a * XXH_PRIME32_1;
+	}
+}
+
+static void xxh3Stripes(xxh3_t *state, const unsigned char *p, size_t count)
+{
+	for (size_t n = 0; n < count; n++, p += XXH3_STRIPE)
+	{
+		xxh3Accumulate(state->acc, p, s_xxh3Secret + state->stripes * 8);
+		if (++state->stripes == XXH3_STRIPES_PER_BLOCK) { xxh3Scramble(state->acc); state->stripes = 0; }
+	}
+}
+
+void Xxh3Init(xxh3_t *state)
+{
+	static const uint64_t initial[8] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+	memcpy(state->acc, initial, sizeof(initial));
+	state->length = 0;
+	state->stripes = 0;
+	state->pendingLength = 0;
+}
+
+void Xxh3Update(xxh3_t *state, const unsigned char *data, size_t length)
+{
+	if (state->length < XXH3_MIDSIZE_MAX)
+	{
+		size_t count = XXH3_MIDSIZE_MAX - state->length < length ? XXH3_MIDSIZE_MAX - (size_t)state->length : length;
+		memcpy(state->start + state->length, data, count);
+	}
+	state->length += length;
+	if (state->pendingLength + length <= XXH3_STRIPE)
+	{
+		memcpy(state->pending + state->pendingLength, data, length);
+		state->pendingLength += length;
+		return;
+	}
+
+	// More than a stripe is available, so the pending stripe is not the last
+	if (state->pendingLength > 0)
+	{
+		size_t count = XXH3_STRIPE - state->pendingLength;
+		memcpy(state->pending + state->pendingLength, data, count);
+		data += count; length -= count;
+		xxh3Stripes(state, state->pending, 1);
+		memcpy(state->last, state->pending, XXH3_STRIPE);
+	}
+
+	// Whole stripes directly from the input, keeping 1-64 bytes pending
+	size_t stripes = (length - 1) / XXH3_STRIPE;
+	if (stripes > 0)
+	{
+		xxh3Stripes(state, data, stripes);
+		memcpy(state->last, data + (stripes - 1) * XXH3_STRIPE, XXH3_STRIPE);
+		data += stripes * XXH3_STRIPE; length -= stripes * XXH3_STRIPE;
+	}
+	memcpy(state->pending, data, length);
+	state->pendingLength = length;
+}
+
+uint64_t Xxh3Final(const xxh3_t *state)
+{
+	if (state->length <= XXH3_MIDSIZE_MAX) return xxh3Short(state->start, (size_t)state->length);
+
+	// Final stripe is the last 64 bytes of the input, which may include some of the previous stripe
+	uint64_t acc[8];
+	unsigned char last[XXH3_STRIPE];
+	memcpy(acc, state->acc, sizeof(acc));
+	memcpy(last, state->last + state->pendingLength, XXH3_STRIPE - state->pendingLength);
+	memcpy(last + XXH3_STRIPE - state->pendingLength, state->pending, state->pendingLength);
+	xxh3Accumulate(acc, last, s_xxh3Secret + XXH3_SECRET_SIZE - XXH3_STRIPE - 7);
+
+	uint64_t result = state->length * XXH_PRIME64_1;
+	for (int i = 0; i < 4; i++) result += xxhMul128Fold64(acc[2 * i] ^ xxhRead64(s_xxh3Secret + 11 + 16 * i), acc[2 * i + 1] ^ xxhRead64(s_xxh3Secret + 11 + 16 * i + 8));
+	return xxh3Avalanche(result);
+}
+
+// Selected digests
+typedef struct
+{
+	unsigned int digests;	// DIGEST_* flags
+	sha256_t sha256;
+	xxh3_t xxh3;
+} digest_t;
+
+void DigestInit(digest_t *digest, unsigned int digests)
+{
+	digest->digests = digests;
+	if (digests & DIGEST_SHA256) Sha256Init(&digest->sha256);
+	if (digests & DIGEST_XXH3) Xxh3Init(&digest->xxh3);
+}
+
+void DigestUpdate(digest_t *digest, const void *data, size_t length)
+{
+	if (digest->digests & DIGEST_SHA256) Sha256Update(&digest->sha256, (const unsigned char *)data, length);
+	if (digest->digests & DIGEST_XXH3) Xxh3Update(&digest->xxh3, (const unsigned char *)data, length);
+}
+
+// Write the digests as BSD-style lines (as checked by 'sha256sum -c' and 'xxhsum -c')
+void DigestReport(digest_t *digest, const char *name, FILE *fp)
+{
+	if (digest->digests & DIGEST_SHA256)
+	{
+		unsigned char hash[32];
+		Sha256Final(&digest->sha256, hash);
+		fprintf(fp, "SHA256 (%s) = ", name);
+		for (int i = 0; i < 32; i++) fprintf(fp, "%02x", hash[i]);
+		fprintf(fp, "\n");
+	}
+	if (digest->digests & DIGEST_XXH3)
+	{
+		fprintf(fp, "XXH3 (%s) = %016llx\n", name, (unsigned long long)Xxh3Final(&digest->xxh3));
+	}
+}
+
+// Alignment padding extra field (as used by Android's zipalign): ID, size, 16-bit alignment, then zero padding
+#define ZIP_EXTRA_ALIGNMENT_ID 0xD935
+#define ZIP_EXTRA_ALIGNMENT_MIN 6
+#define ZIP_ALIGNMENT_MAX 0x8000
+
+// Padding (extra field) length so that data at 'offset' (after the padding) is aligned
+static size_t zipAlignmentPadding(size_t offset, size_t alignment)
+{
+	if (alignment <= 1) return 0;
+	size_t padding = (alignment - offset % alignment) % alignment;
+	while (padding > 0 && padding < ZIP_EXTRA_ALIGNMENT_MIN) padding += alignment;
+	return padding;
+}
+
+// Write an alignment padding extra field of the given length (0, or at least ZIP_EXTRA_ALIGNMENT_MIN)
+static void zipWriteAlignmentExtra(unsigned char *p, size_t padding, size_t alignment)
+{
+	if (padding < ZIP_EXTRA_ALIGNMENT_MIN) return;
+	memset(p, 0, padding);
+	p[0] = (unsigned char)ZIP_EXTRA_ALIGNMENT_ID; p[1] = (unsigned char)(ZIP_EXTRA_ALIGNMENT_ID >> 8);	// Header ID
+	p[2] = (unsigned char)(padding - 4); p[3] = (unsigned char)((padding - 4) >> 8);					// Data size
+	p[4] = (unsigned char)alignment; p[5] = (unsigned char)(alignment >> 8);							// Alignment
+}
+
+void ZIPWriterInitialize(zipwriter_t *context)
+{
+	// Clear context
+	memset(context, 0, sizeof(zipwriter_t));
+}
+
+// Initialize to continue writing at an offset within an existing ZIP file (e.g. over the old central directory when appending)
+void ZIPWriterInitializeAt(zipwriter_t *context, unsigned long offset)
+{
+	ZIPWriterInitialize(context);
+	context->length = offset;
+}
+
+// Generate the ZIP local header for a file
+int ZIPWriterStartFile(zipwriter_t *context, zipwriter_file_t *file, const char *filename, unsigned long modified, int alignment, void *buffer)
+{
+	// Start writing header
+	unsigned char *p = buffer;
+
+	// Initialize file structure
+	memset(file, 0, sizeof(zipwriter_file_t));
+	file->filename = filename;		// TODO: Check length
+	file->filenameLength = (int)strlen(filename);
+	file->modified = modified;
+	file->offset = context->length;
+	file->extraFieldLength = 0;
+
+	// Calculate extra field length to match alignment (of the content within the eventual output)
+	if (alignment > 0)
+	{
+		size_t contentOffset = context->alignmentBase + file->offset + 30 + file->filenameLength;
+		file->extraFieldLength = (int)zipAlignmentPadding(contentOffset, alignment);
+	}
+
+	// Start file list, or append if we've already got one
+	if (context->centralDirectoryFile == NULL) { context->centralDirectoryFile = file; }
+	if (context->files == NULL)
+	{
+		context->files = file;
+	}
+	else
+	{
+		context->lastFile->next = file;
+	}
+
+	// Update file pointer
+	context->currentFile = file;
+	context->lastFile = file;
+	context->numFiles++;
+
+	// Local header
+	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x03; p[3] = 0x04; // Local file header signature
+	p[4] = 0x14; p[5] = 0x00;					// Version needed to extract
+	p[6] = 0x00 | (1 << 3); p[7] = 0x00;			// Flags (b3 = data descriptor)
+	p[8] = 0; p[9] = 0;							// Compression method (0=store, 8=deflated)
+	p[10] = (unsigned char)(context->currentFile->modified); p[11] = (unsigned char)(context->currentFile->modified >> 8);					// Modification time
+	p[12] = (unsigned char)(context->currentFile->modified >> 16); p[13] = (unsigned char)(context->currentFile->modified >> 24);			// Modification date
+	p[14] = 0; p[15] = 0; p[16] = 0; p[17] = 0;	// CRC32
+	p[18] = 0; p[19] = 0; p[20] = 0; p[21] = 0;	// Compressed size
+	p[22] = 0; p[23] = 0; p[24] = 0; p[25] = 0;	// Uncompressed size
+	p[26] = (unsigned char)(file->filenameLength); p[27] = (unsigned char)(file->filenameLength >> 8);		// Filename length
+	p[28] = (unsigned char)(context->currentFile->extraFieldLength); p[29] = (unsigned char)(context->currentFile->extraFieldLength >> 8);	// Extra field length
+	memcpy(p + 30, file->filename, file->filenameLength);
+	p += 30 + file->filenameLength;
+
+	// Extra field (alignment padding)
+	if (file->extraFieldLength > 0)
+	{
+		zipWriteAlignmentExtra(p, file->extraFieldLength, alignment);
+		p += file->extraFieldLength;
+	}
+
+	context->currentFile->crc = CRC32_INIT;
+
+	context->length += (int)((char *)p - (char *)buffer);
+	return (int)((char *)p - (char *)buffer);
+}
+
+// Update the context with the ZIP file data
+void ZIPWriterFileContent(zipwriter_t *context, const void *data, size_t length)
+{
+	// Update CRC
+	context->currentFile->crc = crc32(context->currentFile->crc, data, length);
+
+	// Update file and archive lengths
+	context->currentFile->length += (unsigned long)length;
+	context->length += (unsigned long)length;
+}
+
+// Update the context with ZIP file data whose CRC has already been calculated (e.g. in parallel)
+void ZIPWriterFileContentCrc(zipwriter_t *context, unsigned long crc, size_t length)
+{
+	context->currentFile->crc = crc32Combine(context->currentFile->crc, crc, length);
+	context->currentFile->length += (unsigned long)length;
+	context->length += (unsigned long)length;
+}
+
+// Generate the ZIP local header for a file
+int ZIPWriterEndFile(zipwriter_t *context, void *buffer)
+{
+	// Start writing header
+	unsigned char *p = (unsigned char *)buffer;
+
+	// Extended local header
+	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x07; p[3] = 0x08; // Extended local file header signature
+	p[4] = (unsigned char)(context->currentFile->crc); p[5] = (unsigned char)(context->currentFile->crc >> 8); p[6] = (unsigned char)(context->currentFile->crc >> 16); p[7] = (unsigned char)(context->currentFile->crc >> 24);	// CRC32
+	p[8] = (unsigned char)(context->currentFile->length); p[9] = (unsigned char)(context->currentFile->length >> 8); p[10] = (unsigned char)(context->currentFile->length >> 16); p[11] = (unsigned char)(context->currentFile->length >> 24);	// Compressed size
+	p[12] = (unsigned char)(context->currentFile->length); p[13] = (unsigned char)(context->currentFile->length >> 8); p[14] = (unsigned char)(context->currentFile->length >> 16); p[15] = (unsigned char)(context->currentFile->length >> 24);	// Uncompressed size
+	p += 16;
+
+	context->length += (int)((char *)p - (char *)buffer);
+	return (int)((char *)p - (char *)buffer);
+}
+
+// Little-endian stores of 16/32-bit values (a single unaligned store on little-endian targets)
+#if ZIPPAST_LITTLE_ENDIAN
+static inline void zipStore16(unsigned char *p, uint16_t v) { memcpy(p, &v, 2); }
+static inline void zipStore32(unsigned char *p, uint32_t v) { memcpy(p, &v, 4); }
+#else
+static inline void zipStore16(unsigned char *p, uint16_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static inline void zipStore32(unsigned char *p, uint32_t v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24); }
+#endif
+
+// Fixed fields of a central directory record
+static const unsigned char s_zipCentralDirectoryTemplate[46] = {
+	0x50, 0x4b, 0x01, 0x02,		// Central directory
+	0x14, 0x00,					// Version made by
+	0x14, 0x00,					// Version needed to extract
+	(1 << 3), 0x00,				// General purpose bit flag
+	0, 0,						// Compression method (0=store, 8=deflated)
+	0, 0, 0, 0,					// Modification time/date
+	0, 0, 0, 0,					// CRC32
+	0, 0, 0, 0,					// Compressed size
+	0, 0, 0, 0,					// Uncompressed size
+	0, 0,						// Filename length
+	0, 0,						// Extra field length (alignment padding is only in the local header)
+	0, 0,						// File comment length
+	0, 0,						// Disk number start
+	0, 0,						// Internal file attributes
+	0, 0, 0, 0,					// External file attributes
+	0, 0, 0, 0,					// Relative offset of local header
+};
+
+// Write one central directory record, returns its length
+static size_t zipWriteCentralDirectoryRecord(unsigned char *p, const zipwriter_file_t *file)
+{
+	memcpy(p, s_zipCentralDirectoryTemplate, 46);
+	zipStore32(p + 12, (uint32_t)file->modified);		// Modification time/date
+	zipStore32(p + 16, (uint32_t)file->crc);			// CRC32
+	zipStore32(p + 20, (uint32_t)file->length);			// Compressed size
+	zipStore32(p + 24, (uint32_t)file->length);			// Uncompressed size
+	zipStore16(p + 28, (uint16_t)file->filenameLength);	// Filename length
+	zipStore32(p + 42, (uint32_t)file->offset);			// Relative offset of local header
+	memcpy(p + 46, file->filename, file->filenameLength);
+	return 46 + file->filenameLength;
+}
+
+// Is this the start of the central directory?
+static void zipWriterCentralDirectoryStart(zipwriter_t *context)
+{
+	if (context->centralDirectoryEntries <= 0 && context->existingEntries <= 0)
+	{
+		context->centralDirectoryOffset = context->length;
+		context->centralDirectorySize = 0;
+	}
+}
+
+// Generate a ZIP central directory entry
+int ZIPWriterCentralDirectoryEntry(zipwriter_t *context, void *buffer)
+{
+	zipWriterCentralDirectoryStart(context);
+
+	// Are there any remaining entries?
+	if (context->centralDirectoryEntries >= context->numFiles || context->centralDirectoryFile == NULL)
+	{
+		return 0;
+	}
+
+	// Starting this entry
+	context->centralDirectoryEntries++;
+	size_t length = zipWriteCentralDirectoryRecord((unsigned char *)buffer, context->centralDirectoryFile);
+
+	// Advance to the next entry
+	context->centralDirectoryFile = context->centralDirectoryFile->next;
+
+	context->centralDirectorySize += (unsigned long)length;
+	context->length += (unsigned long)length;
+	return (int)length;
+}
+
+// Length of the remaining central directory entries (for the buffer passed to ZIPWriterCentralDirectory)
+size_t ZIPWriterCentralDirectorySize(zipwriter_t *context)
+{
+	size_t size = 0;
+	for (zipwriter_file_t *file = context->centralDirectoryFile; file != NULL; file = file->next)
+	{
+		size += 46 + file->filenameLength;
+	}
+	return size;
+}
+
+// Batched central directory: chunks of entries are written in parallel, each at its prefix-summed position
+#define ZIP_WRITER_CD_CHUNK 16384
+typedef struct
+{
+	zipwriter_file_t **files;
+	int count;
+	unsigned char *buffer;
+	size_t *chunkPosition;			// chunk sizes, then (after the prefix sum) chunk start positions
+} zipwriter_cd_t;
+
+static void zipWriterCentralDirectoryMeasure(void *context, int index)
+{
+	zipwriter_cd_t *cd = (zipwriter_cd_t *)context;
+	int end = (index + 1) * ZIP_WRITER_CD_CHUNK < cd->count ? (index + 1) * ZIP_WRITER_CD_CHUNK : cd->count;
+	size_t size = 0;
+	for (int i = index * ZIP_WRITER_CD_CHUNK; i < end; i++) size += 46 + cd->files[i]->filenameLength;
+	cd->chunkPosition[index] = size;
+}
+
+static void zipWriterCentralDirectoryChunk(void *context, int index)
+{
+	zipwriter_cd_t *cd = (zipwriter_cd_t *)context;
+	int end = (index + 1) * ZIP_WRITER_CD_CHUNK < cd->count ? (index + 1) * ZIP_WRITER_CD_CHUNK : cd->count;
+	unsigned char *p = cd->buffer + cd->chunkPosition[index];
+	for (int i = index * ZIP_WRITER_CD_CHUNK; i < end; i++) p += zipWriteCentralDirectoryRecord(p, cd->files[i]);
+}
+
+// Generate all of the remaining central directory entries into one buffer (of ZIPWriterCentralDirectorySize() bytes), returns the length written
+size_t ZIPWriterCentralDirectory(zipwriter_t *context, void *buffer, int threads)
+{
+	zipWriterCentralDirectoryStart(context);
+	int count = context->numFiles - context->centralDirectoryEntries;
+	if (count <= 0 || context->centralDirectoryFile == NULL) return 0;
+
+	size_t length = 0;
+	int chunks = (count + ZIP_WRITER_CD_CHUNK - 1) / ZIP_WRITER_CD_CHUNK;
+	zipwriter_cd_t cd;
+	cd.files = (threads > 1 && chunks > 1) ? (zipwriter_file_t **)malloc(count * sizeof(zipwriter_file_t *)) : NULL;
+	cd.chunkPosition = (cd.files != NULL) ? (size_t *)malloc(chunks * sizeof(size_t)) : NULL;
+	if (cd.chunkPosition != NULL)
+	{
+		zipwriter_file_t *file = context->centralDirectoryFile;
+		for (int i = 0; i < count; i++, file = file->next) cd.files[i] = file;
+		cd.count = count;
+		cd.buffer = (unsigned char *)buffer;
+		parallelFor(chunks, threads, zipWriterCentralDirectoryMeasure, &cd);
+		for (int c = 0; c < chunks; c++) { size_t size = cd.chunkPosition[c]; cd.chunkPosition[c] = length; length += size; }
+		parallelFor(chunks, threads, zipWriterCentralDirectoryChunk, &cd);
+	}
+	else
+	{
+		// Single-threaded (or allocation failed)
+		unsigned char *p = (unsigned char *)buffer;
+		for (zipwriter_file_t *file = context->centralDirectoryFile; file != NULL; file = file->next) p += zipWriteCentralDirectoryRecord(p, file);
+		length = (size_t)(p - (unsigned char *)buffer);
+	}
+	free(cd.files);
+	free(cd.chunkPosition);
+
+	context->centralDirectoryEntries = context->numFiles;
+	context->centralDirectoryFile = NULL;
+	context->centralDirectorySize += (unsigned long)length;
+	context->length += (unsigned long)length;
+	return length;
+}
+
+// Account for central directory entries already written by the caller at the current position (must precede any new entries)
+void ZIPWriterCentralDirectoryExisting(zipwriter_t *context, unsigned long size, int entries)
+{
+	context->centralDirectoryOffset = context->length;
+	context->centralDirectorySize = size;
+	context->existingEntries = entries;
+	context->length += size;
+}
+
+// Generate the ZIP central directory end
+int ZIPWriterCentralDirectoryEnd(zipwriter_t *context, void *buffer)
+{
+	// Start writing header
+	unsigned char *p = buffer;
+
+	// Local header
+	p[0] = 0x50; p[1] = 0x4b; p[2] = 0x05; p[3] = 0x06; // End of central directory header
+	p[4] = 0x00; p[5] = 0x00;					// Number of this disk
+	p[6] = 0x00; p[7] = 0x00;					// Number of the disk with the start of the central directory
+	p[8] = (unsigned char)(context->numFiles + context->existingEntries); p[9] = (unsigned char)((context->numFiles + context->existingEntries) >> 8);		// Number of entries in the central directory on this disk
+	p[10] = (unsigned char)(context->numFiles + context->existingEntries); p[11] = (unsigned char)((context->numFiles + context->existingEntries) >> 8);	// Total number of entries in the central directory
+	
+	p[12] = (unsigned char)(context->centralDirectorySize); p[13] = (unsigned char)(context->centralDirectorySize >> 8); p[14] = (unsigned char)(context->centralDirectorySize >> 16); p[15] = (unsigned char)(context->centralDirectorySize >> 24);			// Size of the central directory
+	p[16] = (unsigned char)(context->centralDirectoryOffset); p[17] = (unsigned char)(context->centralDirectoryOffset >> 8); p[18] = (unsigned char)(context->centralDirectoryOffset >> 16); p[19] = (unsigned char)(context->centralDirectoryOffset >> 24);	// Offset of the start of the central directory from the starting disk
+	p[20] = 0; p[21] = 0;						// ZIP file comment length
+	p += 22;
+
+	context->length += (int)((char *)p - (char *)buffer);
+	return (int)((char *)p - (char *)buffer);
+}
+
+#define ZIP_READ_WORD(p) ((p)[0] | ((p)[1] << 8))
+#define ZIP_READ_DWORD(p) ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((p)[3] << 24))
+#define ZIP_WRITE_WORD(p, v) (((p)[0]) = ((v) & 0xff), ((p)[1]) = (((v) >> 8) & 0xff))
+#define ZIP_WRITE_DWORD(p, v) (((p)[0]) = ((v) & 0xff), ((p)[1]) = (((v) >> 8) & 0xff), ((p)[2]) = (((v) >> 16) & 0xff), ((p)[3]) = (((v) >> 24) & 0xff))
+
+// Find the last position in [first, last] where a 4-byte little-endian signature occurs (the caller ensures last+3 is in range), SIZE_MAX if not found
+static size_t findSignatureReverse(const unsigned char *data, size_t first, size_t last, uint32_t signature)
+{
+	const unsigned char s0 = (unsigned char)signature, s1 = (unsigned char)(signature >> 8), s2 = (unsigned char)(signature >> 16), s3 = (unsigned char)(signature >> 24);
+	size_t p = last + 1;	// candidates remaining are [first, p)
+#if defined(__wasm_simd128__) || defined(ZIPPAST_SSE2)
+	// 16 candidate positions at a time, each vector load reads up to 3 bytes beyond the block
+	while (p >= first + 16)
+	{
+		size_t b = p - 16;
+#if defined(__wasm_simd128__)
+		v128_t m = wasm_v128_and(
+			wasm_v128_and(wasm_i8x16_eq(wasm_v128_load(data + b), wasm_i8x16_splat((char)s0)), wasm_i8x16_eq(wasm_v128_load(data + b + 1), wasm_i8x16_splat((char)s1))),
+			wasm_v128_and(wasm_i8x16_eq(wasm_v128_load(data + b + 2), wasm_i8x16_splat((char)s2)), wasm_i8x16_eq(wasm_v128_load(data + b + 3), wasm_i8x16_splat((char)s3))));
+		unsigned int mask = (unsigned int)wasm_i8x16_bitmask(m);
+#else
+		__m128i m = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + b)), _mm_set1_epi8((char)s0)), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + b + 1)), _mm_set1_epi8((char)s1))),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + b + 2)), _mm_set1_epi8((char)s2)), _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + b + 3)), _mm_set1_epi8((char)s3))));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+#endif
+		if (mask != 0)
+		{
+			int bit = 15;
+			while (!(mask & (1u << bit))) bit--;
+			return b + bit;
+		}
+		p = b;
+	}
+#endif
+	while (p > first)
+	{
+		p--;
+		if (data[p] == s0 && data[p + 1] == s1 && data[p + 2] == s2 && data[p + 3] == s3) return p;
+	}
+	return SIZE_MAX;
+}
+
+// Locate the End of central directory record (EOCD), scanning back over any whole-file comment ('dataOffset' is the position of the data within the file, if only the end of the file has been read)
+bool zipFindEocd(const unsigned char *data, size_t length, uint64_t dataOffset, size_t *outEocd)
+{
+	if (length < 22) { return false; }
+	size_t first = (length - 22 > 0xffff) ? length - 22 - 0xffff : 0;
+	size_t last = length - 22;
+	for (;;)
+	{
+		size_t eocd = findSignatureReverse(data, first, last, 0x06054b50);
+		if (eocd == SIZE_MAX) { return false; }
+		size_t commentLength = ZIP_READ_WORD(data + eocd + 20);
+		uint64_t cdSize = (uint32_t)ZIP_READ_DWORD(data + eocd + 12);
+		uint64_t cd = (uint32_t)ZIP_READ_DWORD(data + eocd + 16);
+		if (eocd + 22 + commentLength == length && cd <= dataOffset + eocd && cdSize <= dataOffset + eocd - cd)
+		{
+			*outEocd = eocd;
+			return true;
+		}
+		if (eocd == first) { return false; }
+		last = eocd - 1;
+	}
+}
+
+bool isZip(unsigned char *data, size_t length)
+{
+	size_t eocd;
+	return zipFindEocd(data, length, 0, &eocd);
+}
+
+// Copy (if 'out' is not NULL) an extra field without any alignment padding fields, returns the length kept (the whole field is kept if it is not well-formed)
+static size_t zipExtraWithoutAlignment(const unsigned char *extra, size_t length, unsigned char *out)
+{
+	size_t kept = 0;
+	for (size_t pos = 0; pos < length; )
+	{
+		if (pos + 4 > length) { kept = length; break; }
+		size_t size = 4 + (extra[pos + 2] | (extra[pos + 3] << 8));
+		if (pos + size > length) { kept = length; break; }
+		if ((extra[pos] | (extra[pos + 1] << 8)) != ZIP_EXTRA_ALIGNMENT_ID) kept += size;
+		pos += size;
+	}
+	if (out != NULL)
+	{
+		if (kept == length) { memcpy(out, extra, length); return length; }
+		unsigned char *p = out;
+		for (size_t pos = 0; pos < length; )
+		{
+			size_t size = 4 + (extra[pos + 2] | (extra[pos + 3] << 8));
+			if ((extra[pos] | (extra[pos + 1] << 8)) != ZIP_EXTRA_ALIGNMENT_ID) { memcpy(p, extra + pos, size); p += size; }
+			pos += size;
+		}
+	}
+	return kept;
+}
+
+// Entry table: the central directory parsed once into compact columns (struct-of-arrays), shared by the conversion, offset patching, index, listing and verification passes
+typedef struct
+{
+	int count;
+	size_t cd;					// central directory position (in the buffer)
+	size_t eocd;				// end of central directory record position (in the buffer)
+	size_t base;				// position of the buffer within the output file (set once offset by a header)
+	void *block;				// single allocation holding the columns
+	uint32_t *entry;			// central directory entry position (relative to the central directory)
+	uint32_t *localFile;		// local file header position (in the buffer)
+	uint32_t *crc32;
+	uint32_t *compressedSize;
+	uint32_t *uncompressedSize;
+	uint32_t *order;			// entry indexes in file order (see zipEntriesLocal)
+	uint16_t *method;			// compression method
+	uint16_t *flags;			// general purpose bit flags
+	uint16_t *nameLength;		// central directory name length (NOTE: 7-Zip uses local name, while Windows uses central name)
+	uint16_t *localNameLength;	// local header name length (see zipEntriesLocal)
+	uint16_t *localExtraLength;	// local header extra field length (see zipEntriesLocal)
+	bool local;					// local header columns and order are filled
+} zipentries_t;
+
+void zipEntriesFree(zipentries_t *entries)
+{
+	free(entries->block);
+	memset(entries, 0, sizeof(zipentries_t));
+}
+
+// Parse the central directory of the ZIP data in a buffer into the entry table
+bool zipEntriesParse(const unsigned char *data, size_t length, zipentries_t *entries)
+{
+	memset(entries, 0, sizeof(zipentries_t));
+
+	// Find End of central directory record (EOCD)
+	if (length < 22) { fprintf(stderr, "ERROR: ZIP file too small.\n"); return false; }
+	size_t eocd;
+	if (!zipFindEocd(data, length, 0, &eocd))
+	{
+		fprintf(stderr, "ERROR: ZIP file not valid or not supported.\n");
+		return false;
+	}
+	int count = ZIP_READ_WORD(data + eocd + 8);	// Number of central directory records on this disk
+	size_t cd = (uint32_t)ZIP_READ_DWORD(data + eocd + 16);		// Offset of start of central directory
+
+	size_t n = count > 0 ? count : 1;
+	unsigned char *block = (unsigned char *)malloc(n * (6 * sizeof(uint32_t) + 5 * sizeof(uint16_t)));
+	if (block == NULL) { perror("ERROR: Problem allocating entry table"); return false; }
+	entries->block = block;
+	entries->count = count;
+	entries->cd = cd;
+	entries->eocd = eocd;
+	entries->entry = (uint32_t *)block;
+	entries->localFile = entries->entry + n;
+	entries->crc32 = entries->localFile + n;
+	entries->compressedSize = entries->crc32 + n;
+	entries->uncompressedSize = entries->compressedSize + n;
+	entries->order = entries->uncompressedSize + n;
+	entries->method = (uint16_t *)(entries->order + n);
+	entries->flags = entries->method + n;
+	entries->nameLength = entries->flags + n;
+	entries->localNameLength = entries->nameLength + n;
+	entries->localExtraLength = entries->localNameLength + n;
+
+	size_t entryPosition = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const unsigned char *entry = data + cd + entryPosition;
+		if (cd + entryPosition + 46 > eocd)
+		{
+			fprintf(stderr, "ERROR: ZIP internal file positions are not valid (while scanning entry #%d).\n", i + 1);
+			zipEntriesFree(entries);
+			return false;
+		}
+		if (ZIP_READ_DWORD(entry) != 0x02014b50)
+		{
+			fprintf(stderr, "ERROR: ZIP file central directory entry #%d not valid.\n", i + 1);
+			zipEntriesFree(entries);
+			return false;
+		}
+		entries->entry[i] = (uint32_t)entryPosition;
+		entries->flags[i] = ZIP_READ_WORD(entry + 8);
+		entries->method[i] = ZIP_READ_WORD(entry + 10);
+		entries->crc32[i] = (uint32_t)ZIP_READ_DWORD(entry + 16);
+		entries->compressedSize[i] = (uint32_t)ZIP_READ_DWORD(entry + 20);
+		entries->uncompressedSize[i] = (uint32_t)ZIP_READ_DWORD(entry + 24);
+		entries->nameLength[i] = ZIP_READ_WORD(entry + 28);
+		entries->localFile[i] = (uint32_t)ZIP_READ_DWORD(entry + 42);	// Relative offset of local file header
+
+		// Advance to next central directory entry (name, extra field, comment), which must all be within the central directory
+		entryPosition += 46 + entries->nameLength[i] + ZIP_READ_WORD(entry + 30) + ZIP_READ_WORD(entry + 32);
+		if (cd + entryPosition > eocd)
+		{
+			fprintf(stderr, "ERROR: ZIP file central directory entry #%d extends past the central directory.\n", i + 1);
+			zipEntriesFree(entries);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int compareUint64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+// End of an entry's span in the buffer (start of the next entry in file order, or the central directory)
+static size_t zipEntriesEnd(const zipentries_t *entries, int position)
+{
+	return (position + 1 < entries->count) ? entries->localFile[entries->order[position + 1]] : entries->cd;
+}
+
+// Fill the file order and the local header columns of the entry table (validating that each entry fits its span)
+bool zipEntriesLocal(const unsigned char *data, zipentries_t *entries)
+{
+	if (entries->local) { return true; }
+	int count = entries->count;
+
+	// Entries in file order (central directory entries may be unordered), sorting (position, index) keys
+	uint64_t *keys = (uint64_t *)malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+	if (keys == NULL) { perror("ERROR: Problem allocating entry order"); return false; }
+	for (int i = 0; i < count; i++) { keys[i] = ((uint64_t)entries->localFile[i] << 32) | (uint32_t)i; }
+	qsort(keys, count, sizeof(uint64_t), compareUint64);
+	for (int i = 0; i < count; i++) { entries->order[i] = (uint32_t)keys[i]; }
+	free(keys);
+
+	for (int k = 0; k < count; k++)
+	{
+		int i = entries->order[k];
+		size_t localFile = entries->localFile[i];
+		size_t end = zipEntriesEnd(entries, k);
+		const unsigned char *localEntry = data + localFile;
+		if (localFile + 30 > end || ZIP_READ_DWORD(localEntry) != 0x04034b50)
+		{
+			fprintf(stderr, "ERROR: ZIP file local file header at %u not valid.\n", (unsigned int)localFile);
+			return false;
+		}
+		entries->localNameLength[i] = ZIP_READ_WORD(localEntry + 26);
+		entries->localExtraLength[i] = ZIP_READ_WORD(localEntry + 28);
+		if (localFile + 30 + entries->localNameLength[i] + entries->localExtraLength[i] + entries->compressedSize[i] > end)
+		{
+			fprintf(stderr, "ERROR: ZIP file entry at %u overlaps the next entry.\n", (unsigned int)localFile);
+			return false;
+		}
+	}
+	entries->local = true;
+	return true;
+}
+
+// Position of an entry's data in the buffer (requires zipEntriesLocal)
+static size_t zipEntriesData(const zipentries_t *entries, int i)
+{
+	return (size_t)entries->localFile[i] + 30 + entries->localNameLength[i] + entries->localExtraLength[i];
+}
+
+// Plan the layout of converted entries (requires zipEntriesLocal): each entry's new local header position, its extra field length without
+// any existing alignment padding, and with any new padding; returns false if an entry cannot be aligned
+bool zipConvertLayout(const unsigned char *data, const zipentries_t *entries, bool descriptors, size_t alignment, size_t baseOffset, uint32_t *newLocalFile, uint16_t *keptExtraLength, uint16_t *newExtraLength, size_t *outNewCd, int *outPatched, int *outAligned, bool *outUnchanged)
+{
+	int countPatched = 0, countAligned = 0;
+	bool unchanged = true;
+	size_t position = entries->localFile[entries->order[0]];		// any data before the first entry is kept
+	for (int k = 0; k < entries->count; k++)
+	{
+		int i = entries->order[k];
+		size_t localFile = entries->localFile[i];
+		size_t end = zipEntriesEnd(entries, k);
+		bool patch = descriptors && !(entries->flags[i] & (1 << 3));
+
+		keptExtraLength[i] = newExtraLength[i] = entries->localExtraLength[i];
+		if (alignment > 0 && entries->method[i] == 0)
+		{
+			keptExtraLength[i] = (uint16_t)zipExtraWithoutAlignment(data + localFile + 30 + entries->localNameLength[i], entries->localExtraLength[i], NULL);
+			size_t padding = zipAlignmentPadding(baseOffset + position + 30 + entries->localNameLength[i] + keptExtraLength[i], alignment);
+			if (keptExtraLength[i] + padding > 0xffff) { fprintf(stderr, "ERROR: Entry extra field too large to align.\n"); return false; }
+			newExtraLength[i] = (uint16_t)(keptExtraLength[i] + padding);
+			countAligned++;
+		}
+		if (patch) { countPatched++; }
+		if (newExtraLength[i] != entries->localExtraLength[i]) { unchanged = false; }
+
+		newLocalFile[i] = (uint32_t)position;
+		position += end - localFile - entries->localExtraLength[i] + newExtraLength[i] + (patch ? 16 : 0);
+	}
+	*outNewCd = position;
+	*outPatched = countPatched;
+	*outAligned = countAligned;
+	*outUnchanged = unchanged;
+	return true;
+}
+
+// Convert entries to data descriptor/extended local header ('descriptors'), and/or pad stored entries so their data is aligned within the output (where the ZIP data will be at 'baseOffset').  The entry table is updated to the new layout.
+bool zipConvert(unsigned char **data, size_t *length, zipentries_t *entries, bool descriptors, size_t alignment, size_t baseOffset)
+{
+	int numRecords = entries->count;
+	size_t cd = entries->cd;
+	size_t eocd = entries->eocd;
+	if (numRecords <= 0)
+	{
+		fprintf(stderr, "INFO: No entries to convert\n");
+		return true;
+	}
+	if (!zipEntriesLocal(*data, entries)) { return false; }
+
+	// New layout columns
+	unsigned char *block = (unsigned char *)malloc(numRecords * (sizeof(uint32_t) + 2 * sizeof(uint16_t)));
+	if (block == NULL) { perror("ERROR: Problem allocating entry table"); return false; }
+	uint32_t *newLocalFile = (uint32_t *)block;						// local file header position after conversion
+	uint16_t *keptExtraLength = (uint16_t *)(newLocalFile + numRecords);	// original extra field, without any alignment padding
+	uint16_t *newExtraLength = keptExtraLength + numRecords;			// including new alignment padding
+
+	// Plan the new layout
+	int countPatched = 0, countAligned = 0;
+	bool unchanged = true;
+	size_t newCd = 0;
+	if (!zipConvertLayout(*data, entries, descriptors, alignment, baseOffset, newLocalFile, keptExtraLength, newExtraLength, &newCd, &countPatched, &countAligned, &unchanged)) { free(block); return false; }
+	if (newCd == cd && countPatched <= 0 && unchanged)
+	{
+		fprintf(stderr, "INFO: No entries to convert (of %d)\n", numRecords);
+		free(block);
+		return true;
+	}
+	fprintf(stderr, "INFO: Converting %d/%d entries(s), aligning %d\n", countPatched, numRecords, countAligned);
+	size_t newLength = newCd + (*length - cd);
+	unsigned char *newBuffer = (unsigned char *)BufferAlloc(newLength);
+	if (newBuffer == NULL) { perror("ERROR: Problem allocating converted ZIP buffer"); free(block); return false; }
+
+	// Any data before the first entry
+	memcpy(newBuffer, *data, entries->localFile[entries->order[0]]);
+
+	for (int k = 0; k < numRecords; k++)
+	{
+		int i = entries->order[k];
+		bool patch = descriptors && !(entries->flags[i] & (1 << 3));
+		size_t nameLength = entries->localNameLength[i];
+		size_t extraLength = entries->localExtraLength[i];
+		const unsigned char *localEntry = *data + entries->localFile[i];
+		unsigned char *newEntry = newBuffer + newLocalFile[i];
+
+		// Local header and name
+		memcpy(newEntry, localEntry, 30 + nameLength);
+		ZIP_WRITE_WORD(newEntry + 28, newExtraLength[i]);
+		if (patch)
+		{
+			newEntry[6] |= (1 << 3); 				// Flags (b3 = data descriptor)
+			ZIP_WRITE_DWORD(newEntry + 14, 0);		// clear CRC
+			ZIP_WRITE_DWORD(newEntry + 18, 0);		// clear compressed size
+			ZIP_WRITE_DWORD(newEntry + 22, 0);		// clear uncompressed size
+		}
+		unsigned char *p = newEntry + 30 + nameLength;
+
+		// Extra field (with any alignment padding)
+		if (keptExtraLength[i] == extraLength && newExtraLength[i] == extraLength)
+		{
+			memcpy(p, localEntry + 30 + nameLength, extraLength);
+		}
+		else
+		{
+			zipExtraWithoutAlignment(localEntry + 30 + nameLength, extraLength, p);
+			zipWriteAlignmentExtra(p + keptExtraLength[i], newExtraLength[i] - keptExtraLength[i], alignment);
+		}
+		p += newExtraLength[i];
+
+		// File data
+		const unsigned char *content = localEntry + 30 + nameLength + extraLength;
+		memcpy(p, content, entries->compressedSize[i]);
+		p += entries->compressedSize[i];
+
+		// Add extended local file header
+		if (patch)
+		{
+			ZIP_WRITE_DWORD(p + 0, 0x08074b50); // Extended local file header signature
+			ZIP_WRITE_DWORD(p + 4, entries->crc32[i]);
+			ZIP_WRITE_DWORD(p + 8, entries->compressedSize[i]);
+			ZIP_WRITE_DWORD(p + 12, entries->uncompressedSize[i]);
+			p += 16;
+		}
+
+		// Remainder of the entry's span (e.g. an existing data descriptor)
+		const unsigned char *rest = content + entries->compressedSize[i];
+		memcpy(p, rest, *data + zipEntriesEnd(entries, k) - rest);
+	}
+
+	// Copy central directory and end record, with adjusted positions
+	memcpy(newBuffer + newCd, *data + cd, *length - cd);
+	for (int i = 0; i < numRecords; i++)
+	{
+		unsigned char *entry = newBuffer + newCd + entries->entry[i];
+		ZIP_WRITE_DWORD(entry + 42, newLocalFile[i]);
+		if (descriptors && !(entries->flags[i] & (1 << 3)))
+		{
+			// Patching: add to general purpose bit flag
+			entry[8] |= (1 << 3);
+			entries->flags[i] |= (1 << 3);
+		}
+		entries->localFile[i] = newLocalFile[i];
+		entries->localExtraLength[i] = newExtraLength[i];
+	}
+fprintf(stderr, "INFO: Post-conversion adjustment of EOCD CD position by %d\n", (int)(newCd - cd));
+	ZIP_WRITE_DWORD(newBuffer + newCd + (eocd - cd) + 16, newCd);	// Patch central directory position
+	entries->cd = newCd;
+	entries->eocd = newCd + (eocd - cd);
+
+	free(block);
+	BufferFree(*data);
+	*data = newBuffer;
+	*length = newLength;
+	return true;
+}
+
+
+// Patch the offsets in the specified ZIP file data's central directory
+bool zipOffsets(unsigned char **data, size_t *length, zipentries_t *entries, size_t headerSize, size_t commentPad)
+{
+	size_t offset = headerSize; 
+
+	fprintf(stderr, "INFO: Offsetting .ZIP by %u (+%u end comment)\n", (unsigned int)headerSize, (unsigned int)commentPad);
+
+	// Patch local file offset positions (from the table, rather than re-parsing the central directory)
+	unsigned char *cd = *data + entries->cd;
+	for (int i = 0; i < entries->count; i++)
+	{
+		ZIP_WRITE_DWORD(cd + entries->entry[i] + 42, entries->localFile[i] + offset);
+	}
+
+	ZIP_WRITE_DWORD(*data + entries->eocd + 16, entries->cd + offset);	// Patch central directory position
+	ZIP_WRITE_WORD(*data + entries->eocd + 20, commentPad);		// Add comment length
+	*length = entries->eocd + 22;								// Any existing whole-file comment is replaced by the comment pad
+	entries->base = offset;
+
+	return true;
+}
+
+
+// Deflate (raw deflate encoder): LZ77 matching on hash chains (with one-step lazy evaluation), emitted as dynamic Huffman, fixed Huffman or stored
+// blocks, whichever is smallest.  A span of a buffer is compressed on its own, with the preceding 32 kB as its dictionary, so that the spans of an
+// entry can be compressed in parallel and their outputs concatenated into one stream (each non-final span ends byte-aligned with an empty stored block).
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_CHAIN 48
+#define DEFLATE_LAZY 32				// matches at least this long are taken without checking the next position
+#define DEFLATE_BLOCK_SYMBOLS 16384
+
+static const short s_lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short s_lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short s_distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short s_distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const unsigned char s_codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+typedef struct
+{
+	unsigned char *out;
+	size_t outLength;
+	size_t outPos;
+	uint64_t bitBuffer;
+	int bitCount;
+	bool overflow;				// output did not fit
+	uint32_t head[1 << DEFLATE_HASH_BITS];	// most recent position (+1) with each hash (0=none)
+	uint32_t prev[DEFLATE_WINDOW];			// previous position (+1) with the same hash, by position within the window
+	uint16_t value[DEFLATE_BLOCK_SYMBOLS];	// literal byte, or match length
+	uint16_t dist[DEFLATE_BLOCK_SYMBOLS];	// match distance (0=literal)
+	int symbols;
+} deflate_t;
+
+static void deflateBits(deflate_t *s, uint32_t value, int count)
+{
+	s->bitBuffer |= (uint64_t)value << s->bitCount;
+	s->bitCount += count;
+	while (s->bitCount >= 8)
+	{
+		if (s->outPos < s->outLength) s->out[s->outPos++] = (unsigned char)s->bitBuffer;
+		else s->overflow = true;
+		s->bitBuffer >>= 8;
+		s->bitCount -= 8;
+	}
+}
+
+static int deflateLengthCode(int length)
+{
+	int code = 28;
+	while (s_lengthBase[code] > length) code--;
+	return code;
+}
+
+static int deflateDistCode(int dist)
+{
+	int code = 29;
+	while (s_distBase[code] > dist) code--;
+	return code;
+}
+
+// Huffman code lengths (of at most 'limit' bits) for symbol frequencies: a tree is built from the sorted leaves with two queues, and if it is
+// too deep, the frequencies are flattened and it is built again.  At least two symbols are given codes, so that the code is complete.
+static void deflateLengths(const uint32_t *frequencies, int n, int limit, uint8_t *lengths)
+{
+	uint32_t freq[288];
+	uint64_t leaves[288];
+	uint32_t weight[2 * 288];
+	int parent[2 * 288];
+	uint8_t depth[2 * 288];
+	memcpy(freq, frequencies, n * sizeof(uint32_t));
+	int used = 0;
+	for (int i = 0; i < n; i++) if (freq[i] > 0) used++;
+	for (int i = 0; used < 2 && i < n; i++) if (freq[i] == 0) { freq[i] = 1; used++; }
+	for (;;)
+	{
+		int m = 0;
+		for (int i = 0; i < n; i++) if (freq[i] > 0) leaves[m++] = ((uint64_t)freq[i] << 16) | (uint32_t)i;
+		if (m < 2) { memset(lengths, 0, n); if (m == 1) lengths[leaves[0] & 0xffff] = 1; return; }
+		qsort(leaves, m, sizeof(uint64_t), compareUint64);
+		for (int i = 0; i < m; i++) weight[i] = (uint32_t)(leaves[i] >> 16);
+
+		// Combine the two lightest nodes (leaves in order, then internal nodes, which are created in order of weight)
+		int leaf = 0, node = m, next = m;
+		for (int k = 0; k < m - 1; k++)
+		{
+			int pick[2];
+			for (int j = 0; j < 2; j++) pick[j] = (leaf < m && (node >= next || weight[leaf] <= weight[node])) ? leaf++ : node++;
+			weight[next] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = parent[pick[1]] = next;
+			next++;
+		}
+		depth[next - 1] = 0;
+		int maxDepth = 0;
+		for (int i = next - 2; i >= 0; i--)
+		{
+			depth[i] = depth[parent[i]] + 1;
+			if (i < m && depth[i] > maxDepth) maxDepth = depth[i];
+		}
+		if (maxDepth <= limit)
+		{
+			memset(lengths, 0, n);
+			for (int i = 0; i < m; i++) lengths[leaves[i] & 0xffff] = depth[i];
+			return;
+		}
+		for (int i = 0; i < n; i++) if (freq[i] > 0) freq[i] = (freq[i] >> 1) | 1;
+	}
+}
+
+// Canonical codes (bit-reversed, as sent) for code lengths
+static void deflateCodes(const uint8_t *lengths, int n, uint16_t *codes)
+{
+	int count[16] = { 0 }, next[16];
+	for (int i = 0; i < n; i++) count[lengths[i]]++;
+	count[0] = 0;
+	int code = 0;
+	for (int len = 1; len < 16; len++) { code = (code + count[len - 1]) << 1; next[len] = code; }
+	for (int i = 0; i < n; i++)
+	{
+		if (lengths[i] == 0) { codes[i] = 0; continue; }
+		int c = next[lengths[i]]++, reversed = 0;
+		for (int b = 0; b < lengths[i]; b++) { reversed = (reversed << 1) | (c & 1); c >>= 1; }
+		codes[i] = (uint16_t)reversed;
+	}
+}
+
+// Emit the pending symbols (covering the input from 'blockStart' to 'blockEnd') as the smallest type of block
+static void deflateBlock(deflate_t *s, const unsigned char *data, size_t blockStart, size_t blockEnd, bool last)
+{
+	uint32_t litFreq[286] = { 0 }, distFreq[30] = { 0 };
+	uint64_t extraBits = 0;
+	for (int i = 0; i < s->symbols; i++)
+	{
+		if (s->dist[i] == 0) { litFreq[s->value[i]]++; continue; }
+		int lc = deflateLengthCode(s->value[i]), dc = deflateDistCode(s->dist[i]);
+		litFreq[257 + lc]++;
+		distFreq[dc]++;
+		extraBits += s_lengthExtra[lc] + s_distExtra[dc];
+	}
+	litFreq[256] = 1;
+
+	// Dynamic: code lengths, and the run-length encoded code lengths (16=repeat previous 3-6, 17=zeros 3-10, 18=zeros 11-138)
+	uint8_t litLengths[286], distLengths[30], all[286 + 30], clLengths[19];
+	deflateLengths(litFreq, 286, 15, litLengths);
+	deflateLengths(distFreq, 30, 15, distLengths);
+	int hlit = 286, hdist = 30;
+	while (hlit > 257 && litLengths[hlit - 1] == 0) hlit--;
+	while (hdist > 1 && distLengths[hdist - 1] == 0) hdist--;
+	memcpy(all, litLengths, hlit);
+	memcpy(all + hlit, distLengths, hdist);
+	uint8_t rle[286 + 30], rleExtra[286 + 30];
+	int runs = 0;
+	uint32_t clFreq[19] = { 0 };
+	for (int i = 0; i < hlit + hdist; )
+	{
+		int run = 1;
+		while (i + run < hlit + hdist && all[i + run] == all[i]) run++;
+		if (all[i] == 0 && run >= 3)
+		{
+			if (run > 138) run = 138;
+			rle[runs] = run >= 11 ? 18 : 17;
+			rleExtra[runs++] = (uint8_t)(run >= 11 ? run - 11 : run - 3);
+		}
+		else if (all[i] != 0 && run >= 4)
+		{
+			rle[runs] = all[i]; rleExtra[runs++] = 0;
+			run = run - 1 > 6 ? 6 : run - 1;
+			rle[runs] = 16; rleExtra[runs++] = (uint8_t)(run - 3);
+			run++;
+		}
+		else
+		{
+			run = 1;
+			rle[runs] = all[i]; rleExtra[runs++] = 0;
+		}
+		clFreq[rle[runs - 1]]++;
+		if (rle[runs - 1] == 16) clFreq[all[i]]++;
+		i += run;
+	}
+	deflateLengths(clFreq, 19, 7, clLengths);
+	int hclen = 19;
+	while (hclen > 4 && clLengths[s_codeLengthOrder[hclen - 1]] == 0) hclen--;
+
+	uint8_t fixedLengths[288 + 30];
+	for (int i = 0; i < 288; i++) fixedLengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (int i = 0; i < 30; i++) fixedLengths[288 + i] = 5;
+
+	uint64_t dynamicBits = 3 + 14 + 3 * hclen + extraBits, fixedBits = 3 + extraBits;
+	for (int i = 0; i < runs; i++) dynamicBits += clLengths[rle[i]] + (rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : rle[i] == 18 ? 7 : 0);
+	for (int i = 0; i < 286; i++) { dynamicBits += (uint64_t)litFreq[i] * litLengths[i]; fixedBits += (uint64_t)litFreq[i] * fixedLengths[i]; }
+	for (int i = 0; i < 30; i++) { dynamicBits += (uint64_t)distFreq[i] * distLengths[i]; fixedBits += (uint64_t)distFreq[i] * 5; }
+	size_t storedLength = blockEnd - blockStart;
+	uint64_t storedBits = 3 + 7 + ((uint64_t)storedLength + 4 * ((storedLength + 65534) / 65535 + (storedLength == 0))) * 8 + 3 * ((storedLength + 65534) / 65535);
+
+	if (storedBits < dynamicBits && storedBits < fixedBits)
+	{
+		// Stored, in pieces of up to 65535 bytes
+		size_t position = blockStart;
+		do
+		{
+			size_t piece = blockEnd - position > 65535 ? 65535 : blockEnd - position;
+			deflateBits(s, (last && position + piece == blockEnd) ? 1 : 0, 3);
+			if (s->bitCount > 0) deflateBits(s, 0, 8 - s->bitCount);
+			deflateBits(s, (uint32_t)piece, 16);
+			deflateBits(s, (uint32_t)piece ^ 0xffff, 16);
+			if (s->outPos + piece > s->outLength) { s->overflow = true; break; }
+			memcpy(s->out + s->outPos, data + position, piece);
+			s->outPos += piece;
+			position += piece;
+		} while (position < blockEnd);
+		s->symbols = 0;
+		return;
+	}
+
+	uint16_t litCodes[288], distCodes[30], clCodes[19];
+	const uint8_t *useLit = litLengths, *useDist = distLengths;
+	if (fixedBits <= dynamicBits)
+	{
+		useLit = fixedLengths;
+		useDist = fixedLengths + 288;
+		deflateCodes(useLit, 288, litCodes);
+		deflateCodes(useDist, 30, distCodes);
+		deflateBits(s, last ? 1 : 0, 1);
+		deflateBits(s, 1, 2);
+	}
+	else
+	{
+		deflateCodes(litLengths, 286, litCodes);
+		deflateCodes(distLengths, 30, distCodes);
+		deflateCodes(clLengths, 19, clCodes);
+		deflateBits(s, last ? 1 : 0, 1);
+		deflateBits(s, 2, 2);
+		deflateBits(s, hlit - 257, 5);
+		deflateBits(s, hdist - 1, 5);
+		deflateBits(s, hclen - 4, 4);
+		for (int i = 0; i < hclen; i++) deflateBits(s, clLengths[s_codeLengthOrder[i]], 3);
+		for (int i = 0; i < runs; i++)
+		{
+			deflateBits(s, clCodes[rle[i]], clLengths[rle[i]]);
+			if (rle[i] >= 16) deflateBits(s, rleExtra[i], rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+		}
+	}
+	for (int i = 0; i < s->symbols; i++)
+	{
+		if (s->dist[i] == 0) { deflateBits(s, litCodes[s->value[i]], useLit[s->value[i]]); continue; }
+		int lc = deflateLengthCode(s->value[i]), dc = deflateDistCode(s->dist[i]);
+		deflateBits(s, litCodes[257 + lc], useLit[257 + lc]);
+		if (s_lengthExtra[lc] > 0) deflateBits(s, s->value[i] - s_lengthBase[lc], s_lengthExtra[lc]);
+		deflateBits(s, distCodes[dc], useDist[dc]);
+		if (s_distExtra[dc] > 0) deflateBits(s, s->dist[i] - s_distBase[dc], s_distExtra[dc]);
+	}
+	deflateBits(s, litCodes[256], useLit[256]);
+	s->symbols = 0;
+}
+
+static uint32_t deflateHash(const unsigned char *p)
+{
+	return ((uint32_t)(p[0] | (p[1] << 8) | (p[2] << 16)) * 2654435761U) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static void deflateInsert(deflate_t *s, const unsigned char *data, size_t position, size_t end)
+{
+	if (position + 3 > end) return;
+	uint32_t hash = deflateHash(data + position);
+	s->prev[position & (DEFLATE_WINDOW - 1)] = s->head[hash];
+	s->head[hash] = (uint32_t)position + 1;
+}
+
+// Longest match for a position (of at least 3 bytes, not past 'end'), returns its length (0=none) and distance
+static int deflateMatch(deflate_t *s, const unsigned char *data, size_t position, size_t end, int *outDist)
+{
+	if (position + 3 > end) return 0;
+	size_t maxLength = end - position > 258 ? 258 : end - position;
+	size_t best = 2;
+	uint32_t candidate = s->head[deflateHash(data + position)];
+	for (int chain = DEFLATE_MAX_CHAIN; candidate > 0 && chain > 0; chain--)
+	{
+		size_t match = candidate - 1;
+		if (match >= position || position - match > DEFLATE_WINDOW) break;
+		if (data[match + best] == data[position + best])
+		{
+			size_t length = 0;
+			while (length < maxLength && data[match + length] == data[position + length]) length++;
+			if (length > best) { best = length; *outDist = (int)(position - match); if (length == maxLength) break; }
+		}
+		uint32_t next = s->prev[match & (DEFLATE_WINDOW - 1)];
+		if (next >= candidate) break;		// (overwritten by a later position)
+		candidate = next;
+	}
+	return best >= 3 ? (int)best : 0;
+}
+
+static void deflateSymbol(deflate_t *s, const unsigned char *data, size_t *blockStart, size_t position, int value, int dist, int length)
+{
+	s->value[s->symbols] = (uint16_t)value;
+	s->dist[s->symbols] = (uint16_t)dist;
+	if (++s->symbols >= DEFLATE_BLOCK_SYMBOLS)
+	{
+		deflateBlock(s, data, *blockStart, position + length, false);
+		*blockStart = position + length;
+	}
+}
+
+// Deflate data[start, end) into 'out' (using data from up to 32 kB before 'start' as the dictionary), ending the stream if 'last', otherwise
+// ending byte-aligned so that the next span's output can follow; returns the output length, or 0 if it does not fit in 'outLength'
+size_t deflateSpan(const unsigned char *data, size_t start, size_t end, bool last, unsigned char *out, size_t outLength)
+{
+	deflate_t *s = (deflate_t *)malloc(sizeof(deflate_t));
+	if (s == NULL) return 0;
+	memset(s->head, 0, sizeof(s->head));
+	s->out = out;
+	s->outLength = outLength;
+	s->outPos = 0;
+	s->bitBuffer = 0;
+	s->bitCount = 0;
+	s->overflow = false;
+	s->symbols = 0;
+	for (size_t p = start > DEFLATE_WINDOW ? start - DEFLATE_WINDOW : 0; p < start; p++) deflateInsert(s, data, p, end);
+
+	size_t blockStart = start;
+	for (size_t p = start; p < end && !s->overflow; )
+	{
+		int dist = 0;
+		int length = deflateMatch(s, data, p, end, &dist);
+		deflateInsert(s, data, p, end);
+		if (length > 0 && length < DEFLATE_LAZY)
+		{
+			// A longer match at the next position is better than this one
+			int nextDist = 0;
+			int nextLength = deflateMatch(s, data, p + 1, end, &nextDist);
+			if (nextLength > length)
+			{
+				deflateSymbol(s, data, &blockStart, p, data[p], 0, 1);
+				p++;
+				deflateInsert(s, data, p, end);
+				length = nextLength;
+				dist = nextDist;
+			}
+		}
+		if (length == 0)
+		{
+			deflateSymbol(s, data, &blockStart, p, data[p], 0, 1);
+			p++;
+			continue;
+		}
+		deflateSymbol(s, data, &blockStart, p, length, dist, length);
+		for (size_t i = p + 1; i < p + length; i++) deflateInsert(s, data, i, end);
+		p += length;
+	}
+	if (s->symbols > 0 || blockStart < end || last) deflateBlock(s, data, blockStart, end, last);
+	if (!last)
+	{
+		// Empty stored block (byte-aligned)
+		deflateBits(s, 0, 3);
+		if (s->bitCount > 0) deflateBits(s, 0, 8 - s->bitCount);
+		deflateBits(s, 0xffff0000, 32);
+	}
+	else if (s->bitCount > 0) deflateBits(s, 0, 8 - s->bitCount);
+	size_t result = s->overflow ? 0 : s->outPos;
+	free(s);
+	return result;
+}
+
+// Estimated entropy (bits per byte) of a buffer, from the byte histogram of up to 8 evenly spaced 4 kB samples
+static double log2Approx(double x)
+{
+	int exponent = 0;
+	while (x >= 2.0) { x *= 0.5; exponent++; }
+	while (x < 1.0) { x *= 2.0; exponent--; }
+	return exponent + (-0.34484843 * x + 2.02466578) * x - 0.67487759;		// (within 0.005)
+}
+
+double sampleEntropy(const unsigned char *data, size_t length)
+{
+	uint32_t histogram[256] = { 0 };
+	const size_t sampleSize = 4096;
+	int samples = length > 8 * sampleSize ? 8 : (int)((length + sampleSize - 1) / sampleSize);
+	uint32_t total = 0;
+	for (int i = 0; i < samples; i++)
+	{
+		size_t start = samples > 1 ? (length - sampleSize) / (samples - 1) * i : 0;
+		size_t end = start + sampleSize < length ? start + sampleSize : length;
+		for (size_t p = start; p < end; p++) histogram[data[p]]++;
+		total += (uint32_t)(end - start);
+	}
+	if (total == 0) return 0;
+	double sum = 0;
+	for (int i = 0; i < 256; i++) if (histogram[i] > 0) sum += histogram[i] * log2Approx(histogram[i]);
+	return log2Approx(total) - sum / total;
+}
+
+// Repack: deflate stored entries of at least a minimum size (unless a sample of their bytes looks incompressible), in parallel chunks, keeping
+// any that do not shrink.  Entries are processed in batches in file order: each batch is deflated, then compacted in place (entries only move
+// towards the start, so later entries are not disturbed), before the next.  The local headers, data descriptors and central directory are
+// updated, and the entry table is re-parsed afterwards.
+#define REPACK_CHUNK (1024 * 1024)
+#define REPACK_BATCH (64 * 1024 * 1024)	// candidate bytes deflated before compacting
+#define REPACK_ENTROPY_MAX 7.5		// bits per byte
+
+typedef struct
+{
+	int entry;
+	size_t start;				// within the entry data
+	size_t end;
+	bool last;
+	unsigned char *out;			// (within the entry's region)
+	size_t capacity;
+	size_t outLength;			// (0=failed)
+} repack_chunk_t;
+
+typedef struct
+{
+	const unsigned char *data;
+	const zipentries_t *entries;
+	repack_chunk_t *chunks;
+	progress_t *progress;
+	zippast_mutex_t mutex;
+	volatile bool cancelled;
+} repack_t;
+
+static void repackWorker(void *context, int index)
+{
+	repack_t *repack = (repack_t *)context;
+	repack_chunk_t *chunk = &repack->chunks[index];
+	if (repack->cancelled) return;
+	const unsigned char *content = repack->data + zipEntriesData(repack->entries, chunk->entry);
+	if (chunk->out != NULL) chunk->outLength = deflateSpan(content, chunk->start, chunk->end, chunk->last, chunk->out, chunk->capacity);
+	MutexLock(&repack->mutex);
+	if (!ProgressUpdate(repack->progress, chunk->end - chunk->start)) repack->cancelled = true;
+	MutexUnlock(&repack->mutex);
+}
+
+static size_t repackCapacity(size_t length)
+{
+	return length + length / 1024 + 64;
+}
+
+bool zipRepack(unsigned char *data, size_t *length, zipentries_t *entries, size_t minSize, int threads, progress_t *progress)
+{
+	if (entries->count <= 0) return true;
+	if (!zipEntriesLocal(data, entries)) return false;
+
+	// Candidates, and their chunks (numbered in file order)
+	int count = entries->count, chunkCount = 0, candidates = 0;
+	uint64_t candidateBytes = 0;
+	int *firstChunk = (int *)malloc((count + 1) * sizeof(int));		// (by file position)
+	size_t *newSize = (size_t *)malloc(count * sizeof(size_t));
+	if (firstChunk == NULL || newSize == NULL) { perror("ERROR: Problem allocating repack"); free(firstChunk); free(newSize); return false; }
+	for (int k = 0; k < count; k++)
+	{
+		int i = entries->order[k];
+		size_t size = entries->compressedSize[i];
+		bool candidate = entries->method[i] == 0 && !(entries->flags[i] & 1) && size >= minSize && size > 0 && size == entries->uncompressedSize[i];
+		if (candidate && sampleEntropy(data + zipEntriesData(entries, i), size) > REPACK_ENTROPY_MAX) candidate = false;
+		firstChunk[k] = chunkCount;
+		newSize[i] = 0;
+		if (!candidate) continue;
+		chunkCount += (int)((size + REPACK_CHUNK - 1) / REPACK_CHUNK);
+		candidateBytes += size;
+		candidates++;
+	}
+	firstChunk[count] = chunkCount;
+	if (chunkCount == 0) { free(firstChunk); free(newSize); return true; }
+
+	repack_t repack;
+	memset(&repack, 0, sizeof(repack));
+	repack.data = data;
+	repack.entries = entries;
+	repack.progress = progress;
+	repack_chunk_t *chunks = (repack_chunk_t *)calloc(chunkCount, sizeof(repack_chunk_t));
+	unsigned char **region = (unsigned char **)calloc(count, sizeof(unsigned char *));		// (by file position)
+	if (chunks == NULL || region == NULL) { perror("ERROR: Problem allocating repack"); free(chunks); free(region); free(firstChunk); free(newSize); return false; }
+	ProgressStart(progress, "repack", candidateBytes, (uint32_t)candidates);
+	MutexInit(&repack.mutex);
+
+	int repacked = 0;
+	uint64_t saved = 0;
+	size_t position = entries->localFile[entries->order[0]];
+	for (int k = 0; k < count && !repack.cancelled; )
+	{
+		// Batch: the next entries in file order, up to a total size of candidates (at least one)
+		int batchEnd = k;
+		uint64_t batchBytes = 0;
+		while (batchEnd < count)
+		{
+			size_t size = (firstChunk[batchEnd + 1] > firstChunk[batchEnd]) ? entries->compressedSize[entries->order[batchEnd]] : 0;
+			if (batchBytes > 0 && batchBytes + size > REPACK_BATCH) break;
+			batchBytes += size;
+			batchEnd++;
+		}
+
+		// One region per entry (a buffer counted against the memory limit), with each chunk deflated at its own offset within it
+		for (int b = k; b < batchEnd; b++)
+		{
+			if (firstChunk[b + 1] == firstChunk[b]) continue;
+			int i = entries->order[b];
+			size_t capacity = 0;
+			for (int c = firstChunk[b]; c < firstChunk[b + 1]; c++)
+			{
+				chunks[c].entry = i;
+				chunks[c].start = (size_t)(c - firstChunk[b]) * REPACK_CHUNK;
+				chunks[c].end = chunks[c].start + REPACK_CHUNK < entries->compressedSize[i] ? chunks[c].start + REPACK_CHUNK : entries->compressedSize[i];
+				chunks[c].last = (c + 1 == firstChunk[b + 1]);
+				chunks[c].capacity = repackCapacity(chunks[c].end - chunks[c].start);
+				capacity += chunks[c].capacity;
+			}
+			region[b] = (unsigned char *)BufferAlloc(capacity);
+			size_t offset = 0;
+			for (int c = firstChunk[b]; c < firstChunk[b + 1] && region[b] != NULL; c++) { chunks[c].out = region[b] + offset; offset += chunks[c].capacity; }
+		}
+		repack.chunks = chunks + firstChunk[k];
+		parallelFor(firstChunk[batchEnd] - firstChunk[k], threads, repackWorker, &repack);
+
+		// Compact the batch in place, in file order (each entry only moves towards the start)
+		for (; k < batchEnd && !repack.cancelled; k++)
+		{
+			int i = entries->order[k];
+			size_t localFile = entries->localFile[i];
+			size_t end = zipEntriesEnd(entries, k);
+			entries->localFile[i] = (uint32_t)position;
+			size_t size = 0;
+			bool complete = (firstChunk[k + 1] > firstChunk[k]);
+			for (int c = firstChunk[k]; c < firstChunk[k + 1]; c++) { size += chunks[c].outLength; if (chunks[c].outLength == 0) complete = false; }
+			if (!complete || size >= entries->compressedSize[i])
+			{
+				if (position != localFile) memmove(data + position, data + localFile, end - localFile);
+				position += end - localFile;
+				BufferFree(region[k]);
+				region[k] = NULL;
+				continue;
+			}
+			newSize[i] = size;
+			saved += entries->compressedSize[i] - size;
+			repacked++;
+			size_t headerLength = 30 + entries->localNameLength[i] + entries->localExtraLength[i];
+			size_t dataEnd = localFile + headerLength + entries->compressedSize[i];
+			memmove(data + position, data + localFile, headerLength);
+			unsigned char *local = data + position;
+			if (ZIP_READ_WORD(local + 4) < 20) ZIP_WRITE_WORD(local + 4, 20);	// Version needed to extract (deflate)
+			ZIP_WRITE_WORD(local + 8, 8);										// Compression method (deflated)
+			if (!(entries->flags[i] & (1 << 3)) || ZIP_READ_DWORD(local + 18) != 0) ZIP_WRITE_DWORD(local + 18, newSize[i]);	// Compressed size (unless deferred to the descriptor)
+			position += headerLength;
+			for (int c = firstChunk[k]; c < firstChunk[k + 1]; c++)
+			{
+				memcpy(data + position, chunks[c].out, chunks[c].outLength);
+				position += chunks[c].outLength;
+			}
+			BufferFree(region[k]);
+			region[k] = NULL;
+			memmove(data + position, data + dataEnd, end - dataEnd);
+			if ((entries->flags[i] & (1 << 3)) && end - dataEnd >= 12)
+			{
+				// Data descriptor (with or without its signature)
+				size_t sizeField = ZIP_READ_DWORD(data + position) == 0x08074b50 ? 8 : 4;
+				ZIP_WRITE_DWORD(data + position + sizeField, newSize[i]);
+			}
+			position += end - dataEnd;
+		}
+	}
+	MutexDestroy(&repack.mutex);
+	for (int k = 0; k < count; k++) BufferFree(region[k]);		// (if cancelled)
+	free(region);
+	free(chunks);
+	free(firstChunk);
+	if (progress != NULL) progress->state.entries = (uint32_t)candidates;
+	if (repack.cancelled || !ProgressEnd(progress)) { free(newSize); return false; }
+
+	if (repacked > 0)
+	{
+		// Central directory (and EOCD, and any comment) after the entries, with the new positions, methods and sizes
+		size_t cd = entries->cd;
+		memmove(data + position, data + cd, *length - cd);
+		for (int i = 0; i < count; i++)
+		{
+			unsigned char *entry = data + position + entries->entry[i];
+			ZIP_WRITE_DWORD(entry + 42, entries->localFile[i]);
+			if (newSize[i] == 0) continue;
+			if (ZIP_READ_WORD(entry + 6) < 20) ZIP_WRITE_WORD(entry + 6, 20);
+			ZIP_WRITE_WORD(entry + 10, 8);
+			ZIP_WRITE_DWORD(entry + 20, newSize[i]);
+		}
+		ZIP_WRITE_DWORD(data + position + (entries->eocd - cd) + 16, position);
+		*length = position + (*length - cd);
+		fprintf(stderr, "ZIPPAST: Repacked %d of %d entries (%d candidates), saving %llu bytes.\n", repacked, count, candidates, (unsigned long long)saved);
+		zipEntriesFree(entries);
+		if (!zipEntriesParse(data, *length, entries)) { free(newSize); return false; }
+	}
+	free(newSize);
+	return true;
+}
+
+unsigned char *generateBmp(size_t contentsLength, size_t *outHeaderSize)
+{
+	// Fixed width and bits-per-pixel
+	int width = 1024;
+	int bpp = 24;
+	int span = 4 * ((width * ((bpp + 7) / 8) + 3) / 4);
+
+	// Determine height from file size
+	int height = (((int)contentsLength + span - 1) / span);
+	size_t fileSize = BMP_WRITER_SIZE_HEADER + height * span;
+	size_t headerSize = fileSize - contentsLength;
+	fprintf(stderr, "ZIPPAST: BMP: Read %u, Header %u, Total %u, Image %ux%u (span %u).\n", (unsigned int)contentsLength, (unsigned int)headerSize, (unsigned int)(contentsLength + headerSize), width, height, span);
+
+	// Create header
+	unsigned char *header = (unsigned char *)malloc(headerSize);
+	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
+	memset(header, 0, headerSize);
+	BitmapWriteHeader(header, width, -height, bpp);
+	*outHeaderSize = headerSize;
+	return header;
+}
+
+unsigned char *generateWav(size_t contentsLength, size_t *outHeaderSize)
+{
+	unsigned int bitsPerSample = 8;
+	unsigned int chans = 1;
+	unsigned int freq = 44100;
+	unsigned int bytesPerSample = (bitsPerSample + 7) / 8;
+	unsigned int align = bytesPerSample * chans;
+	unsigned int numSamples = (((unsigned int)contentsLength + align - 1) / align) * align;
+	if (numSamples & 1) { numSamples++; }	// instead of trailing padding byte (as we are 1-channel, 8-bit samples)
+	unsigned int dataSize = numSamples * chans * bytesPerSample;
+	//if (dataSize & 1) dataSize++;		// trailing padding byte
+	size_t fileSize = WAV_WRITER_SIZE_HEADER + dataSize;
+	size_t headerSize = fileSize - contentsLength;
+
+	fprintf(stderr, "ZIPPAST: WAV: Read %u, Header %u, Total %u, Samples %u.\n", (unsigned int)contentsLength, (unsigned int)headerSize, (unsigned int)(contentsLength + headerSize), numSamples);
+
+	// Create header
+	unsigned char *header = (unsigned char *)malloc(headerSize);
+	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
+	memset(header, 0, headerSize);
+	WavWriteHeader(header, bitsPerSample, chans, freq, numSamples);
+	*outHeaderSize = headerSize;
+	return header;
+}
+
+// TODO: The attached .ZIP file has incorrect offsets in the central directory -- try to solve this with a second central directory within the main part of the .ZIP file
+unsigned char *generateEml(size_t contentsLength, size_t *outHeaderSize, unsigned char *comment, size_t commentPad)
+{
+	const char *emlHeader =
+		"From: <zippast>\r\n"
+		//"Snapshot-Content-Location: zippast\r\n"
+		"Subject: ZIP File Attached\r\n"
+		//"Date: Thu, 01 Jan 1970 00:00:00 +0000\r\n"
+		//"MIME-Version: 1.0\r\n"
+		"Content-Type: multipart/related; type=\"text/html\"; boundary=\"" MULTIPART_BOUNDARY "\"\r\n"
+		"\r\n"
+		"--" MULTIPART_BOUNDARY "\r\n"
+		"Content-Type: text/html\r\n"
+		//"Content-ID: <_index>\r\n"
+		//"Content-Transfer-Encoding: binary\r\n"
+		//"Content-Location: index.html\r\n"
+		"\r\n"
+		"<!doctype html>\r\n"
+		"<html>\r\n"
+		"<head>\r\n"
+		"<meta charset='ISO-8859-1'>\r\n"
+		"</head>\r\n"
+		"<body>\r\n"
+		"Please open the attachment (or rename this .eml file to .zip)\r\n"
+		"</body>\r\n"
+		"</html>\r\n"
+		"\r\n"
+		"--" MULTIPART_BOUNDARY "\r\n"
+		"Content-Type: application/zip\r\n"
+		//"Content-ID: <_zip>\r\n"
+		"Content-Disposition: attachment; filename=\"file.zip\"\r\n"
+		"Content-Transfer-Encoding: binary\r\n"
+		"Content-Length: %u\r\n"
+		"\r\n"
+	;
+
+	const char *emlFooterStart = ""
+		// "\r\n"
+		// "\r\n"
+		// "--" MULTIPART_BOUNDARY "\r\n"
+		// "Content-Type: text/plain\r\n"
+		// "\r\n"
+	;
+	const char *emlFooterEnd =
+		//"\r\n"
+		//"\r\n"
+		"--" MULTIPART_BOUNDARY "--\r\n"
+	;
+
+	if (commentPad >= strlen(emlFooterStart)) {
+		memcpy(comment, emlFooterStart, strlen(emlFooterStart));
+		size_t ofs = strlen(emlFooterStart), count = commentPad - strlen(emlFooterStart), mod = strlen(TEXT_STRING);
+		if (mod > 0) {
+			for (size_t i = 0; i < count; i++) {
+				comment[ofs + i] = TEXT_STRING[i % mod];
+			}
+		}
+	}
+	if (commentPad >= strlen(emlFooterStart) + strlen(emlFooterEnd)) {
+		memcpy(comment + commentPad - strlen(emlFooterEnd), emlFooterEnd, strlen(emlFooterEnd));
+	}
+
+	unsigned char *header = (unsigned char *)malloc(strlen(emlHeader) + 512);
+	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
+	*outHeaderSize = sprintf((char *)header, emlHeader, contentsLength);
+	return header;
+}
+
+// TODO: Find a way of downloading the attached file (e.g. represent as a BMP and render to canvas if not tainted?), also solve the offset issue as with .eml files (e.g. a second central directory?)
+unsigned char *generateMhtml(size_t contentsLength, size_t *outHeaderSize, unsigned char *comment, size_t commentPad)
+{
+	const char *mhtmlHeader =
+		//"From: <zippast>\r\n"
+		//"Snapshot-Content-Location: zippast\r\n"
+		//"Subject: ZIP File Attached\r\n"
+		//"Date: Thu, 01 Jan 1970 00:00:00 +0000\r\n"
+		//"MIME-Version: 1.0\r\n"
+		"Content-Type: multipart/related; type=\"text/html\"; boundary=\"" MULTIPART_BOUNDARY "\"\r\n"
+		"\r\n"
+		"--" MULTIPART_BOUNDARY "\r\n"
+		"Content-Type: text/html\r\n"
+		//"Content-ID: <_index>\r\n"
+		//"Content-Transfer-Encoding: binary\r\n"
+		//"Content-Location: index.html\r\n"
+		"\r\n"
+		"<!doctype html>\r\n"
+		"<html>\r\n"
+		"<head>\r\n"
+		"<meta charset='ISO-8859-1'>\r\n"
+		"</head>\r\n"
+		"<body>\r\n"
+		"<embed type='application/zip' src='cid:_zip'>...</embed>\r\n"
+		"</body>\r\n"
+		"</html>\r\n"
+		"\r\n"
+		"--" MULTIPART_BOUNDARY "\r\n"
+		"Content-Type: application/zip\r\n"
+		"Content-ID: <_zip>\r\n"
+		"Content-Disposition: attachment; filename=\"file.zip\"\r\n"
+		"Content-Transfer-Encoding: binary\r\n"
+		"Content-Length: %u\r\n"
+		"\r\n"
+	;
+
+	const char *mhtmlFooterStart = ""
+		// "\r\n"
+		// "\r\n"
+		// "--" MULTIPART_BOUNDARY "\r\n"
+		// "Content-Type: text/plain\r\n"
+		// "\r\n"
+	;
+	const char *mhtmlFooterEnd =
+		//"\r\n"
+		//"\r\n"
+		"--" MULTIPART_BOUNDARY "--\r\n"
+	;
+
+	if (commentPad >= strlen(mhtmlFooterStart)) {
+		memcpy(comment, mhtmlFooterStart, strlen(mhtmlFooterStart));
+		size_t ofs = strlen(mhtmlFooterStart), count = commentPad - strlen(mhtmlFooterStart), mod = strlen(TEXT_STRING);
+		if (mod > 0) {
+			for (size_t i = 0; i < count; i++) {
+				comment[ofs + i] = TEXT_STRING[i % mod];
+			}
+		}
+	}
+	if (commentPad >= strlen(mhtmlFooterStart) + strlen(mhtmlFooterEnd)) {
+		memcpy(comment + commentPad - strlen(mhtmlFooterEnd), mhtmlFooterEnd, strlen(mhtmlFooterEnd));
+	}
+
+	unsigned char *header = (unsigned char *)malloc(strlen(mhtmlHeader) + 512);
+	if (header == NULL) { perror("ERROR: Problem allocating header buffer"); return NULL; }
+	*outHeaderSize = sprintf((char *)header, mhtmlHeader, contentsLength);
+	return header;
+}
+
+unsigned char *generateHtml(size_t contentsLength, size_t *outHeaderSize)
 {
 	const char *htmlHeader =
 		"<!doctype html>\n"
@@ -826,243 +3196,3208 @@ unsigned char *generateHtml(size_t contentsLength, size_t *outHeaderSize)
 	return header;
 }
 
-unsigned char *zipFile(const char *filename, const unsigned char *contents, size_t contentsLength, size_t *zipLength)
+unsigned char *zipFile(const char *filename, const unsigned char *contents, size_t contentsLength, int threads, size_t alignment, size_t baseOffset, const uint32_t *knownCrc, size_t *zipLength, progress_t *progress)
+{
+	// [
+	//   ZIP LOCAL HEADER <30+n>
+	//   FILE CONTENT <f>
+	//   ZIP EXTENDED LOCAL HEADER <16>
+	// ]...
+	// ZIP CENTRAL DIRECTORY ENTRY... <46+n>
+	// ZIP END CENTRAL DIRECTORY <22>
+	size_t length = 30 + strlen(filename) + contentsLength + 16 + 46 + strlen(filename) + 22;
+	unsigned char *buffer = (unsigned char *)BufferAlloc(length + (alignment > 0 ? alignment + ZIP_EXTRA_ALIGNMENT_MIN : 0));
+	unsigned char *p = buffer;
+	if (buffer == NULL)
+	{
+		perror("ERROR: Problem allocating zip buffer");
+		return NULL;
+	}
+
+	zipwriter_t zip;
+	ZIPWriterInitialize(&zip);
+	zip.alignmentBase = (unsigned long)baseOffset;
+
+	zipwriter_file_t file;
+	p += ZIPWriterStartFile(&zip, &file, filename, ZIP_DATETIME(2000,1,1,0,0,0), (int)alignment, p);
+	length += file.extraFieldLength;
+	// Copy and CRC the contents in blocks (so that progress can be reported), or just copy them if the CRC is already known
+	ProgressStart(progress, "wrap", contentsLength, 1);
+	size_t blockSize = (size_t)CRC32_PARALLEL_CHUNK * 4 * (threads > 4 ? threads : 4);
+	unsigned long crc = knownCrc != NULL ? *knownCrc : CRC32_INIT;
+	for (size_t offset = 0; offset < contentsLength; offset += blockSize)
+	{
+		size_t block = contentsLength - offset < blockSize ? contentsLength - offset : blockSize;
+		memcpy(p + offset, contents + offset, block);
+		if (knownCrc == NULL) crc = crc32Parallel(crc, contents + offset, block, threads);
+		if (!ProgressUpdate(progress, block)) { BufferFree(buffer); return NULL; }
+	}
+	ZIPWriterFileContentCrc(&zip, crc, contentsLength);
+	p += contentsLength;
+	p += ZIPWriterEndFile(&zip, p);
+	p += ZIPWriterCentralDirectory(&zip, p, 1);
+	p += ZIPWriterCentralDirectoryEnd(&zip, p);
+
+	*zipLength = (size_t)(p - buffer);
+	if (*zipLength != length) { fprintf(stderr, "WARNING: Zip output %u, expected %u.\n", (unsigned int)*zipLength, (unsigned int)length); }
+	if (progress != NULL) progress->state.entries = 1;
+	if (!ProgressEnd(progress)) { BufferFree(buffer); return NULL; }
+	return buffer;
+}
+
+const char *findFilename(const char *file)
+{
+	for (const char *p = file + strlen(file); p >= file; p--)
+	{
+		char c = *p;
+#ifdef _WIN32
+		if (c == '\\') c = '/';
+#endif
+		if (c == '/') return p + 1;
+	}
+	return file;
+}
+
+// Further destination for the output (-tee), written concurrently from the same generated data
+typedef struct
+{
+	const char *path;		// file name, "-" for standard output, or "fd:<n>" for an already-open descriptor
+	bool optional;			// a failure only loses this destination (otherwise it stops all of them)
+} zippast_sink_t;
+
+// Processing options
+typedef struct
+{
+	HeaderMode mode;		// output container
+	size_t commentPad;		// end of file comment length
+	bool convert;			// convert entries to use data descriptors
+	int threads;			// worker threads for parallel stages
+	size_t alignment;		// align stored entries' data within the output file (0=none)
+	const char *indexFile;	// write a sidecar random-access index (NULL=none)
+	unsigned int digests;	// DIGEST_* of the output to calculate while writing (0=none)
+	bool digestInput;		// also calculate the digests of the input
+	const char *digestFile;	// write the digests to a sidecar file (NULL=standard output)
+	const char *checkpointFile;	// journal for a resumable output (NULL=none)
+	uint64_t checkpointInterval;	// output bytes between checkpoints
+	zippast_progress_fn progress;	// progress (and cancellation) callback (NULL=none)
+	void *progressContext;
+	bool crcCache;			// cache the CRC-32 of wrapped inputs in an extended attribute of the input file
+	size_t repackMin;		// deflate stored entries of at least this size (0=off)
+	bool inputCrcKnown;		// the CRC-32 of the input contents is already known (skips the CRC pass when wrapping)
+	uint32_t inputCrc;
+	const zippast_sink_t *tees;	// further destinations for the same output (NULL=none)
+	int teeCount;
+} zippast_options_t;
+
+void zippastDefaultOptions(zippast_options_t *options)
+{
+	memset(options, 0, sizeof(zippast_options_t));
+	options->mode = MODE_STANDARD;
+	options->commentPad = (1<<13) - 22 + 1;		// To push EOCD out of last 8kB: default=8171
+	options->convert = false;
+	options->threads = cpuCount();
+	options->checkpointInterval = (uint64_t)256 << 20;
+}
+
+// Generated output: header, (patched) ZIP contents, and comment pad -- written consecutively
+typedef struct
+{
+	unsigned char *header;
+	size_t headerSize;
+	unsigned char *contents;
+	size_t contentsLength;
+	unsigned char *comment;
+	size_t commentPad;
+	zipentries_t entries;		// entry table of the contents (positions relative to the contents, entries.base is the header size)
+} zippast_output_t;
+
+void zippastOutputFree(zippast_output_t *output)
+{
+	free(output->header);
+	BufferFree(output->contents);
+	free(output->comment);
+	zipEntriesFree(&output->entries);
+	memset(output, 0, sizeof(zippast_output_t));
+}
+
+// Header size for modes where it does not depend on the contents length (the .bmp/.wav rounding is moved to after the comment)
+bool headerSizeFixed(HeaderMode mode, size_t *headerSize)
+{
+	if (mode == MODE_STANDARD || mode == MODE_BYTE) { *headerSize = strlen(HEADER_STRING); }
+	else if (mode == MODE_NONE) { *headerSize = 0; }
+	else if (mode == MODE_BMP) { *headerSize = BMP_WRITER_SIZE_HEADER; }
+	else if (mode == MODE_WAV) { *headerSize = WAV_WRITER_SIZE_HEADER; }
+	else { return false; }
+	return true;
+}
+
+// When aligning .bmp/.wav, the container's rounding slack goes after the comment pad rather than in the header (so that the header size is fixed)
+static bool zippastAlignmentSlack(HeaderMode mode, size_t contentsLength, size_t alignBase, size_t *commentPad)
+{
+	if (mode != MODE_BMP && mode != MODE_WAV) return true;
+	size_t slackHeaderSize = 0;
+	unsigned char *slackHeader = (mode == MODE_BMP) ? generateBmp(contentsLength + *commentPad, &slackHeaderSize) : generateWav(contentsLength + *commentPad, &slackHeaderSize);
+	free(slackHeader);
+	*commentPad += slackHeaderSize - alignBase;
+	if (slackHeader == NULL || *commentPad > 0xffff)
+	{
+		fprintf(stderr, "ERROR: Comment pad out of range after alignment: %u\n", (unsigned int)*commentPad);
+		return false;
+	}
+	return true;
+}
+
+// Additional ZIP comment pad at end of file
+static unsigned char *zippastComment(size_t commentPad)
+{
+	const char *commentString = COMMENT_STRING;
+	unsigned char *comment = (unsigned char *)malloc(commentPad > 0 ? commentPad : 1);
+	if (comment == NULL) return NULL;
+	memset(comment, ' ', commentPad);
+	const size_t commentStringLength = strlen(commentString);
+	if (commentStringLength > 0)
+	{
+		for (size_t i = 0; i < commentPad; i++)
+		{
+			comment[i] = commentString[i % commentStringLength] & 0x7f;	// clear top bit to allow easier control codes
+		}
+	}
+#if 0	// Fake central directory at end (7-Zip ignores, others do not?)
+	if (commentPad > 22)
+	{
+		unsigned char *eocd = comment + commentPad - 22;
+		memset(eocd, 0x00, 22);
+		eocd[0]  = 0x50; eocd[1]  = 0x4b; eocd[2] = 0x05; eocd[3] = 0x06;	// End of central directory signature
+		//eocd[4]  = 0x00; eocd[5]  = 0x00; // Number of this disk
+		//eocd[6]  = 0x00; eocd[7]  = 0x00; // Disk where central directory starts
+		//eocd[8]  = 0x00; eocd[9]  = 0x00; // Number of central directory records on this disk
+		//eocd[10] = 0x00; eocd[11] = 0x00; // Total number of central directory records
+		//eocd[12] = 0x00; eocd[13] = 0x00; eocd[14] = 0x00; eocd[15] = 0x00; // Size of central directory(bytes)
+		//eocd[16] = 0x00; eocd[17] = 0x00; eocd[18] = 0x00; eocd[19] = 0x00; // Offset of start of central directory, relative to start of archive
+		//eocd[20] = 0x00; eocd[21] = 0x00; // Comment length
+	}
+#endif
+	return comment;
+}
+
+// Header for the mode, given the ZIP data length (some modes also fill in the comment pad), NULL on error (or for MODE_NONE)
+static unsigned char *zippastHeader(HeaderMode mode, size_t contentsLength, unsigned char *comment, size_t commentPad, size_t *outHeaderSize)
+{
+	unsigned char *header = NULL;
+	*outHeaderSize = 0;
+	if (mode == MODE_BMP)
+	{
+		header = generateBmp(contentsLength + commentPad, outHeaderSize);
+	}
+	else if (mode == MODE_WAV)
+	{
+		header = generateWav(contentsLength + commentPad, outHeaderSize);
+	}
+	else if (mode == MODE_EML) {
+		header = generateEml(contentsLength, outHeaderSize, comment, commentPad);
+	}
+	else if (mode == MODE_MHTML) {
+		header = generateMhtml(contentsLength, outHeaderSize, comment, commentPad);
+	}
+	else if (mode == MODE_HTML) {
+		header = generateHtml(contentsLength + commentPad, outHeaderSize);
+	}
+	else if (mode == MODE_STANDARD)
+	{
+		const char *data; // = "\x1A";	// DOS EOF
+		data = HEADER_STRING;
+		header = (unsigned char *)strdup(data);
+		for (unsigned char *p = header; *p != 0; p++) *p &= 0x7f;	// clear top bit to allow easier control codes from source
+		*outHeaderSize = strlen((char *)header);
+	}
+	else if (mode == MODE_BYTE)
+	{
+		const char *data; // = "\x1A";	// DOS EOF
+		data = HEADER_STRING;
+		header = (unsigned char *)strdup(data);
+		for (unsigned char *p = header; *p != 0; p++) *p &= 0x7f;	// clear top bit to allow easier control codes from source
+		*outHeaderSize = strlen((char *)header);
+	}
+	else  // mode == MODE_NONE
+	{
+		;
+	}
+	return header;
+}
+
+// Generate the output from the input contents (takes ownership of the contents buffer, which is modified in-place or replaced)
+bool zippastGenerate(const char *filename, unsigned char *contents, size_t contentsLength, const zippast_options_t *options, zippast_output_t *output)
+{
+	HeaderMode mode = options->mode;
+	size_t commentPad = options->commentPad;
+	memset(output, 0, sizeof(zippast_output_t));
+	progress_t progress;
+	ProgressInit(&progress, options->progress, options->progressContext);
+
+	// Check parameters
+	if (commentPad < 0 || commentPad > 0xffff)
+	{
+		fprintf(stderr, "ZIPPAST: Comment pad out of range (0-65535): %u\n", (unsigned int)commentPad);
+		BufferFree(contents);
+		return false;
+	}
+
+	// Alignment is relative to the start of the output, so needs a header size that is known in advance
+	size_t alignment = options->alignment;
+	size_t alignBase = 0;
+	if (alignment > 0 && (alignment > ZIP_ALIGNMENT_MAX || !headerSizeFixed(mode, &alignBase)))
+	{
+		fprintf(stderr, "ERROR: Alignment not supported for this mode, or out of range (1-%u): %u\n", ZIP_ALIGNMENT_MAX, (unsigned int)alignment);
+		BufferFree(contents);
+		return false;
+	}
+
+	// Zip
+	bool wrapped = false;
+	if (!isZip(contents, contentsLength))
+	{
+		fprintf(stderr, "ZIPPAST: Wrapping in ZIP...\n");
+		size_t zipLength = 0;
+		unsigned char *zipContents = zipFile(filename, contents, contentsLength, options->threads, alignment, alignBase, options->inputCrcKnown ? &options->inputCrc : NULL, &zipLength, &progress);
+		BufferFree(contents);
+		contents = zipContents;
+		contentsLength = zipLength;
+		if (contents == NULL) { return false; }
+		wrapped = true;
+	}
+
+	// Entry table, parsed once for the following passes
+	zipentries_t entries;
+	if (!zipEntriesParse(contents, contentsLength, &entries))
+	{
+		BufferFree(contents);
+		return false;
+	}
+
+	// Deflate large stored entries
+	if (options->repackMin > 0 && !zipRepack(contents, &contentsLength, &entries, options->repackMin, options->threads, &progress))
+	{
+		if (!progress.cancelled) fprintf(stderr, "ERROR: Problem repacking ZIP entries\n");
+		zipEntriesFree(&entries);
+		BufferFree(contents);
+		return false;
+	}
+
+	// Convert ZIP file (and/or realign entries)
+	if (options->convert || (alignment > 0 && !wrapped))
+	{
+		ProgressStart(&progress, "convert", contentsLength, (uint32_t)entries.count);
+		bool converted = zipConvert(&contents, &contentsLength, &entries, options->convert, alignment, alignBase);
+		progress.state.entries = (uint32_t)entries.count;
+		progress.state.totalBytes = contentsLength;
+		if (!converted || !ProgressUpdate(&progress, contentsLength) || !ProgressEnd(&progress))
+		{
+			if (!converted) fprintf(stderr, "ERROR: Problem converting ZIP entries\n");
+			zipEntriesFree(&entries);
+			BufferFree(contents);
+			return false;
+		}
+	}
+
+	// When aligning, the container's rounding slack goes after the comment pad rather than in the header
+	if (alignment > 0 && !zippastAlignmentSlack(mode, contentsLength, alignBase, &commentPad))
+	{
+		zipEntriesFree(&entries);
+		BufferFree(contents);
+		return false;
+	}
+
+	// Additional ZIP comment pad at end of file
+	unsigned char *comment = NULL;
+	if (commentPad > 0)
+	{
+		comment = zippastComment(commentPad);
+		if (comment == NULL)
+		{
+			perror("ERROR: Problem allocating comment memory");
+			zipEntriesFree(&entries);
+			BufferFree(contents);
+			return false;
+		}
+	}
+
+	// Generate required header
+	size_t headerSize = 0;
+	unsigned char *header = zippastHeader(mode, contentsLength, comment, commentPad, &headerSize);
+	if (header == NULL && mode != MODE_NONE)
+	{
+		zipEntriesFree(&entries);
+		free(comment);
+		BufferFree(contents);
+		return false;
+	}
+
+	// Patch ZIP file
+	if (!zipOffsets(&contents, &contentsLength, &entries, headerSize, commentPad))
+	{
+		fprintf(stderr, "ERROR: Problem offsetting ZIP file contents by %u\n", (unsigned int)headerSize);
+		zipEntriesFree(&entries);
+		free(header);
+		free(comment);
+		BufferFree(contents);
+		return false;
+	}
+
+	output->header = header;
+	output->headerSize = headerSize;
+	output->contents = contents;
+	output->contentsLength = contentsLength;
+	output->comment = comment;
+	output->commentPad = commentPad;
+	output->entries = entries;
+	return true;
+}
+
+// Output layout, planned from the input's entry table (central directory and local headers) without generating the output:
+// the header size, each entry's new position (shifted by any inserted data descriptors or alignment padding), and the comment pad
+typedef struct
+{
+	bool wrapped;				// the input is not a ZIP file, so is wrapped as a single entry
+	size_t headerSize;
+	size_t contentsLength;		// ZIP data, after any conversion
+	size_t commentPad;
+	uint64_t length;			// whole output (at most, if repacking)
+	size_t repackMin;			// stored entries of at least this size may be deflated (0=not repacking)
+	size_t cd;					// central directory position within the ZIP data, after any conversion
+	size_t cdSize;
+	int patched;				// entries gaining a data descriptor
+	int aligned;				// entries padded for alignment
+	zipentries_t entries;		// entry table of the input (unless wrapped)
+	uint32_t *newLocalFile;		// each entry's local header position within the ZIP data, after any conversion
+	uint16_t *newExtraLength;	// ...and its local extra field length
+	uint16_t *keptExtraLength;
+} zippast_plan_t;
+
+void zippastPlanFree(zippast_plan_t *plan)
+{
+	zipEntriesFree(&plan->entries);
+	free(plan->newLocalFile);
+	memset(plan, 0, sizeof(zippast_plan_t));
+}
+
+// Plan the output for the input contents (which are not modified)
+bool zippastPlan(const char *filename, const unsigned char *contents, size_t contentsLength, const zippast_options_t *options, zippast_plan_t *plan)
+{
+	HeaderMode mode = options->mode;
+	size_t commentPad = options->commentPad;
+	size_t alignment = options->alignment;
+	size_t alignBase = 0;
+	size_t sizedLength = 0;		// ZIP data length that the header is sized for (before any existing whole-file comment is removed)
+	memset(plan, 0, sizeof(zippast_plan_t));
+	if (commentPad > 0xffff || (alignment > 0 && (alignment > ZIP_ALIGNMENT_MAX || !headerSizeFixed(mode, &alignBase)))) { fprintf(stderr, "ERROR: Comment pad or alignment out of range for this mode.\n"); return false; }
+
+	if (!isZip((unsigned char *)contents, contentsLength))
+	{
+		// Wrapped: local header (with any alignment padding), contents, data descriptor, central directory entry, end record
+		size_t nameLength = strlen(filename);
+		size_t padding = alignment > 0 ? zipAlignmentPadding(alignBase + 30 + nameLength, alignment) : 0;
+		plan->wrapped = true;
+		plan->aligned = (alignment > 0) ? 1 : 0;
+		plan->cd = 30 + nameLength + padding + contentsLength + 16;
+		plan->cdSize = 46 + nameLength;
+		plan->contentsLength = plan->cd + plan->cdSize + 22;
+		sizedLength = plan->contentsLength;
+	}
+	else
+	{
+		zipentries_t *entries = &plan->entries;
+		if (!zipEntriesParse(contents, contentsLength, entries)) return false;
+		size_t newCd = entries->cd;
+		if (entries->count > 0 && (options->convert || alignment > 0))
+		{
+			if (!zipEntriesLocal(contents, entries)) { zippastPlanFree(plan); return false; }
+			plan->newLocalFile = (uint32_t *)malloc(entries->count * (sizeof(uint32_t) + 2 * sizeof(uint16_t)));
+			if (plan->newLocalFile == NULL) { perror("ERROR: Problem allocating plan"); zippastPlanFree(plan); return false; }
+			plan->newExtraLength = (uint16_t *)(plan->newLocalFile + entries->count);
+			plan->keptExtraLength = plan->newExtraLength + entries->count;
+			bool unchanged = true;
+			if (!zipConvertLayout(contents, entries, options->convert, alignment, alignBase, plan->newLocalFile, plan->keptExtraLength, plan->newExtraLength, &newCd, &plan->patched, &plan->aligned, &unchanged)) { zippastPlanFree(plan); return false; }
+		}
+		plan->cd = newCd;
+		plan->cdSize = entries->eocd - entries->cd;
+		plan->contentsLength = newCd + plan->cdSize + 22;		// (any existing whole-file comment is replaced by the comment pad)
+		sizedLength = newCd + (contentsLength - entries->cd);
+	}
+
+	// Comment pad (with any alignment slack), and the header for the ZIP data
+	if (alignment > 0 && !zippastAlignmentSlack(mode, sizedLength, alignBase, &commentPad)) { zippastPlanFree(plan); return false; }
+	unsigned char *comment = zippastComment(commentPad);
+	unsigned char *header = (comment != NULL) ? zippastHeader(mode, sizedLength, comment, commentPad, &plan->headerSize) : NULL;
+	free(comment);
+	free(header);
+	if (header == NULL && mode != MODE_NONE) { zippastPlanFree(plan); return false; }
+	plan->commentPad = commentPad;
+	plan->length = (uint64_t)plan->headerSize + plan->contentsLength + plan->commentPad;
+	plan->repackMin = options->repackMin;
+	return true;
+}
+
+// Report a plan (the dry run of a conversion)
+void zippastPlanReport(const zippast_plan_t *plan, const unsigned char *contents, const char *filename, FILE *fp)
+{
+	fprintf(fp, "%12s %12s  %s\n", "OFFSET", "LENGTH", "PART");
+	if (plan->headerSize > 0) fprintf(fp, "%12llu %12llu  header\n", 0ULL, (unsigned long long)plan->headerSize);
+	if (plan->wrapped)
+	{
+		bool repack = plan->repackMin > 0 && plan->cd >= plan->repackMin;
+		fprintf(fp, "%12llu %12llu  entry (wrapped%s%s): %s\n", (unsigned long long)plan->headerSize, (unsigned long long)plan->cd, plan->aligned ? ", aligned" : "", repack ? ", may repack" : "", filename);
+	}
+	else
+	{
+		const zipentries_t *entries = &plan->entries;
+		for (int k = 0; k < entries->count; k++)
+		{
+			int i = entries->local ? (int)entries->order[k] : k;
+			uint64_t localFile = plan->newLocalFile != NULL ? plan->newLocalFile[i] : entries->localFile[i];
+			long long shift = (long long)localFile + (long long)plan->headerSize - (long long)entries->localFile[i];
+			bool patch = plan->newLocalFile != NULL && (entries->flags[i] & (1 << 3)) == 0 && plan->patched > 0;
+			bool aligned = plan->newLocalFile != NULL && plan->newExtraLength[i] != plan->keptExtraLength[i];
+			bool repack = plan->repackMin > 0 && entries->method[i] == 0 && !(entries->flags[i] & 1) && entries->compressedSize[i] >= plan->repackMin;
+			const unsigned char *name = contents + entries->cd + entries->entry[i] + 46;
+			fprintf(fp, "%12llu %12llu  entry (shift %+lld%s%s%s): %.*s\n", (unsigned long long)(plan->headerSize + localFile), (unsigned long long)entries->compressedSize[i], shift, patch ? ", +descriptor" : "", aligned ? ", aligned" : "", repack ? ", may repack" : "", (int)entries->nameLength[i], name);
+		}
+	}
+	fprintf(fp, "%12llu %12llu  central directory\n", (unsigned long long)(plan->headerSize + plan->cd), (unsigned long long)plan->cdSize);
+	fprintf(fp, "%12llu %12llu  end record\n", (unsigned long long)(plan->headerSize + plan->cd + plan->cdSize), 22ULL);
+	if (plan->commentPad > 0) fprintf(fp, "%12llu %12llu  comment pad\n", (unsigned long long)(plan->headerSize + plan->contentsLength), (unsigned long long)plan->commentPad);
+	fprintf(fp, "%12llu %12s  total%s (%d entries, %d gaining a data descriptor, %d aligned)\n", (unsigned long long)plan->length, "", plan->repackMin > 0 ? ", at most" : "", plan->wrapped ? 1 : plan->entries.count, plan->patched, plan->aligned);
+}
+
+// Digest of the generated output, calculated on a helper thread while the output is written
+typedef struct
+{
+	digest_t *digest;
+	const zippast_output_t *output;
+} digest_job_t;
+
+static void *DigestWorker(void *arg)
+{
+	digest_job_t *job = (digest_job_t *)arg;
+	if (job->output->header != NULL) DigestUpdate(job->digest, job->output->header, job->output->headerSize);
+	DigestUpdate(job->digest, job->output->contents, job->output->contentsLength);
+	if (job->output->commentPad > 0) DigestUpdate(job->digest, job->output->comment, job->output->commentPad);
+	return NULL;
+}
+
+// Number of whole entries (local header and data) before a position in the output
+static uint32_t outputEntriesBefore(const zippast_output_t *output, uint64_t position)
+{
+	const zipentries_t *entries = &output->entries;
+	if (!entries->local) return position >= (uint64_t)output->headerSize + output->contentsLength ? (uint32_t)entries->count : 0;
+	int count = 0;
+	while (count < entries->count && output->headerSize + zipEntriesEnd(entries, count) <= position) count++;
+	return (uint32_t)count;
+}
+
+static uint32_t outputEntriesAt(const void *output, uint64_t position)
+{
+	return outputEntriesBefore((const zippast_output_t *)output, position);
+}
+
+// Start the progress of writing the output (from a position, if resuming)
+static void outputProgressStart(progress_t *progress, const zippast_output_t *output, uint64_t position)
+{
+	if (progress == NULL) return;
+	ProgressStart(progress, "write", (uint64_t)output->headerSize + output->contentsLength + output->commentPad, (uint32_t)output->entries.count);
+	progress->entriesAt = outputEntriesAt;
+	progress->table = output;
+	progress->state.bytes = position;
+}
+
+// Write the generated output to an open file (and calculate its digests, if 'digest' is not NULL; with progress, if 'progress' is not NULL)
+bool writeOutput(FILE *fp, const zippast_output_t *output, digest_t *digest, progress_t *progress)
+{
+	digest_job_t job;
+	job.digest = digest;
+	job.output = output;
+	zippast_thread_t thread;
+	bool threaded = (digest != NULL) && ThreadCreate(&thread, DigestWorker, &job);
+	if (digest != NULL && !threaded) DigestWorker(&job);
+	outputProgressStart(progress, output, 0);
+
+	size_t written = 0;
+	if (output->header != NULL)
+	{
+fprintf(stderr, "OUTPUT: Header: %u\n", (unsigned int)output->headerSize);
+		written += fileWriteData(fp, output->header, output->headerSize, progress) ? output->headerSize : 0;
+	}
+fprintf(stderr, "OUTPUT: Contents: %u\n", (unsigned int)output->contentsLength);
+	written += fileWriteData(fp, output->contents, output->contentsLength, progress) ? output->contentsLength : 0;
+fprintf(stderr, "OUTPUT: Comment: %u\n", (unsigned int)output->commentPad);
+	if (output->commentPad > 0)
+	{
+		written += fileWriteData(fp, output->comment, output->commentPad, progress) ? output->commentPad : 0;
+	}
+	bool result = (fflush(fp) == 0 && written == output->headerSize + output->contentsLength + output->commentPad) && ProgressEnd(progress);
+	if (threaded) ThreadJoin(thread);
+	if (!result)
+	{
+		if (progress == NULL || !progress->cancelled) fprintf(stderr, "ERROR: Problem writing file contents.\n");
+		return false;
+	}
+	return true;
+}
+
+// Report the input (if not NULL) and output digests to the digest file, or the given stream
+bool writeDigests(const zippast_options_t *options, digest_t *inputDigest, const char *inputName, digest_t *outputDigest, const char *outputName, FILE *stream)
+{
+	FILE *fp = stream;
+	if (options->digestFile != NULL)
+	{
+		fp = fopen(options->digestFile, "w");
+		if (fp == NULL) { perror("ERROR: Problem opening digest file"); return false; }
+	}
+	if (inputDigest != NULL) DigestReport(inputDigest, inputName, fp);
+	DigestReport(outputDigest, outputName, fp);
+	if (fp != stream && fclose(fp) != 0) { fprintf(stderr, "ERROR: Problem writing digest file.\n"); return false; }
+	return true;
+}
+
+// Sidecar random-access index: a hash table of entry names so that a single entry can be found (and mapped) without parsing the central directory.
+// All values little-endian:
+//   Header (32 bytes):  "ZPIX", uint32 version, uint32 entry count, uint32 slot count (power of two), uint64 names offset, uint64 names size
+//   Slots:              uint32 per slot, entry index + 1 (0=empty), linear probing from (hash & (slots - 1))
+//   Entries (48 bytes): uint64 name hash (64-bit FNV-1a), uint64 local header offset, uint64 data offset, uint32 compressed size,
+//                       uint32 uncompressed size, uint32 CRC-32, uint16 method, uint16 name length, uint64 name offset (within names) -- sorted by hash
+//   Names:              entry names, not terminated
+// Offsets are positions within the output file (i.e. already shifted by the prepended header).
+#define INDEX_MAGIC "ZPIX"
+#define INDEX_VERSION 1
+#define INDEX_SIZE_HEADER 32
+#define INDEX_SIZE_ENTRY 48
+
+uint64_t hashName(const unsigned char *name, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) { hash ^= name[i]; hash *= 0x100000001b3ULL; }
+	return hash;
+}
+
+static void writeQword(unsigned char *p, uint64_t v)
+{
+	ZIP_WRITE_DWORD(p, (uint32_t)v);
+	ZIP_WRITE_DWORD(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t readQword(const unsigned char *p)
+{
+	return (uint32_t)ZIP_READ_DWORD(p) | ((uint64_t)(uint32_t)ZIP_READ_DWORD(p + 4) << 32);
+}
+
+typedef struct
+{
+	uint64_t hash;
+	int index;						// entry table index
+} index_item_t;
+
+static int compareIndexItem(const void *a, const void *b)
+{
+	const index_item_t *ia = (const index_item_t *)a, *ib = (const index_item_t *)b;
+	return (ia->hash > ib->hash) - (ia->hash < ib->hash);
+}
+
+// Write the index for the generated output (from its entry table)
+bool writeIndexFile(const char *indexFile, zippast_output_t *output)
+{
+	zipentries_t *table = &output->entries;
+	const unsigned char *data = output->contents;
+	if (!zipEntriesLocal(data, table)) { fprintf(stderr, "ERROR: Index: ZIP not valid.\n"); return false; }
+	uint32_t count = (uint32_t)table->count;
+	uint32_t slots = 1;
+	while (slots < 2 * count) slots <<= 1;
+
+	// Entries, sorted by name hash
+	index_item_t *items = (index_item_t *)malloc((count > 0 ? count : 1) * sizeof(index_item_t));
+	if (items == NULL) { perror("ERROR: Problem allocating index"); return false; }
+	size_t namesSize = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		items[i].hash = hashName(data + table->cd + table->entry[i] + 46, table->nameLength[i]);
+		items[i].index = (int)i;
+		namesSize += table->nameLength[i];
+	}
+	qsort(items, count, sizeof(index_item_t), compareIndexItem);
+
+	size_t namesOffset = INDEX_SIZE_HEADER + (size_t)slots * 4 + (size_t)count * INDEX_SIZE_ENTRY;
+	size_t length = namesOffset + namesSize;
+	unsigned char *index = (unsigned char *)malloc(length);
+	if (index == NULL) { perror("ERROR: Problem allocating index"); free(items); return false; }
+	memset(index, 0, namesOffset);
+	memcpy(index, INDEX_MAGIC, 4);
+	ZIP_WRITE_DWORD(index + 4, INDEX_VERSION);
+	ZIP_WRITE_DWORD(index + 8, count);
+	ZIP_WRITE_DWORD(index + 12, slots);
+	writeQword(index + 16, namesOffset);
+	writeQword(index + 24, namesSize);
+
+	unsigned char *slotTable = index + INDEX_SIZE_HEADER;
+	unsigned char *records = slotTable + (size_t)slots * 4;
+	size_t nameOffset = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		int e = items[i].index;
+		size_t nameLength = table->nameLength[e];
+		unsigned char *p = records + (size_t)i * INDEX_SIZE_ENTRY;
+		writeQword(p + 0, items[i].hash);
+		writeQword(p + 8, table->base + table->localFile[e]);
+		writeQword(p + 16, table->base + zipEntriesData(table, e));
+		ZIP_WRITE_DWORD(p + 24, table->compressedSize[e]);
+		ZIP_WRITE_DWORD(p + 28, table->uncompressedSize[e]);
+		ZIP_WRITE_DWORD(p + 32, table->crc32[e]);
+		ZIP_WRITE_WORD(p + 36, table->method[e]);
+		ZIP_WRITE_WORD(p + 38, nameLength);
+		writeQword(p + 40, nameOffset);
+		memcpy(index + namesOffset + nameOffset, data + table->cd + table->entry[e] + 46, nameLength);
+		nameOffset += nameLength;
+
+		// Hash slot
+		uint32_t slot = (uint32_t)items[i].hash & (slots - 1);
+		while (ZIP_READ_DWORD(slotTable + (size_t)slot * 4) != 0) slot = (slot + 1) & (slots - 1);
+		ZIP_WRITE_DWORD(slotTable + (size_t)slot * 4, i + 1);
+	}
+	free(items);
+
+	bool result = true;
+	fprintf(stderr, "ZIPPAST: Writing index: %s (%u entries)\n", indexFile, (unsigned int)count);
+	FILE *fp = fopen(indexFile, "wb");
+	if (fp == NULL) { perror("ERROR: Problem opening index file"); result = false; }
+	else
+	{
+		result = fwrite(index, 1, length, fp) == length;
+		if (fclose(fp) != 0) result = false;
+		if (!result) fprintf(stderr, "ERROR: Problem writing index file.\n");
+	}
+	free(index);
+	return result;
+}
+
+// Find an entry in an index (loaded in memory), returns a pointer to the entry record or NULL
+const unsigned char *indexLookup(const unsigned char *index, size_t length, const char *name)
+{
+	if (length < INDEX_SIZE_HEADER || memcmp(index, INDEX_MAGIC, 4) != 0 || ZIP_READ_DWORD(index + 4) != INDEX_VERSION) return NULL;
+	uint32_t count = ZIP_READ_DWORD(index + 8);
+	uint32_t slots = ZIP_READ_DWORD(index + 12);
+	uint64_t namesOffset = readQword(index + 16);
+	if (slots == 0 || (slots & (slots - 1)) != 0 || namesOffset > length || INDEX_SIZE_HEADER + (uint64_t)slots * 4 + (uint64_t)count * INDEX_SIZE_ENTRY > namesOffset) return NULL;
+	const unsigned char *entries = index + INDEX_SIZE_HEADER + (size_t)slots * 4;
+	size_t nameLength = strlen(name);
+	uint64_t hash = hashName((const unsigned char *)name, nameLength);
+	for (uint32_t slot = (uint32_t)hash & (slots - 1), probes = 0; probes < slots; slot = (slot + 1) & (slots - 1), probes++)
+	{
+		uint32_t item = ZIP_READ_DWORD(index + INDEX_SIZE_HEADER + (size_t)slot * 4);
+		if (item == 0 || item > count) return NULL;
+		const unsigned char *p = entries + (size_t)(item - 1) * INDEX_SIZE_ENTRY;
+		uint64_t nameOffset = readQword(p + 40);
+		if (readQword(p) == hash && (size_t)ZIP_READ_WORD(p + 38) == nameLength && namesOffset + nameOffset + nameLength <= length && memcmp(index + namesOffset + nameOffset, name, nameLength) == 0) return p;
+	}
+	return NULL;
+}
+
+// Print the location of an entry from an index file
+int lookupIndex(const char *indexFile, const char *name)
+{
+	size_t length = 0;
+	unsigned char *index = readFile(indexFile, &length);
+	if (index == NULL) return 1;
+	const unsigned char *p = indexLookup(index, length, name);
+	if (p != NULL)
+	{
+		printf("offset=%llu data=%llu compressed=%lu uncompressed=%lu crc=%08lx method=%u\n", (unsigned long long)readQword(p + 8), (unsigned long long)readQword(p + 16),
+			(unsigned long)(uint32_t)ZIP_READ_DWORD(p + 24), (unsigned long)(uint32_t)ZIP_READ_DWORD(p + 28), (unsigned long)(uint32_t)ZIP_READ_DWORD(p + 32), (unsigned int)ZIP_READ_WORD(p + 36));
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: Entry not found in index: %s\n", name);
+	}
+	BufferFree(index);
+	return p != NULL ? 0 : 1;
+}
+
+// CRC cache: the CRC-32 of a wrapped input is stored in a user extended attribute of the input file, keyed by its inode, size and modification time,
+// so that wrapping the same (unmodified) input again can skip the CRC pass.  Value (32 bytes, little-endian): "ZPCR", uint64 inode, uint64 size, uint64 mtime (ns), uint32 CRC-32
+#if defined(__linux__)
+#define ZIPPAST_XATTR
+#endif
+#define CRC_CACHE_ATTRIBUTE "user.zippast.crc"
+#define CRC_CACHE_SIZE 32
+
+typedef struct
+{
+	uint64_t inode;
+	uint64_t size;
+	uint64_t mtime;			// modification time (ns)
+} crc_cache_key_t;
+
+// Key of an open file (taken before it is read, so that a modification while reading does not match later)
+bool crcCacheKey(int fd, crc_cache_key_t *key)
+{
+	memset(key, 0, sizeof(crc_cache_key_t));
+#ifdef ZIPPAST_XATTR
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+	key->inode = (uint64_t)st.st_ino;
+	key->size = (uint64_t)st.st_size;
+	key->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+	return true;
+#else
+	(void)fd;
+	return false;
+#endif
+}
+
+// Cached CRC-32 of an open file, if it matches the key
+bool crcCacheRead(int fd, const crc_cache_key_t *key, uint32_t *crc)
+{
+#ifdef ZIPPAST_XATTR
+	unsigned char p[CRC_CACHE_SIZE];
+	if (fgetxattr(fd, CRC_CACHE_ATTRIBUTE, p, sizeof(p)) != (ssize_t)sizeof(p) || memcmp(p, "ZPCR", 4)) return false;
+	if (readQword(p + 4) != key->inode || readQword(p + 12) != key->size || readQword(p + 20) != key->mtime) return false;
+	*crc = (uint32_t)ZIP_READ_DWORD(p + 28);
+	return true;
+#else
+	(void)fd; (void)key; (void)crc;
+	return false;
+#endif
+}
+
+// Store the CRC-32 of a file (if it still matches the key it was read with); failures (e.g. no extended attribute support, or no permission) only disable the cache
+void crcCacheWrite(int fd, const crc_cache_key_t *key, uint32_t crc)
+{
+#ifdef ZIPPAST_XATTR
+	crc_cache_key_t current;
+	if (!crcCacheKey(fd, &current) || memcmp(&current, key, sizeof(crc_cache_key_t))) return;
+	unsigned char p[CRC_CACHE_SIZE];
+	memcpy(p, "ZPCR", 4);
+	writeQword(p + 4, key->inode);
+	writeQword(p + 12, key->size);
+	writeQword(p + 20, key->mtime);
+	ZIP_WRITE_DWORD(p + 28, crc);
+	if (fsetxattr(fd, CRC_CACHE_ATTRIBUTE, p, sizeof(p), 0) != 0) fprintf(stderr, "WARNING: CRC not cached: %s\n", strerror(errno));
+#else
+	(void)fd; (void)key; (void)crc;
+#endif
+}
+
+// Resumable output: the output is written in chunks, each synced to storage before a small journal is replaced (atomically) to record it.
+// A rerun with the same arguments and input regenerates the output in memory, verifies the committed prefix of the file against the journal,
+// and continues from there.  Journal (48 bytes, little-endian):
+//   "ZPCK", uint32 version, uint64 key (hash of the arguments and input), uint64 output length, uint64 bytes committed,
+//   uint32 CRC-32 of the committed bytes, uint32 entries committed (whole entries before the committed position), uint32 entry count, uint32 reserved
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_SIZE 48
+
+typedef struct
+{
+	uint64_t key;
+	uint64_t length;
+	uint64_t committed;
+	uint32_t crc;
+	uint32_t entries;
+	uint32_t count;
+} checkpoint_t;
+
+// Key identifying a conversion: the options that affect the output, and the input's name, length and modification time
+// (every option that changes the output bytes must be included, otherwise a journal from another conversion could be resumed)
+#define CHECKPOINT_KEY_VALUES 7
+uint64_t checkpointKey(const char *inputFile, uint64_t inputLength, const zippast_options_t *options)
+{
+	uint64_t values[CHECKPOINT_KEY_VALUES];
+	values[0] = (uint64_t)options->mode;
+	values[1] = (uint64_t)options->commentPad;
+	values[2] = (uint64_t)options->convert;
+	values[3] = (uint64_t)options->alignment;
+	values[4] = (uint64_t)options->repackMin;
+	values[5] = inputLength;
+	values[6] = 0;
+	struct stat st;
+	if (stat(inputFile, &st) == 0) values[6] = (uint64_t)st.st_mtime;
+	uint64_t key = hashName((const unsigned char *)inputFile, strlen(inputFile));
+	for (int i = 0; i < CHECKPOINT_KEY_VALUES; i++)
+	{
+		unsigned char bytes[8];
+		writeQword(bytes, values[i]);
+		key ^= hashName(bytes, sizeof(bytes)) + (key << 6) + (key >> 2);
+	}
+	return key;
+}
+
+static bool checkpointRead(const char *journalFile, checkpoint_t *checkpoint)
+{
+	unsigned char p[CHECKPOINT_SIZE];
+	FILE *fp = fopen(journalFile, "rb");
+	if (fp == NULL) return false;
+	bool valid = fread(p, 1, sizeof(p), fp) == sizeof(p) && !memcmp(p, "ZPCK", 4) && ZIP_READ_DWORD(p + 4) == CHECKPOINT_VERSION;
+	fclose(fp);
+	if (!valid) return false;
+	checkpoint->key = readQword(p + 8);
+	checkpoint->length = readQword(p + 16);
+	checkpoint->committed = readQword(p + 24);
+	checkpoint->crc = (uint32_t)ZIP_READ_DWORD(p + 32);
+	checkpoint->entries = (uint32_t)ZIP_READ_DWORD(p + 36);
+	checkpoint->count = (uint32_t)ZIP_READ_DWORD(p + 40);
+	return checkpoint->committed <= checkpoint->length;
+}
+
+// Replace the journal (written to a temporary file, synced, then renamed over the old one)
+static bool checkpointWrite(const char *journalFile, const checkpoint_t *checkpoint)
+{
+	unsigned char p[CHECKPOINT_SIZE];
+	memset(p, 0, sizeof(p));
+	memcpy(p, "ZPCK", 4);
+	ZIP_WRITE_DWORD(p + 4, CHECKPOINT_VERSION);
+	writeQword(p + 8, checkpoint->key);
+	writeQword(p + 16, checkpoint->length);
+	writeQword(p + 24, checkpoint->committed);
+	ZIP_WRITE_DWORD(p + 32, checkpoint->crc);
+	ZIP_WRITE_DWORD(p + 36, checkpoint->entries);
+	ZIP_WRITE_DWORD(p + 40, checkpoint->count);
+	char *tempFile = (char *)malloc(strlen(journalFile) + 5);
+	if (tempFile == NULL) return false;
+	sprintf(tempFile, "%s.tmp", journalFile);
+	FILE *fp = fopen(tempFile, "wb");
+	bool result = fp != NULL && fwrite(p, 1, sizeof(p), fp) == sizeof(p) && fileSync(fp);
+	if (fp != NULL && fclose(fp) != 0) result = false;
+	result = result && fileReplace(tempFile, journalFile);
+	if (!result) { perror("ERROR: Problem writing checkpoint journal"); remove(tempFile); }
+	free(tempFile);
+	return result;
+}
+
+// Contiguous span of the output at a position (within the header, contents or comment pad), returns the pointer and the length to the end of that part
+static const unsigned char *outputSpan(const zippast_output_t *output, uint64_t position, size_t *length)
+{
+	if (position < output->headerSize) { *length = (size_t)(output->headerSize - position); return output->header + position; }
+	position -= output->headerSize;
+	if (position < output->contentsLength) { *length = (size_t)(output->contentsLength - position); return output->contents + position; }
+	position -= output->contentsLength;
+	*length = (size_t)(output->commentPad - position);
+	return output->comment + position;
+}
+
+// Verify the committed prefix of an existing output file against the journal (and the regenerated output)
+static bool checkpointVerify(FILE *fp, const zippast_output_t *output, const checkpoint_t *checkpoint)
+{
+	const size_t chunkSize = 1 << 20;
+	unsigned char *chunk = (unsigned char *)malloc(chunkSize);
+	if (chunk == NULL || !fileSeek(fp, 0)) { free(chunk); return false; }
+	unsigned long crc = CRC32_INIT;
+	bool match = true;
+	for (uint64_t position = 0; match && position < checkpoint->committed; )
+	{
+		size_t length;
+		const unsigned char *span = outputSpan(output, position, &length);
+		if (length > chunkSize) length = chunkSize;
+		if (length > checkpoint->committed - position) length = (size_t)(checkpoint->committed - position);
+		match = fread(chunk, 1, length, fp) == length && !memcmp(chunk, span, length);
+		crc = crc32(crc, chunk, length);
+		position += length;
+	}
+	free(chunk);
+	return match && (uint32_t)crc == checkpoint->crc;
+}
+
+// Write the generated output to a file, resuming from (and recording progress in) the checkpoint journal
+bool writeOutputCheckpointed(const char *outputFile, const zippast_output_t *output, digest_t *digest, const zippast_options_t *options, uint64_t key, progress_t *progress)
+{
+	checkpoint_t checkpoint;
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	uint64_t total = (uint64_t)output->headerSize + output->contentsLength + output->commentPad;
+
+	// Resume from a matching journal if the committed prefix of the output is intact
+	FILE *fp = NULL;
+	bool journal = checkpointRead(options->checkpointFile, &checkpoint);
+	if (journal && (checkpoint.key != key || checkpoint.length != total))
+	{
+		fprintf(stderr, "WARNING: Checkpoint journal is for a different conversion, restarting: %s\n", options->checkpointFile);
+	}
+	else if (journal && checkpoint.committed > 0)
+	{
+		fp = fopen(outputFile, "r+b");
+		if (fp != NULL && checkpointVerify(fp, output, &checkpoint))
+		{
+			fprintf(stderr, "ZIPPAST: Resuming: %llu of %llu bytes already written (%u of %u entries).\n", (unsigned long long)checkpoint.committed, (unsigned long long)total, checkpoint.entries, checkpoint.count);
+		}
+		else
+		{
+			fprintf(stderr, "WARNING: Output does not match the checkpoint journal, restarting: %s\n", outputFile);
+			if (fp != NULL) fclose(fp);
+			fp = NULL;
+		}
+	}
+	if (fp == NULL)
+	{
+		checkpoint.committed = 0;
+		checkpoint.crc = CRC32_INIT;
+		fp = fopen(outputFile, "wb");
+		if (fp == NULL) { perror("ERROR: Problem opening output file"); return false; }
+	}
+	checkpoint.key = key;
+	checkpoint.length = total;
+	checkpoint.count = (uint32_t)output->entries.count;
+
+	digest_job_t job;
+	job.digest = digest;
+	job.output = output;
+	zippast_thread_t thread;
+	bool threaded = (digest != NULL) && ThreadCreate(&thread, DigestWorker, &job);
+	if (digest != NULL && !threaded) DigestWorker(&job);
+
+	outputProgressStart(progress, output, checkpoint.committed);
+
+	// Write each chunk up to the next checkpoint, sync it, then record it
+	uint64_t interval = options->checkpointInterval > 0 ? options->checkpointInterval : total;
+	bool result = fileSeek(fp, checkpoint.committed);
+	while (result && checkpoint.committed < total)
+	{
+		uint64_t end = (checkpoint.committed / interval + 1) * interval;
+		if (end > total) end = total;
+		unsigned long crc = checkpoint.crc;
+		for (uint64_t position = checkpoint.committed; result && position < end; )
+		{
+			size_t length;
+			const unsigned char *span = outputSpan(output, position, &length);
+			if (length > end - position) length = (size_t)(end - position);
+			result = fileWriteData(fp, span, length, progress);
+			crc = crc32Parallel(crc, span, length, options->threads);
+			position += length;
+		}
+		result = result && fileSync(fp);
+		if (!result) break;
+		checkpoint.committed = end;
+		checkpoint.crc = (uint32_t)crc;
+		checkpoint.entries = outputEntriesBefore(output, end);
+		if (end < total) result = checkpointWrite(options->checkpointFile, &checkpoint);
+	}
+	if (fclose(fp) != 0) result = false;
+	if (threaded) ThreadJoin(thread);
+	if (!result || !ProgressEnd(progress))
+	{
+		fprintf(stderr, "%s: Problem writing file contents (rerun to resume from the last checkpoint).\n", (progress != NULL && progress->cancelled) ? "ZIPPAST: Cancelled" : "ERROR");
+		return false;
+	}
+
+	// Complete: the journal is no longer needed
+	remove(options->checkpointFile);
+	return true;
+}
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define ZIPPAST_PWRITE
+#endif
+
+#ifdef ZIPPAST_PWRITE
+// Create the output file, preallocated to its planned length (so that it is allocated up front and can be written at known offsets in any order), returns the file descriptor or -1
+int outputCreate(const char *outputFile, uint64_t length)
+{
+	int fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) return -1;
+#if defined(__linux__)
+	struct stat st;
+	if (length > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && fallocate(fd, 0, 0, (off_t)length) != 0)
+	{
+		// (not supported by every file system: the file is then extended as it is written)
+		if (errno != EOPNOTSUPP && errno != ENOSYS) { perror("ERROR: Problem preallocating output file"); close(fd); remove(outputFile); return -1; }
+	}
+#else
+	(void)length;
+#endif
+	return fd;
+}
+
+#define OUTPUT_PARALLEL_CHUNK (8 * 1024 * 1024)
+
+typedef struct
+{
+	const zippast_output_t *output;
+	int fd;
+	uint64_t length;
+	progress_t *progress;
+	zippast_mutex_t mutex;
+	volatile bool failed;
+} output_parallel_t;
+
+static void outputParallelChunk(void *context, int index)
+{
+	output_parallel_t *job = (output_parallel_t *)context;
+	uint64_t position = (uint64_t)index * OUTPUT_PARALLEL_CHUNK;
+	uint64_t end = position + OUTPUT_PARALLEL_CHUNK;
+	if (end > job->length) end = job->length;
+	while (!job->failed && position < end)
+	{
+		size_t length;
+		const unsigned char *span = outputSpan(job->output, position, &length);
+		if (length > end - position) length = (size_t)(end - position);
+		if (length > IO_CHUNK) length = IO_CHUNK;
+		IoThrottle(0, length);
+		ssize_t written = pwrite(job->fd, span, length, (off_t)position);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) { job->failed = true; break; }
+		position += (uint64_t)written;
+		MutexLock(&job->mutex);
+		if (!ProgressUpdate(job->progress, (uint64_t)written)) job->failed = true;
+		MutexUnlock(&job->mutex);
+	}
+}
+
+// Write the generated output to a preallocated file, in parallel chunks at their known offsets (and calculate its digests, if 'digest' is not NULL; with progress, if 'progress' is not NULL)
+bool writeOutputParallel(int fd, const zippast_output_t *output, digest_t *digest, progress_t *progress, int threads)
+{
+	digest_job_t digestJob;
+	digestJob.digest = digest;
+	digestJob.output = output;
+	zippast_thread_t thread;
+	bool threaded = (digest != NULL) && ThreadCreate(&thread, DigestWorker, &digestJob);
+	if (digest != NULL && !threaded) DigestWorker(&digestJob);
+	outputProgressStart(progress, output, 0);
+
+	output_parallel_t job;
+	job.output = output;
+	job.fd = fd;
+	job.length = (uint64_t)output->headerSize + output->contentsLength + output->commentPad;
+	job.progress = progress;
+	job.failed = false;
+	MutexInit(&job.mutex);
+	int chunks = (int)((job.length + OUTPUT_PARALLEL_CHUNK - 1) / OUTPUT_PARALLEL_CHUNK);
+	parallelFor(chunks, threads, outputParallelChunk, &job);
+	MutexDestroy(&job.mutex);
+
+	// Trim to the written length (in case the preallocation differed)
+	bool result = !job.failed && ftruncate(fd, (off_t)job.length) == 0 && ProgressEnd(progress);
+	if (threaded) ThreadJoin(thread);
+	if (!result)
+	{
+		if (progress == NULL || !progress->cancelled) fprintf(stderr, "ERROR: Problem writing file contents.\n");
+		return false;
+	}
+	return true;
+}
+#endif
+
+// Fan-out of the output to several destinations (-tee): each has its own writer thread, reading from the shared generated output (which is already in memory, so nothing is copied or buffered per destination)
+struct output_tee_tag_t;
+
+typedef struct
+{
+	const zippast_sink_t *sink;
+	struct output_tee_tag_t *tee;
+	FILE *fp;
+	bool created;			// a regular file was created (removed if incomplete)
+	uint64_t position;
+	bool failed;
+} tee_sink_t;
+
+typedef struct output_tee_tag_t
+{
+	const zippast_output_t *output;
+	uint64_t length;
+	progress_t *progress;
+	uint64_t reported;		// progress is of the slowest destination
+	tee_sink_t *sinks;
+	int count;
+	zippast_mutex_t mutex;
+	volatile bool abort;	// a required destination failed (or cancelled): stop all of them
+} output_tee_t;
+
+// Open a destination: a file, "-" for standard output, or "fd:<n>"
+static bool teeSinkOpen(tee_sink_t *sink)
+{
+	const char *path = sink->sink->path;
+	if (!strcmp(path, "-") || path[0] == '\0') { sink->fp = stdout; return true; }
+	if (!strncmp(path, "fd:", 3))
+	{
+		char *end;
+		long fd = strtol(path + 3, &end, 0);
+		int copy = (end != path + 3 && *end == '\0' && fd >= 0) ? dup((int)fd) : -1;
+		sink->fp = copy >= 0 ? fdopen(copy, "wb") : NULL;
+		if (sink->fp == NULL && copy >= 0) close(copy);
+		return sink->fp != NULL;
+	}
+	sink->fp = fopen(path, "wb");
+	if (sink->fp == NULL) return false;
+	struct stat st;
+	sink->created = (fstat(fileno(sink->fp), &st) == 0 && (st.st_mode & S_IFMT) == S_IFREG);		// (not e.g. a device; no S_ISREG() on MSVC)
+	return true;
+}
+
+// (with the lock held) A destination failed: report it, and stop the others if it was required
+static void teeSinkFailed(output_tee_t *tee, tee_sink_t *sink)
+{
+	sink->failed = true;
+	if (tee->progress != NULL && tee->progress->cancelled) { tee->abort = true; return; }
+	fprintf(stderr, "%s: Problem writing output: %s\n", sink->sink->optional ? "WARNING" : "ERROR", sink->sink->path[0] != '\0' ? sink->sink->path : "-");
+	if (!sink->sink->optional) tee->abort = true;
+}
+
+static void *teeSinkWorker(void *arg)
+{
+	tee_sink_t *sink = (tee_sink_t *)arg;
+	output_tee_t *tee = sink->tee;
+	while (!tee->abort && !sink->failed && sink->position < tee->length)
+	{
+		size_t length;
+		const unsigned char *span = outputSpan(tee->output, sink->position, &length);
+		if (length > IO_CHUNK) length = IO_CHUNK;
+		bool written = fileWriteData(sink->fp, span, length, NULL);
+		MutexLock(&tee->mutex);
+		if (!written)
+		{
+			teeSinkFailed(tee, sink);
+		}
+		else
+		{
+			sink->position += length;
+			uint64_t slowest = tee->length;
+			for (int i = 0; i < tee->count; i++) if (!tee->sinks[i].failed && tee->sinks[i].position < slowest) slowest = tee->sinks[i].position;
+			if (slowest > tee->reported)
+			{
+				if (!ProgressUpdate(tee->progress, slowest - tee->reported)) tee->abort = true;
+				tee->reported = slowest;
+			}
+		}
+		MutexUnlock(&tee->mutex);
+	}
+	if (!tee->abort && !sink->failed && fflush(sink->fp) != 0)
+	{
+		MutexLock(&tee->mutex);
+		teeSinkFailed(tee, sink);
+		MutexUnlock(&tee->mutex);
+	}
+	return NULL;
+}
+
+// Write the generated output to each destination concurrently (and calculate its digests, if 'digest' is not NULL; with progress, if 'progress' is not NULL).  Fails if a required destination fails; an optional one that fails is removed.
+bool writeOutputTee(const zippast_sink_t *sinks, int count, const zippast_output_t *output, digest_t *digest, progress_t *progress)
+{
+	output_tee_t tee;
+	memset(&tee, 0, sizeof(tee));
+	tee.output = output;
+	tee.length = (uint64_t)output->headerSize + output->contentsLength + output->commentPad;
+	tee.progress = progress;
+	tee.count = count;
+	tee.sinks = (tee_sink_t *)calloc(count, sizeof(tee_sink_t));
+	zippast_thread_t *threads = (zippast_thread_t *)calloc(count, sizeof(zippast_thread_t));
+	bool *threaded = (bool *)calloc(count, sizeof(bool));
+	if (tee.sinks == NULL || threads == NULL || threaded == NULL) { perror("ERROR: Problem allocating output destinations"); free(tee.sinks); free(threads); free(threaded); return false; }
+	MutexInit(&tee.mutex);
+
+	// Open every destination before writing any
+	for (int i = 0; i < count; i++)
+	{
+		tee_sink_t *sink = &tee.sinks[i];
+		sink->sink = &sinks[i];
+		sink->tee = &tee;
+		if (!teeSinkOpen(sink))
+		{
+			fprintf(stderr, "%s: Problem opening output: %s (%s)\n", sinks[i].optional ? "WARNING" : "ERROR", sinks[i].path, strerror(errno));
+			sink->failed = true;
+			if (!sinks[i].optional) tee.abort = true;
+		}
+	}
+
+	digest_job_t digestJob;
+	digestJob.digest = digest;
+	digestJob.output = output;
+	zippast_thread_t digestThread;
+	bool digestThreaded = false;
+	if (!tee.abort)
+	{
+		digestThreaded = (digest != NULL) && ThreadCreate(&digestThread, DigestWorker, &digestJob);
+		if (digest != NULL && !digestThreaded) DigestWorker(&digestJob);
+		outputProgressStart(progress, output, 0);
+
+		// One writer per destination (in turn, without threads)
+		for (int i = 0; i < count; i++) if (!tee.sinks[i].failed) threaded[i] = ThreadCreate(&threads[i], teeSinkWorker, &tee.sinks[i]);
+		for (int i = 0; i < count; i++) if (!tee.sinks[i].failed && !threaded[i]) teeSinkWorker(&tee.sinks[i]);
+		for (int i = 0; i < count; i++) if (threaded[i]) ThreadJoin(threads[i]);
+	}
+
+	bool result = !tee.abort && ProgressEnd(progress);
+	if (digestThreaded) ThreadJoin(digestThread);
+	for (int i = 0; i < count; i++)
+	{
+		tee_sink_t *sink = &tee.sinks[i];
+		if (sink->fp != NULL && sink->fp != stdout && fclose(sink->fp) != 0 && !sink->failed)
+		{
+			fprintf(stderr, "%s: Problem writing output: %s\n", sinks[i].optional ? "WARNING" : "ERROR", sinks[i].path);
+			sink->failed = true;
+			if (!sinks[i].optional) result = false;
+		}
+		if (sink->created && (sink->failed || !result)) remove(sinks[i].path);		// (incomplete)
+	}
+	MutexDestroy(&tee.mutex);
+	free(tee.sinks);
+	free(threads);
+	free(threaded);
+	return result;
+}
+
+int process(const char *inputFile, const char *outputFile, const zippast_options_t *options)
+{
+	progress_t progress;
+	ProgressInit(&progress, options->progress, options->progressContext);
+
+	// Read content
+	fprintf(stderr, "ZIPPAST: Reading: %s\n", inputFile);
+	FILE *fp = fopen(inputFile, "rb");
+	if (fp == NULL) { perror("ERROR: Problem opening input file"); return 1; }
+	crc_cache_key_t crcKey;
+	bool crcKeyed = options->crcCache && crcCacheKey(fileno(fp), &crcKey);
+	size_t contentsLength = 0;
+	unsigned char *contents = NULL;
+	size_t capacity = 0;
+	if (readStream(fp, &contents, &capacity, &contentsLength, &progress) == NULL) { BufferFree(contents); contents = NULL; }
+
+	// A wrapped input's CRC may already be known from an earlier run
+	zippast_options_t generateOptions = *options;
+	bool crcStore = contents != NULL && crcKeyed && !isZip(contents, contentsLength);
+	if (crcStore && crcCacheRead(fileno(fp), &crcKey, &generateOptions.inputCrc))
+	{
+		fprintf(stderr, "ZIPPAST: Using cached CRC: %08x\n", (unsigned int)generateOptions.inputCrc);
+		generateOptions.inputCrcKnown = true;
+		crcStore = false;
+	}
+	fclose(fp);
+	if (contents == NULL) { return 1; }
+	uint64_t key = options->checkpointFile != NULL ? checkpointKey(inputFile, contentsLength, options) : 0;
+
+	// Input digests (before the contents are modified in-place)
+	digest_t inputDigest, outputDigest;
+	if (options->digests && options->digestInput)
+	{
+		DigestInit(&inputDigest, options->digests);
+		DigestUpdate(&inputDigest, contents, contentsLength);
+	}
+	if (options->digests) DigestInit(&outputDigest, options->digests);
+
+	// Plan the output layout (from the central directory), rejecting an input that cannot be converted before any work is done
+	zippast_plan_t plan;
+	if (!zippastPlan(findFilename(inputFile), contents, contentsLength, options, &plan)) { BufferFree(contents); return 1; }
+	uint64_t plannedLength = plan.repackMin > 0 ? 0 : plan.length;		// (unknown until repacked)
+	zippastPlanFree(&plan);
+
+	// (an existing output is only replaced once the conversion has succeeded)
+	zippast_output_t output;
+	if (!zippastGenerate(findFilename(inputFile), contents, contentsLength, &generateOptions, &output)) { return 1; }
+#ifdef ZIPPAST_XATTR
+	if (crcStore && output.entries.count == 1)
+	{
+		int inputFd = open(inputFile, O_RDONLY);
+		if (inputFd >= 0) { crcCacheWrite(inputFd, &crcKey, output.entries.crc32[0]); close(inputFd); }
+	}
+#endif
+	uint64_t outputLength = (uint64_t)output.headerSize + output.contentsLength + output.commentPad;
+	if (plannedLength > 0 && outputLength != plannedLength) fprintf(stderr, "WARNING: Output length differs from the plan.\n");
+#ifdef ZIPPAST_PWRITE
+	// Preallocated at its final size before it is written
+	int fd = -1;
+	if (options->checkpointFile == NULL && options->teeCount == 0 && outputFile[0] != '\0' && strcmp(outputFile, "-") && !s_io.dropCache)
+	{
+		fd = outputCreate(outputFile, outputLength);
+		if (fd < 0) { perror("ERROR: Problem opening output file"); zippastOutputFree(&output); return 1; }
+	}
+#endif
+
+	// Write output
+	fprintf(stderr, "ZIPPAST: Writing: %s\n", outputFile);
+	if (options->checkpointFile != NULL)
+	{
+		bool written = writeOutputCheckpointed(outputFile, &output, options->digests ? &outputDigest : NULL, options, key, &progress);
+		if (written && options->digests) { written = writeDigests(options, options->digestInput ? &inputDigest : NULL, inputFile, &outputDigest, outputFile, stdout); }
+		if (written && options->indexFile != NULL) { written = writeIndexFile(options->indexFile, &output); }
+		zippastOutputFree(&output);
+		return written ? 0 : 1;
+	}
+#ifdef ZIPPAST_PWRITE
+	if (fd >= 0)
+	{
+		// Regular files are written in parallel at their planned offsets (otherwise, e.g. a device or pipe, as a stream)
+		struct stat st;
+		bool written;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		{
+			written = writeOutputParallel(fd, &output, options->digests ? &outputDigest : NULL, &progress, options->threads);
+			if (close(fd) != 0) written = false;
+		}
+		else
+		{
+			FILE *stream = fdopen(fd, "wb");
+			written = stream != NULL && writeOutput(stream, &output, options->digests ? &outputDigest : NULL, &progress);
+			if (stream != NULL ? fclose(stream) != 0 : close(fd) != 0) written = false;
+		}
+		if (!written) remove(outputFile);		// (incomplete, e.g. cancelled)
+		if (written && options->digests) { written = writeDigests(options, options->digestInput ? &inputDigest : NULL, inputFile, &outputDigest, outputFile, stdout); }
+		if (written && options->indexFile != NULL) { written = writeIndexFile(options->indexFile, &output); }
+		zippastOutputFree(&output);
+		return written ? 0 : 1;
+	}
+#endif
+	if (options->teeCount > 0)
+	{
+		// The output, and each further destination, written concurrently
+		zippast_sink_t *sinks = (zippast_sink_t *)malloc((options->teeCount + 1) * sizeof(zippast_sink_t));
+		if (sinks == NULL) { perror("ERROR: Problem allocating output destinations"); zippastOutputFree(&output); return 1; }
+		sinks[0].path = outputFile;
+		sinks[0].optional = false;
+		bool toStdout = (outputFile[0] == '\0' || !strcmp(outputFile, "-"));
+		for (int i = 0; i < options->teeCount; i++)
+		{
+			sinks[i + 1] = options->tees[i];
+			fprintf(stderr, "ZIPPAST: Writing: %s%s\n", sinks[i + 1].path, sinks[i + 1].optional ? " (optional)" : "");
+			if (!strcmp(sinks[i + 1].path, "-")) toStdout = true;
+		}
+		bool written = writeOutputTee(sinks, options->teeCount + 1, &output, options->digests ? &outputDigest : NULL, &progress);
+		free(sinks);
+		if (written && options->digests) { written = writeDigests(options, options->digestInput ? &inputDigest : NULL, inputFile, &outputDigest, outputFile, toStdout ? stderr : stdout); }
+		if (written && options->indexFile != NULL) { written = writeIndexFile(options->indexFile, &output); }
+		zippastOutputFree(&output);
+		return written ? 0 : 1;
+	}
+	fp = stdout;
+	if (outputFile[0] != '\0' && strcmp(outputFile, "-")) fp = fopen(outputFile, "wb");		// ("-" is standard output, as for -tee)
+	if (fp == NULL) { perror("ERROR: Problem opening output file"); zippastOutputFree(&output); return 1; }
+	bool written = writeOutput(fp, &output, options->digests ? &outputDigest : NULL, &progress);
+	if (fp != stdout)
+	{
+		fclose(fp);
+		if (!written) remove(outputFile);		// (incomplete, e.g. cancelled)
+	}
+	if (written && options->digests) { written = writeDigests(options, options->digestInput ? &inputDigest : NULL, inputFile, &outputDigest, outputFile, fp == stdout ? stderr : stdout); }
+	if (written && options->indexFile != NULL) { written = writeIndexFile(options->indexFile, &output); }
+	zippastOutputFree(&output);
+	if (!written) { return 1; }
+
+	return 0;
+}
+
+// Dry run: report the planned output layout, without converting or writing the output (the input is mapped where possible, so only the central directory and local headers are read)
+int planFile(const char *inputFile, const char *outputFile, const zippast_options_t *options)
+{
+	FILE *fp = fopen(inputFile, "rb");
+	if (fp == NULL) { perror("ERROR: Problem opening input file"); return 1; }
+	uint64_t length = fileLength(fp);
+	if (length == UINT64_MAX || length > SIZE_MAX) { fprintf(stderr, "ERROR: Problem determining input file length.\n"); fclose(fp); return 1; }
+	unsigned char *contents = NULL;
+	bool mapped = false;
+#ifdef ZIPPAST_MMAP
+	if (length > 0)
+	{
+		void *map = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, fileno(fp), 0);
+		if (map != MAP_FAILED) { contents = (unsigned char *)map; mapped = true; }
+	}
+#endif
+	size_t contentsLength = (size_t)length;
+	if (!mapped)
+	{
+		size_t capacity = 0;
+		if (readStream(fp, &contents, &capacity, &contentsLength, NULL) == NULL) { BufferFree(contents); contents = NULL; }
+	}
+	fclose(fp);
+	if (contents == NULL && contentsLength > 0) return 1;
+
+	zippast_plan_t plan;
+	bool result = zippastPlan(findFilename(inputFile), contents, contentsLength, options, &plan);
+	if (result)
+	{
+		fprintf(stderr, "ZIPPAST: Plan: %s -> %s\n", inputFile, outputFile);
+		zippastPlanReport(&plan, contents, findFilename(inputFile), stdout);
+		zippastPlanFree(&plan);
+	}
+#ifdef ZIPPAST_MMAP
+	if (mapped) munmap(contents, (size_t)length);
+#endif
+	if (!mapped) BufferFree(contents);
+	return result ? 0 : 1;
+}
+
+// Append files to an archive already output by zippast, in place: the new local entries overwrite the old central directory, followed by the new central directory, EOCD and the same comment pad.
+// The cost is proportional to the added data (and the size of the central directory), not the archive size.
+// Every file is checked before the archive is modified, and if appending still fails, the old central directory and end are restored.
+int appendFiles(const char *archiveFile, const char **files, int fileCount, int threads)
+{
+	FILE *fp = fopen(archiveFile, "r+b");
+	if (fp == NULL) { perror("ERROR: Problem opening archive to append to"); return 1; }
+	uint64_t length = fileLength(fp);
+
+	// Locate the EOCD past the comment pad
+	size_t tailLength = (size_t)(length < 0xffff + 22 ? length : 0xffff + 22);
+	uint64_t tailOffset = length - tailLength;
+	unsigned char *tail = (unsigned char *)malloc(tailLength > 0 ? tailLength : 1);
+	unsigned char signature[4] = { 0 };
+	size_t eocd = 0;
+	if (length == UINT64_MAX || tail == NULL || !fileRead(fp, tailOffset, tail, tailLength) || !fileRead(fp, 0, signature, sizeof(signature)) || !zipFindEocd(tail, tailLength, tailOffset, &eocd))
+	{
+		fprintf(stderr, "ERROR: Archive to append to is not a valid ZIP file: %s\n", archiveFile);
+		free(tail); fclose(fp);
+		return 1;
+	}
+	if ((signature[0] == 'B' && signature[1] == 'M') || (signature[0] == 'R' && signature[1] == 'I' && signature[2] == 'F' && signature[3] == 'F'))
+	{
+		fprintf(stderr, "ERROR: Cannot append to a .bmp/.wav container (its header records the file size).\n");
+		free(tail); fclose(fp);
+		return 1;
+	}
+	int numRecords = ZIP_READ_WORD(tail + eocd + 10);					// Total number of central directory records
+	unsigned long cdSize = (uint32_t)ZIP_READ_DWORD(tail + eocd + 12);	// Size of central directory
+	unsigned long cd = (uint32_t)ZIP_READ_DWORD(tail + eocd + 16);		// Offset of start of central directory (file offset, as already patched)
+	size_t commentPad = ZIP_READ_WORD(tail + eocd + 20);
+	if ((uint64_t)cd + cdSize != tailOffset + eocd)
+	{
+		fprintf(stderr, "ERROR: Archive central directory is not where expected (has it been processed by zippast?): %s\n", archiveFile);
+		free(tail); fclose(fp);
+		return 1;
+	}
+	if (numRecords + fileCount > 0xffff) { fprintf(stderr, "ERROR: Too many entries for archive.\n"); free(tail); fclose(fp); return 1; }
+
+	// Check the files can be read before overwriting anything
+	for (int i = 0; i < fileCount; i++)
+	{
+		const char *filename = findFilename(files[i]);
+		if (strlen(filename) >= ZIP_WRITER_MAX_PATH) { fprintf(stderr, "ERROR: File name too long: %s\n", filename); free(tail); fclose(fp); return 1; }
+		FILE *in = fopen(files[i], "rb");
+		uint64_t inLength = (in != NULL) ? fileLength(in) : UINT64_MAX;
+		if (in != NULL) fclose(in);
+		if (inLength == UINT64_MAX) { fprintf(stderr, "ERROR: Problem opening file to append: %s\n", files[i]); free(tail); fclose(fp); return 1; }
+	}
+
+	// Keep the old central directory and comment pad
+	unsigned char *oldCd = (unsigned char *)malloc(cdSize > 0 ? cdSize : 1);
+	unsigned char *comment = (unsigned char *)malloc(commentPad > 0 ? commentPad : 1);
+	zipwriter_file_t *entries = (zipwriter_file_t *)malloc(fileCount * sizeof(zipwriter_file_t));
+	unsigned char *buffer = (unsigned char *)malloc(ZIP_WRITER_SIZE_MAX);
+	bool result = oldCd != NULL && comment != NULL && entries != NULL && buffer != NULL && fileRead(fp, cd, oldCd, cdSize);
+	if (result && commentPad > 0) memcpy(comment, tail + eocd + 22, commentPad);
+
+	// New local entries, where the old central directory began
+	zipwriter_t zip;
+	ZIPWriterInitializeAt(&zip, cd);
+	for (int i = 0; result && i < fileCount; i++)
+	{
+		const char *filename = findFilename(files[i]);
+		fprintf(stderr, "ZIPPAST: Appending: %s\n", files[i]);
+		size_t contentsLength = 0;
+		unsigned char *contents = readFile(files[i], &contentsLength);
+		if (contents == NULL) { result = false; break; }
+		uint64_t offset = zip.length;
+		int headerLength = ZIPWriterStartFile(&zip, &entries[i], filename, ZIP_DATETIME(2000,1,1,0,0,0), 0, buffer);
+		result = fileWrite(fp, offset, buffer, headerLength) && fileWriteData(fp, contents, contentsLength, NULL);
+		ZIPWriterFileContentCrc(&zip, crc32Parallel(CRC32_INIT, contents, contentsLength, threads), contentsLength);
+		BufferFree(contents);
+		int descriptorLength = ZIPWriterEndFile(&zip, buffer);
+		result = result && fwrite(buffer, 1, descriptorLength, fp) == (size_t)descriptorLength;
+	}
+
+	// Old central directory, new entries, and end
+	if (result)
+	{
+		uint64_t offset = zip.length;
+		ZIPWriterCentralDirectoryExisting(&zip, cdSize, numRecords);
+		result = fileWrite(fp, offset, oldCd, cdSize);
+		size_t newCdSize = ZIPWriterCentralDirectorySize(&zip);
+		unsigned char *newCd = (unsigned char *)malloc(newCdSize > 0 ? newCdSize : 1);
+		if (newCd == NULL) { perror("ERROR: Problem allocating central directory"); result = false; }
+		else
+		{
+			size_t entryLength = ZIPWriterCentralDirectory(&zip, newCd, threads);
+			result = result && fwrite(newCd, 1, entryLength, fp) == entryLength;
+			free(newCd);
+		}
+		int endLength = ZIPWriterCentralDirectoryEnd(&zip, buffer);
+		ZIP_WRITE_WORD(buffer + 20, commentPad);
+		result = result && fwrite(buffer, 1, endLength, fp) == (size_t)endLength && fwrite(comment, 1, commentPad, fp) == commentPad;
+	}
+	result = result && fflush(fp) == 0;
+
+	// On failure, put back the old central directory, end record and comment pad (as they were), and the original length
+	bool restored = true;
+	if (!result && oldCd != NULL)
+	{
+		restored = fileWrite(fp, cd, oldCd, cdSize) && fileWrite(fp, tailOffset + eocd, tail + eocd, tailLength - eocd) && fileTruncate(fp, length);
+	}
+	if (fclose(fp) != 0) { result = false; restored = false; }
+	free(tail);
+	free(oldCd);
+	free(comment);
+	free(entries);
+	free(buffer);
+	if (!result && restored) { fprintf(stderr, "ERROR: Problem appending to archive (the archive is unchanged): %s\n", archiveFile); return 1; }
+	if (!result) { fprintf(stderr, "ERROR: Problem appending to archive (the archive may now be damaged): %s\n", archiveFile); return 1; }
+	fprintf(stderr, "ZIPPAST: Appended %d file(s), %d entries in total.\n", fileCount, numRecords + fileCount);
+	return 0;
+}
+
+// Inflate (raw deflate decoder, after Mark Adler's "puff"): decodes a whole stream into a buffer of known size
+typedef struct
+{
+	short counts[16];	// number of codes of each length
+	short symbols[288];	// symbols ordered by code
+} huffman_t;
+
+typedef struct
+{
+	const unsigned char *in;
+	size_t inLength;
+	size_t inPos;
+	uint32_t bitBuffer;
+	int bitCount;
+	unsigned char *out;
+	size_t outLength;
+	size_t outPos;
+	bool error;
+} inflate_t;
+
+static int inflateBits(inflate_t *s, int need)
+{
+	uint32_t value = s->bitBuffer;
+	while (s->bitCount < need)
+	{
+		if (s->inPos >= s->inLength) { s->error = true; return 0; }
+		value |= (uint32_t)s->in[s->inPos++] << s->bitCount;
+		s->bitCount += 8;
+	}
+	s->bitBuffer = value >> need;
+	s->bitCount -= need;
+	return (int)(value & ((1UL << need) - 1));
+}
+
+static int inflateDecode(inflate_t *s, const huffman_t *h)
+{
+	int code = 0, first = 0, index = 0;
+	for (int len = 1; len < 16; len++)
+	{
+		code |= inflateBits(s, 1);
+		int count = h->counts[len];
+		if (code - count < first) return h->symbols[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	s->error = true;
+	return -1;
+}
+
+// Build a canonical Huffman decoding table from code lengths, returns false if over-subscribed
+static bool inflateBuild(huffman_t *h, const short *lengths, int n)
+{
+	short offsets[16];
+	memset(h->counts, 0, sizeof(h->counts));
+	for (int symbol = 0; symbol < n; symbol++) h->counts[lengths[symbol]]++;
+	int left = 1;
+	for (int len = 1; len < 16; len++)
+	{
+		left <<= 1;
+		left -= h->counts[len];
+		if (left < 0) return false;
+	}
+	offsets[1] = 0;
+	for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + h->counts[len];
+	for (int symbol = 0; symbol < n; symbol++) if (lengths[symbol] != 0) h->symbols[offsets[lengths[symbol]]++] = (short)symbol;
+	return true;
+}
+
+static bool inflateCodes(inflate_t *s, const huffman_t *lencode, const huffman_t *distcode)
+{
+	for (;;)
+	{
+		int symbol = inflateDecode(s, lencode);
+		if (s->error || symbol < 0) return false;
+		if (symbol < 256)
+		{
+			if (s->outPos >= s->outLength) return false;
+			s->out[s->outPos++] = (unsigned char)symbol;
+		}
+		else if (symbol == 256)
+		{
+			return true;
+		}
+		else
+		{
+			symbol -= 257;
+			if (symbol >= 29) return false;
+			size_t len = s_lengthBase[symbol] + inflateBits(s, s_lengthExtra[symbol]);
+			symbol = inflateDecode(s, distcode);
+			if (s->error || symbol < 0 || symbol >= 30) return false;
+			size_t dist = s_distBase[symbol] + inflateBits(s, s_distExtra[symbol]);
+			if (s->error || dist > s->outPos || len > s->outLength - s->outPos) return false;
+			for (; len > 0; len--, s->outPos++) s->out[s->outPos] = s->out[s->outPos - dist];
+		}
+	}
+}
+
+static bool inflateStored(inflate_t *s)
+{
+	s->bitBuffer = 0;
+	s->bitCount = 0;
+	if (s->inPos + 4 > s->inLength) return false;
+	size_t len = s->in[s->inPos] | (s->in[s->inPos + 1] << 8);
+	size_t nlen = s->in[s->inPos + 2] | (s->in[s->inPos + 3] << 8);
+	s->inPos += 4;
+	if (len != (~nlen & 0xffff) || len > s->inLength - s->inPos || len > s->outLength - s->outPos) return false;
+	memcpy(s->out + s->outPos, s->in + s->inPos, len);
+	s->inPos += len;
+	s->outPos += len;
+	return true;
+}
+
+static bool inflateFixed(inflate_t *s)
+{
+	static huffman_t lencode, distcode;
+	static volatile bool initialized = false;
+	if (!initialized)
+	{
+		short lengths[288];
+		int symbol = 0;
+		for (; symbol < 144; symbol++) lengths[symbol] = 8;
+		for (; symbol < 256; symbol++) lengths[symbol] = 9;
+		for (; symbol < 280; symbol++) lengths[symbol] = 7;
+		for (; symbol < 288; symbol++) lengths[symbol] = 8;
+		inflateBuild(&lencode, lengths, 288);
+		for (symbol = 0; symbol < 30; symbol++) lengths[symbol] = 5;
+		inflateBuild(&distcode, lengths, 30);
+		initialized = true;
+	}
+	return inflateCodes(s, &lencode, &distcode);
+}
+
+static bool inflateDynamic(inflate_t *s)
+{
+	short lengths[320];
+	huffman_t lencode, distcode;
+	int nlen = inflateBits(s, 5) + 257;
+	int ndist = inflateBits(s, 5) + 1;
+	int ncode = inflateBits(s, 4) + 4;
+	if (s->error || nlen > 286 || ndist > 30) return false;
+	int index;
+	for (index = 0; index < ncode; index++) lengths[s_codeLengthOrder[index]] = (short)inflateBits(s, 3);
+	for (; index < 19; index++) lengths[s_codeLengthOrder[index]] = 0;
+	if (s->error || !inflateBuild(&lencode, lengths, 19)) return false;
+	for (index = 0; index < nlen + ndist; )
+	{
+		int symbol = inflateDecode(s, &lencode);
+		if (s->error || symbol < 0) return false;
+		if (symbol < 16)
+		{
+			lengths[index++] = (short)symbol;
+		}
+		else
+		{
+			short len = 0;
+			int repeat;
+			if (symbol == 16)
+			{
+				if (index == 0) return false;
+				len = lengths[index - 1];
+				repeat = 3 + inflateBits(s, 2);
+			}
+			else if (symbol == 17) { repeat = 3 + inflateBits(s, 3); }
+			else { repeat = 11 + inflateBits(s, 7); }
+			if (s->error || index + repeat > nlen + ndist) return false;
+			while (repeat--) lengths[index++] = len;
+		}
+	}
+	if (lengths[256] == 0) return false;
+	if (!inflateBuild(&lencode, lengths, nlen) || !inflateBuild(&distcode, lengths + nlen, ndist)) return false;
+	return inflateCodes(s, &lencode, &distcode);
+}
+
+// Inflate a raw deflate stream into a buffer that must exactly fit the decompressed data
+bool inflateBuffer(const unsigned char *in, size_t inLength, unsigned char *out, size_t outLength)
+{
+	inflate_t s;
+	memset(&s, 0, sizeof(s));
+	s.in = in;
+	s.inLength = inLength;
+	s.out = out;
+	s.outLength = outLength;
+	int last;
+	do
+	{
+		last = inflateBits(&s, 1);
+		int type = inflateBits(&s, 2);
+		if (s.error) return false;
+		bool ok = (type == 0) ? inflateStored(&s) : (type == 1) ? inflateFixed(&s) : (type == 2) ? inflateDynamic(&s) : false;
+		if (!ok || s.error) return false;
+	} while (!last);
+	return s.outPos == outLength;
+}
+
+
+// Central directory of a ZIP file on disk, read without loading the rest of the file
+typedef struct
+{
+	unsigned char *cd;			// central directory, followed by the EOCD record
+	size_t cdSize;
+	uint64_t cdOffset;			// actual position of the central directory in the file
+	int64_t adjust;				// correction to add to recorded offsets (non-zero if a prepended header was not patched in)
+	int numRecords;
+	uint64_t fileLength;
+	size_t commentLength;
+} zipdirectory_t;
+
+void zipDirectoryFree(zipdirectory_t *dir)
+{
+	free(dir->cd);
+	memset(dir, 0, sizeof(zipdirectory_t));
+}
+
+bool zipReadDirectory(FILE *fp, zipdirectory_t *dir)
+{
+	memset(dir, 0, sizeof(zipdirectory_t));
+	dir->fileLength = fileLength(fp);
+	if (dir->fileLength == UINT64_MAX) { return false; }
+	size_t tailLength = (size_t)(dir->fileLength < 0xffff + 22 ? dir->fileLength : 0xffff + 22);
+	uint64_t tailOffset = dir->fileLength - tailLength;
+	unsigned char *tail = (unsigned char *)malloc(tailLength > 0 ? tailLength : 1);
+	size_t eocd = 0;
+	if (tail == NULL || !fileRead(fp, tailOffset, tail, tailLength) || !zipFindEocd(tail, tailLength, tailOffset, &eocd))
+	{
+		fprintf(stderr, "ERROR: ZIP file not valid or not supported.\n");
+		free(tail);
+		return false;
+	}
+	dir->numRecords = ZIP_READ_WORD(tail + eocd + 10);
+	dir->cdSize = (uint32_t)ZIP_READ_DWORD(tail + eocd + 12);
+	uint64_t recordedCd = (uint32_t)ZIP_READ_DWORD(tail + eocd + 16);
+	dir->commentLength = ZIP_READ_WORD(tail + eocd + 20);
+	free(tail);
+	if (dir->cdSize > tailOffset + eocd) { fprintf(stderr, "ERROR: ZIP central directory not valid.\n"); return false; }
+	dir->cdOffset = tailOffset + eocd - dir->cdSize;
+	dir->adjust = (int64_t)dir->cdOffset - (int64_t)recordedCd;
+	dir->cd = (unsigned char *)malloc(dir->cdSize + 22);
+	if (dir->cd == NULL || !fileRead(fp, dir->cdOffset, dir->cd, dir->cdSize + 22))
+	{
+		fprintf(stderr, "ERROR: Problem reading ZIP central directory.\n");
+		zipDirectoryFree(dir);
+		return false;
+	}
+	return true;
+}
+
+// Visit each central directory entry, returns false if the directory is not valid
+typedef bool (*zip_entry_fn_t)(void *context, int index, unsigned char *entry);
+bool zipDirectoryForEach(zipdirectory_t *dir, zip_entry_fn_t fn, void *context)
+{
+	size_t position = 0;
+	for (int i = 0; i < dir->numRecords; i++)
+	{
+		unsigned char *entry = dir->cd + position;
+		if (position + 46 > dir->cdSize || ZIP_READ_DWORD(entry) != 0x02014b50 || position + 46 + ZIP_READ_WORD(entry + 28) + ZIP_READ_WORD(entry + 30) + ZIP_READ_WORD(entry + 32) > dir->cdSize)
+		{
+			fprintf(stderr, "ERROR: ZIP file central directory entry #%d not valid.\n", i + 1);
+			return false;
+		}
+		if (fn != NULL && !fn(context, i, entry)) return false;
+		position += 46 + ZIP_READ_WORD(entry + 28) + ZIP_READ_WORD(entry + 30) + ZIP_READ_WORD(entry + 32);
+	}
+	return true;
+}
+
+// Write an end of central directory record (no comment) at a position
+bool zipWriteEndRecord(FILE *fp, uint64_t offset, int numRecords, size_t cdSize, uint64_t cd)
+{
+	unsigned char eocd[22] = { 0 };
+	ZIP_WRITE_DWORD(eocd + 0, 0x06054b50);		// End of central directory signature
+	ZIP_WRITE_WORD(eocd + 8, numRecords);		// Number of central directory records on this disk
+	ZIP_WRITE_WORD(eocd + 10, numRecords);		// Total number of central directory records
+	ZIP_WRITE_DWORD(eocd + 12, cdSize);			// Size of central directory
+	ZIP_WRITE_DWORD(eocd + 16, cd);				// Offset of start of central directory
+	return fileWrite(fp, offset, eocd, sizeof(eocd));
+}
+
+
+// Unwrap: recreate a plain .zip from an output file (strips the prepended header and comment pad), copying the entries without passing through user space where possible
+typedef struct
+{
+	int64_t adjust;
+	uint64_t firstEntry;
+	uint64_t base;			// new position of the first entry
+} unwrap_t;
+
+static bool unwrapFirstEntry(void *context, int index, unsigned char *entry)
+{
+	unwrap_t *unwrap = (unwrap_t *)context;
+	uint64_t localFile = (uint64_t)((uint32_t)ZIP_READ_DWORD(entry + 42) + unwrap->adjust);
+	if (index == 0 || localFile < unwrap->firstEntry) unwrap->firstEntry = localFile;
+	return true;
+}
+
+static bool unwrapRebase(void *context, int index, unsigned char *entry)
+{
+	unwrap_t *unwrap = (unwrap_t *)context;
+	(void)index;
+	uint64_t localFile = (uint64_t)((uint32_t)ZIP_READ_DWORD(entry + 42) + unwrap->adjust) - unwrap->firstEntry + unwrap->base;
+	if (localFile > 0xffffffffUL) { fprintf(stderr, "ERROR: Entry offset too large for a ZIP file (without ZIP64).\n"); return false; }
+	ZIP_WRITE_DWORD(entry + 42, localFile);
+	return true;
+}
+
+int unwrapFile(const char *inputFile, const char *outputFile)
+{
+	FILE *in = fopen(inputFile, "rb");
+	if (in == NULL) { perror("ERROR: Problem opening input file"); return 1; }
+	zipdirectory_t dir;
+	if (!zipReadDirectory(in, &dir)) { fclose(in); return 1; }
+
+	// Rebase the central directory so the first entry is at the start
+	unwrap_t unwrap;
+	unwrap.adjust = dir.adjust;
+	unwrap.firstEntry = dir.cdOffset;
+	unwrap.base = 0;
+	if (!zipDirectoryForEach(&dir, unwrapFirstEntry, &unwrap) || !zipDirectoryForEach(&dir, unwrapRebase, &unwrap))
+	{
+		zipDirectoryFree(&dir); fclose(in);
+		return 1;
+	}
+	uint64_t entriesLength = dir.cdOffset - unwrap.firstEntry;
+	unsigned char *eocd = dir.cd + dir.cdSize;
+	ZIP_WRITE_DWORD(eocd + 16, entriesLength);	// Central directory position
+	ZIP_WRITE_WORD(eocd + 20, 0);				// No comment
+	fprintf(stderr, "ZIPPAST: Unwrapping: %s -> %s (removing %u header, %u comment)\n", inputFile, outputFile, (unsigned int)unwrap.firstEntry, (unsigned int)dir.commentLength);
+
+	FILE *out = fopen(outputFile, "wb");
+	if (out == NULL) { perror("ERROR: Problem opening output file"); zipDirectoryFree(&dir); fclose(in); return 1; }
+	bool result = copyFileRange(in, unwrap.firstEntry, out, 0, entriesLength) && fileWrite(out, entriesLength, dir.cd, dir.cdSize + 22);
+	if (fclose(out) != 0) result = false;
+	fclose(in);
+	zipDirectoryFree(&dir);
+	if (!result) { fprintf(stderr, "ERROR: Problem writing unwrapped file.\n"); return 1; }
+	return 0;
+}
+
+
+// Merge: concatenate the entries of several ZIP files (e.g. zippast outputs, or plain archives) into one, copying the local entries file-to-file
+// (without recompression), rebasing each archive's central directory by its position in the output, then writing one combined directory and EOCD.
+static bool mergeNameHash(void *context, int index, unsigned char *entry)
+{
+	uint64_t **hash = (uint64_t **)context;
+	(void)index;
+	*(*hash)++ = hashName(entry + 46, ZIP_READ_WORD(entry + 28));
+	return true;
+}
+
+int mergeFiles(const char **files, int fileCount, const char *outputFile)
+{
+	zipdirectory_t *dirs = (zipdirectory_t *)calloc(fileCount > 0 ? fileCount : 1, sizeof(zipdirectory_t));
+	unwrap_t *spans = (unwrap_t *)calloc(fileCount > 0 ? fileCount : 1, sizeof(unwrap_t));
+	FILE *out = NULL;
+	uint64_t *hashes = NULL;
+	bool result = dirs != NULL && spans != NULL;
+	if (!result) perror("ERROR: Problem allocating merge");
+
+	// Read each central directory, and rebase it to follow the previous archives' entries
+	uint64_t position = 0;
+	size_t cdSize = 0;
+	int numRecords = 0;
+	for (int i = 0; result && i < fileCount; i++)
+	{
+		FILE *in = fopen(files[i], "rb");
+		if (in == NULL) { perror("ERROR: Problem opening input file"); result = false; break; }
+		result = zipReadDirectory(in, &dirs[i]);
+		fclose(in);
+		if (!result) { fprintf(stderr, "ERROR: Not merged: %s\n", files[i]); break; }
+		spans[i].adjust = dirs[i].adjust;
+		spans[i].firstEntry = dirs[i].cdOffset;
+		spans[i].base = position;
+		result = zipDirectoryForEach(&dirs[i], unwrapFirstEntry, &spans[i]) && zipDirectoryForEach(&dirs[i], unwrapRebase, &spans[i]);
+		position += dirs[i].cdOffset - spans[i].firstEntry;
+		cdSize += dirs[i].cdSize;
+		numRecords += dirs[i].numRecords;
+	}
+	if (result && (numRecords > 0xffff || position + cdSize > 0xffffffffUL))
+	{
+		fprintf(stderr, "ERROR: Merged archive too large for a ZIP file (without ZIP64): %d entries, %llu bytes.\n", numRecords, (unsigned long long)(position + cdSize));
+		result = false;
+	}
+
+	// Entry names that appear in more than one archive are kept, but most readers will only find the first
+	if (result && numRecords > 1)
+	{
+		hashes = (uint64_t *)malloc(numRecords * sizeof(uint64_t));
+		uint64_t *hash = hashes;
+		for (int i = 0; hashes != NULL && i < fileCount; i++) zipDirectoryForEach(&dirs[i], mergeNameHash, &hash);
+		if (hashes != NULL)
+		{
+			qsort(hashes, numRecords, sizeof(uint64_t), compareUint64);
+			int duplicates = 0;
+			for (int i = 1; i < numRecords; i++) if (hashes[i] == hashes[i - 1]) duplicates++;
+			if (duplicates > 0) fprintf(stderr, "WARNING: Merged archive has %d duplicate entry name(s).\n", duplicates);
+		}
+	}
+
+	// Entries (file-to-file), then each rebased central directory, then the combined EOCD
+	if (result)
+	{
+		fprintf(stderr, "ZIPPAST: Merging: %d files (%d entries) -> %s\n", fileCount, numRecords, outputFile);
+		out = fopen(outputFile, "wb");
+		if (out == NULL) { perror("ERROR: Problem opening output file"); result = false; }
+	}
+	uint64_t outOffset = 0;
+	for (int i = 0; result && i < fileCount; i++)
+	{
+		FILE *in = fopen(files[i], "rb");
+		uint64_t length = dirs[i].cdOffset - spans[i].firstEntry;
+		result = in != NULL && copyFileRange(in, spans[i].firstEntry, out, outOffset, length);
+		if (in != NULL) fclose(in);
+		outOffset += length;
+	}
+	for (int i = 0; result && i < fileCount; i++)
+	{
+		result = fileWrite(out, outOffset, dirs[i].cd, dirs[i].cdSize);
+		outOffset += dirs[i].cdSize;
+	}
+	result = result && zipWriteEndRecord(out, outOffset, numRecords, cdSize, position);
+	if (out != NULL)
+	{
+		if (fclose(out) != 0) result = false;
+		if (!result) { fprintf(stderr, "ERROR: Problem writing merged file.\n"); remove(outputFile); }
+	}
+
+	for (int i = 0; dirs != NULL && i < fileCount; i++) zipDirectoryFree(&dirs[i]);
+	free(hashes);
+	free(spans);
+	free(dirs);
+	return result ? 0 : 1;
+}
+
+
+// Split: write the (optionally filtered) entries of a ZIP file to several archives (by entry count or byte budget), copying each run of
+// local entries file-to-file, and writing a central directory rebased to each archive.  Archives are written in parallel.
+typedef struct
 {
-	// [
-	//   ZIP LOCAL HEADER <30+n>
-	//   FILE CONTENT <f>
-	//   ZIP EXTENDED LOCAL HEADER <16>
-	// ]...
-	// ZIP CENTRAL DIRECTORY ENTRY... <46+n>
-	// ZIP END CENTRAL DIRECTORY <22>
-	size_t length = 30 + strlen(filename) + contentsLength + 16 + 46 + strlen(filename) + 22;
-	unsigned char *buffer = malloc(length);
-	unsigned char *p = buffer;
-	if (buffer == NULL)
+	uint64_t offset;			// local header position in the input
+	uint64_t length;			// local header, data and any data descriptor (up to the next entry)
+	unsigned char *entry;		// central directory entry
+	bool selected;
+} split_entry_t;
+
+typedef struct
+{
+	const char *inputFile;
+	const char *outputPrefix;
+	zipdirectory_t *dir;
+	split_entry_t *entries;		// entries in file order (then only the selected entries)
+	int count;
+	const char **patterns;		// entry names to select (none=all)
+	int patternCount;
+	int *first;					// first entry of each archive (and the end)
+	int archives;
+	bool numbered;				// archive names numbered after the prefix (otherwise, the prefix is the name)
+	zippast_mutex_t mutex;
+	int failed;
+} split_t;
+
+// Match an entry name against a wildcard pattern ('*' any characters, including '/'; '?' any one character)
+bool matchPattern(const char *pattern, const unsigned char *name, size_t length)
+{
+	const char *star = NULL;
+	size_t p = 0, resume = 0;
+	while (p < length)
 	{
-		perror("ERROR: Problem allocating zip buffer");
-		return NULL;
+		if (*pattern == '*') { star = ++pattern; resume = p; }
+		else if (*pattern != '\0' && (*pattern == '?' || *pattern == (char)name[p])) { pattern++; p++; }
+		else if (star != NULL) { pattern = star; p = ++resume; }
+		else return false;
 	}
+	while (*pattern == '*') pattern++;
+	return *pattern == '\0';
+}
 
-	zipwriter_t zip;
-	ZIPWriterInitialize(&zip);
+static bool splitSelect(void *context, int index, unsigned char *entry)
+{
+	split_t *split = (split_t *)context;
+	(void)index;
+	split_entry_t *item = &split->entries[split->count++];
+	item->selected = (split->patternCount == 0);
+	for (int i = 0; !item->selected && i < split->patternCount; i++) item->selected = matchPattern(split->patterns[i], entry + 46, ZIP_READ_WORD(entry + 28));
+	item->offset = (uint64_t)((uint32_t)ZIP_READ_DWORD(entry + 42) + split->dir->adjust);
+	item->entry = entry;
+	if (item->offset >= split->dir->cdOffset) { fprintf(stderr, "ERROR: ZIP file central directory entry #%d not valid.\n", index + 1); return false; }
+	return true;
+}
 
-	zipwriter_file_t file;
-	p += ZIPWriterStartFile(&zip, &file, filename, ZIP_DATETIME(2000,1,1,0,0,0), 0, p);
-	memcpy(p, contents, contentsLength);
-	ZIPWriterFileContent(&zip, contents, contentsLength);
-	p += contentsLength;
-	p += ZIPWriterEndFile(&zip, p);
-	p += ZIPWriterCentralDirectoryEntry(&zip, p);
-	p += ZIPWriterCentralDirectoryEnd(&zip, p);
+static int compareSplitEntry(const void *a, const void *b)
+{
+	uint64_t offsetA = ((const split_entry_t *)a)->offset, offsetB = ((const split_entry_t *)b)->offset;
+	return (offsetA > offsetB) - (offsetA < offsetB);
+}
 
-	*zipLength = (size_t)(p - buffer);
-	if (*zipLength != length) { fprintf(stderr, "WARNING: Zip output %u, expected %u.\n", (unsigned int)*zipLength, (unsigned int)length); }
-	return buffer;
+static size_t zipDirectoryEntrySize(const unsigned char *entry)
+{
+	return 46 + ZIP_READ_WORD(entry + 28) + ZIP_READ_WORD(entry + 30) + ZIP_READ_WORD(entry + 32);
 }
 
-const char *findFilename(const char *file)
+static char *splitArchiveName(const split_t *split, int index)
 {
-	for (const char *p = file + strlen(file); p >= file; p--)
+	char *name = (char *)malloc(strlen(split->outputPrefix) + 16);
+	if (name == NULL) return NULL;
+	if (split->numbered) sprintf(name, "%s-%03d.zip", split->outputPrefix, index + 1);
+	else strcpy(name, split->outputPrefix);
+	return name;
+}
+
+static bool splitArchive(split_t *split, int index, const char *outputFile)
+{
+	int first = split->first[index], end = split->first[index + 1];
+	size_t cdSize = 0;
+	for (int i = first; i < end; i++) cdSize += zipDirectoryEntrySize(split->entries[i].entry);
+	unsigned char *cd = (unsigned char *)malloc(cdSize > 0 ? cdSize : 1);
+	FILE *in = fopen(split->inputFile, "rb");
+	FILE *out = fopen(outputFile, "wb");
+	bool result = cd != NULL && in != NULL && out != NULL;
+	if (!result) perror("ERROR: Problem opening split archive");
+
+	// Entries, copying each run that is contiguous in the input as one span, and rebasing their central directory entries
+	uint64_t position = 0;
+	size_t cdPosition = 0;
+	for (int i = first; result && i < end; )
 	{
-		char c = *p;
-#ifdef _WIN32
-		if (c == '\\') c = '/';
-#endif
-		if (c == '/') return p + 1;
+		int run = i + 1;
+		while (run < end && split->entries[run].offset == split->entries[run - 1].offset + split->entries[run - 1].length) run++;
+		uint64_t length = split->entries[run - 1].offset + split->entries[run - 1].length - split->entries[i].offset;
+		for (int j = i; j < run; j++)
+		{
+			size_t size = zipDirectoryEntrySize(split->entries[j].entry);
+			memcpy(cd + cdPosition, split->entries[j].entry, size);
+			ZIP_WRITE_DWORD(cd + cdPosition + 42, position + (split->entries[j].offset - split->entries[i].offset));
+			cdPosition += size;
+		}
+		result = copyFileRange(in, split->entries[i].offset, out, position, length);
+		position += length;
+		i = run;
 	}
-	return file;
+	result = result && fileWrite(out, position, cd, cdSize) && zipWriteEndRecord(out, position + cdSize, end - first, cdSize, position);
+	if (out != NULL && fclose(out) != 0) result = false;
+	if (in != NULL) fclose(in);
+	free(cd);
+	if (!result) { fprintf(stderr, "ERROR: Problem writing split archive: %s\n", outputFile); remove(outputFile); }
+	return result;
 }
 
-int process(const char *inputFile, const char *outputFile, HeaderMode mode, size_t commentPad, bool convert)
+static void splitWorker(void *context, int index)
 {
-	// Check parameters
-	if (commentPad < 0 || commentPad > 0xffff)
+	split_t *split = (split_t *)context;
+	char *outputFile = splitArchiveName(split, index);
+	if (outputFile == NULL || !splitArchive(split, index, outputFile))
 	{
-		fprintf(stderr, "ZIPPAST: Comment pad out of range (0-65535): %u\n", (unsigned int)commentPad);
-		return 1;
+		MutexLock(&split->mutex);
+		split->failed++;
+		MutexUnlock(&split->mutex);
 	}
+	free(outputFile);
+}
 
-	// Read content
-	fprintf(stderr, "ZIPPAST: Reading: %s\n", inputFile);
-	size_t contentsLength = 0;
-	unsigned char *contents = readFile(inputFile, &contentsLength);
-	if (contents == NULL) { return 1; }
+// Split into archives of at most 'maxEntries' entries and/or 'maxBytes' of entry data (0=no limit; an entry larger than the budget has an archive of its own),
+// selecting only the entries that match one of the patterns (if any).
+int splitFile(const char *inputFile, const char *outputPrefix, bool numbered, int maxEntries, uint64_t maxBytes, const char **patterns, int patternCount, int threads)
+{
+	FILE *in = fopen(inputFile, "rb");
+	if (in == NULL) { perror("ERROR: Problem opening input file"); return 1; }
+	zipdirectory_t dir;
+	bool read = zipReadDirectory(in, &dir);
+	fclose(in);
+	if (!read) { return 1; }
 
-	// Zip
-	if (!isZip(contents, contentsLength))
+	split_t split;
+	memset(&split, 0, sizeof(split));
+	split.inputFile = inputFile;
+	split.outputPrefix = outputPrefix;
+	split.numbered = numbered;
+	split.dir = &dir;
+	split.patterns = patterns;
+	split.patternCount = patternCount;
+	split.entries = (split_entry_t *)malloc((dir.numRecords > 0 ? dir.numRecords : 1) * sizeof(split_entry_t));
+	split.first = (int *)malloc((dir.numRecords + 2) * sizeof(int));
+	if (split.entries == NULL || split.first == NULL || !zipDirectoryForEach(&dir, splitSelect, &split))
 	{
-		const char *filename = findFilename(inputFile);
-		fprintf(stderr, "ZIPPAST: Wrapping in ZIP...\n");
-		size_t zipLength = 0;
-		unsigned char *zipContents = zipFile(filename, contents, contentsLength, &zipLength);
-		free(contents);
-		contents = zipContents;
-		contentsLength = zipLength;
-		if (contents == NULL) { return 1; }
+		free(split.entries);
+		free(split.first);
+		zipDirectoryFree(&dir);
+		return 1;
+	}
+
+	// Entry spans, from each local header to the next one (or the central directory) in file order, then keep the selected entries
+	qsort(split.entries, split.count, sizeof(split_entry_t), compareSplitEntry);
+	int selected = 0;
+	for (int i = 0; i < split.count; i++)
+	{
+		uint64_t next = dir.cdOffset;
+		if (i + 1 < split.count) next = split.entries[i + 1].offset;
+		split.entries[i].length = next - split.entries[i].offset;
+		if (split.entries[i].selected) split.entries[selected++] = split.entries[i];
 	}
+	split.count = selected;
 
-	// Convert ZIP file
-	if (convert)
+	// Archive boundaries, in file order
+	uint64_t bytes = 0;
+	split.first[0] = 0;
+	for (int i = 0; i < split.count; i++)
 	{
-		if (!zipConvert(&contents, &contentsLength))
+		int entries = i - split.first[split.archives];
+		if (entries > 0 && ((maxEntries > 0 && entries >= maxEntries) || entries >= 0xffff || (maxBytes > 0 && bytes + split.entries[i].length > maxBytes)))
 		{
-			fprintf(stderr, "ERROR: Problem converting ZIP entries\n");
-			free(contents);
-			return 1;
+			split.first[++split.archives] = i;
+			bytes = 0;
 		}
+		bytes += split.entries[i].length;
 	}
+	split.first[++split.archives] = split.count;
+	if (!numbered && split.archives > 1) { fprintf(stderr, "ERROR: Entries do not fit in one archive.\n"); free(split.entries); free(split.first); zipDirectoryFree(&dir); return 1; }
 
-	// Additional ZIP comment pad at end of file
-	const char *commentString = COMMENT_STRING;
-	unsigned char *comment = NULL;
-	if (commentPad > 0)
+	fprintf(stderr, "ZIPPAST: Splitting: %s -> %d archive(s), %d of %d entries\n", inputFile, split.archives, split.count, dir.numRecords);
+	MutexInit(&split.mutex);
+	uint64_t start = timeMicroseconds();
+	parallelFor(split.archives, threads, splitWorker, &split);
+	uint64_t elapsed = timeMicroseconds() - start;
+	fprintf(stderr, "ZIPPAST: Split into %d/%d archives in %.3f s.\n", split.archives - split.failed, split.archives, elapsed / 1000000.0);
+	MutexDestroy(&split.mutex);
+	free(split.entries);
+	free(split.first);
+	zipDirectoryFree(&dir);
+	return split.failed > 0 ? 1 : 0;
+}
+
+
+// Extract: write each entry to a directory, in parallel (stored entries copied directly, deflated entries inflated)
+typedef struct
+{
+	const char *inputFile;
+	const char *outputDir;
+	zipdirectory_t *dir;
+	unsigned char **entries;	// central directory entry for each index
+	zippast_mutex_t mutex;
+	int failed;
+	uint64_t bytes;
+} extract_t;
+
+static bool extractIndexEntry(void *context, int index, unsigned char *entry)
+{
+	((extract_t *)context)->entries[index] = entry;
+	return true;
+}
+
+static bool extractEntry(extract_t *extract, const unsigned char *entry)
+{
+	int flags = ZIP_READ_WORD(entry + 8);
+	int method = ZIP_READ_WORD(entry + 10);
+	unsigned long crc = (uint32_t)ZIP_READ_DWORD(entry + 16);
+	size_t compressedSize = (uint32_t)ZIP_READ_DWORD(entry + 20);
+	size_t uncompressedSize = (uint32_t)ZIP_READ_DWORD(entry + 24);
+	size_t nameLength = ZIP_READ_WORD(entry + 28);
+	uint64_t localFile = (uint64_t)((uint32_t)ZIP_READ_DWORD(entry + 42) + extract->dir->adjust);
+
+	// Output path (rejecting absolute paths and parent references)
+	char *path = (char *)malloc(strlen(extract->outputDir) + 1 + nameLength + 1);
+	if (path == NULL) return false;
+	sprintf(path, "%s/", extract->outputDir);
+	char *name = path + strlen(path);
+	memcpy(name, entry + 46, nameLength);
+	name[nameLength] = '\0';
+	bool unsafe = (name[0] == '/' || name[0] == '\\' || strchr(name, ':') != NULL);
+	for (const char *p = name; *p != '\0' && !unsafe; p++)
 	{
-		comment = (unsigned char *)malloc(commentPad);
-		if (comment == NULL)
+		if (p[0] == '.' && p[1] == '.' && (p == name || p[-1] == '/' || p[-1] == '\\') && (p[2] == '\0' || p[2] == '/' || p[2] == '\\')) unsafe = true;
+	}
+	if (unsafe) { fprintf(stderr, "ERROR: Unsafe entry name not extracted: %s\n", name); free(path); return false; }
+	if (nameLength > 0 && (name[nameLength - 1] == '/' || name[nameLength - 1] == '\\'))
+	{
+		bool result = makeDirectories(path);
+		if (!result) fprintf(stderr, "ERROR: Problem creating directory: %s (%s)\n", path, strerror(errno));
+		free(path);
+		return result;
+	}
+	char *slash = strrchr(name, '/');
+	if (slash != NULL)
+	{
+		*slash = '\0';
+		bool made = makeDirectories(path);
+		if (!made) { fprintf(stderr, "ERROR: Problem creating directory: %s (%s)\n", path, strerror(errno)); free(path); return false; }
+		*slash = '/';
+	}
+	if (flags & 1) { fprintf(stderr, "ERROR: Encrypted entry not supported: %s\n", name); free(path); return false; }
+	if (method != 0 && method != 8) { fprintf(stderr, "ERROR: Compression method %d not supported: %s\n", method, name); free(path); return false; }
+
+	FILE *in = fopen(extract->inputFile, "rb");
+	unsigned char local[30];
+	if (in == NULL || !fileRead(in, localFile, local, sizeof(local)) || ZIP_READ_DWORD(local) != 0x04034b50)
+	{
+		fprintf(stderr, "ERROR: Local header not valid: %s\n", name);
+		if (in != NULL) fclose(in);
+		free(path);
+		return false;
+	}
+	uint64_t dataOffset = localFile + 30 + ZIP_READ_WORD(local + 26) + ZIP_READ_WORD(local + 28);
+
+	FILE *out = fopen(path, "wb");
+	bool result = (out != NULL);
+	if (!result) { perror("ERROR: Problem creating extracted file"); }
+	else if (method == 0)
+	{
+		result = copyFileRange(in, dataOffset, out, 0, compressedSize);
+	}
+	else
+	{
+		unsigned char *compressed = (unsigned char *)malloc(compressedSize > 0 ? compressedSize : 1);
+		unsigned char *uncompressed = (unsigned char *)malloc(uncompressedSize > 0 ? uncompressedSize : 1);
+		result = compressed != NULL && uncompressed != NULL && fileRead(in, dataOffset, compressed, compressedSize);
+		if (result && !inflateBuffer(compressed, compressedSize, uncompressed, uncompressedSize)) { fprintf(stderr, "ERROR: Problem decompressing: %s\n", name); result = false; }
+		if (result && crc32(CRC32_INIT, uncompressed, uncompressedSize) != crc) { fprintf(stderr, "ERROR: CRC mismatch: %s\n", name); result = false; }
+		if (result) result = fileWriteData(out, uncompressed, uncompressedSize, NULL);
+		free(compressed);
+		free(uncompressed);
+	}
+	if (out != NULL && fclose(out) != 0) result = false;
+	fclose(in);
+	free(path);
+	if (result)
+	{
+		MutexLock(&extract->mutex);
+		extract->bytes += uncompressedSize;
+		MutexUnlock(&extract->mutex);
+	}
+	return result;
+}
+
+// Entries with the same name (e.g. merged archives) would be written to the same file at once: only the last is extracted (as unzip does)
+typedef struct
+{
+	uint64_t hash;
+	int index;
+} extract_name_t;
+
+static int compareExtractName(const void *a, const void *b)
+{
+	const extract_name_t *na = (const extract_name_t *)a, *nb = (const extract_name_t *)b;
+	if (na->hash != nb->hash) return (na->hash > nb->hash) - (na->hash < nb->hash);
+	return (na->index > nb->index) - (na->index < nb->index);
+}
+
+static bool extractSameName(const unsigned char *a, const unsigned char *b)
+{
+	size_t length = ZIP_READ_WORD(a + 28);
+	return length == (size_t)ZIP_READ_WORD(b + 28) && !memcmp(a + 46, b + 46, length);
+}
+
+// Clear the earlier entries of any duplicate names, returning the number skipped (or -1 on failure)
+static int extractDuplicates(unsigned char **entries, int count)
+{
+	extract_name_t *names = (extract_name_t *)malloc((count > 0 ? count : 1) * sizeof(extract_name_t));
+	if (names == NULL) { perror("ERROR: Problem allocating entry names"); return -1; }
+	for (int i = 0; i < count; i++) { names[i].hash = hashName(entries[i] + 46, ZIP_READ_WORD(entries[i] + 28)); names[i].index = i; }
+	qsort(names, count, sizeof(extract_name_t), compareExtractName);
+	int skipped = 0;
+	for (int i = 0; i < count; i++)
+	{
+		for (int j = i + 1; j < count && names[j].hash == names[i].hash; j++)
 		{
-			perror("ERROR: Problem allocating comment memory");
-			return 1;
+			if (extractSameName(entries[names[i].index], entries[names[j].index])) { entries[names[i].index] = NULL; skipped++; break; }
 		}
-		memset(comment, ' ', commentPad);
-		const size_t commentStringLength = strlen(commentString);
-		if (commentStringLength > 0)
+	}
+	free(names);
+	return skipped;
+}
+
+static void extractWorker(void *context, int index)
+{
+	extract_t *extract = (extract_t *)context;
+	if (extract->entries[index] == NULL) return;		// (duplicate name)
+	if (!extractEntry(extract, extract->entries[index]))
+	{
+		MutexLock(&extract->mutex);
+		extract->failed++;
+		MutexUnlock(&extract->mutex);
+	}
+}
+
+int extractFile(const char *inputFile, const char *outputDir, int threads)
+{
+	FILE *in = fopen(inputFile, "rb");
+	if (in == NULL) { perror("ERROR: Problem opening input file"); return 1; }
+	zipdirectory_t dir;
+	bool read = zipReadDirectory(in, &dir);
+	fclose(in);
+	if (!read) { return 1; }
+
+	extract_t extract;
+	memset(&extract, 0, sizeof(extract));
+	extract.inputFile = inputFile;
+	extract.outputDir = outputDir;
+	extract.dir = &dir;
+	extract.entries = (unsigned char **)malloc((dir.numRecords > 0 ? dir.numRecords : 1) * sizeof(unsigned char *));
+	if (extract.entries == NULL || !zipDirectoryForEach(&dir, extractIndexEntry, &extract) || !makeDirectories(outputDir))
+	{
+		free(extract.entries);
+		zipDirectoryFree(&dir);
+		return 1;
+	}
+	int skipped = extractDuplicates(extract.entries, dir.numRecords);
+	if (skipped < 0) { free(extract.entries); zipDirectoryFree(&dir); return 1; }
+	if (skipped > 0) fprintf(stderr, "WARNING: %d entries skipped, as a later entry has the same name.\n", skipped);
+	MutexInit(&extract.mutex);
+	uint64_t start = timeMicroseconds();
+	parallelFor(dir.numRecords, threads, extractWorker, &extract);
+	uint64_t elapsed = timeMicroseconds() - start;
+	fprintf(stderr, "ZIPPAST: Extracted %d/%d entries, %llu bytes in %.3f s.\n", dir.numRecords - skipped - extract.failed, dir.numRecords, (unsigned long long)extract.bytes, elapsed / 1000000.0);
+	MutexDestroy(&extract.mutex);
+	free(extract.entries);
+	zipDirectoryFree(&dir);
+	return extract.failed > 0 ? 1 : 0;
+}
+
+// Listing and verification of a whole ZIP (or output) file in memory, from its entry table
+typedef struct
+{
+	const unsigned char *data;
+	const zipentries_t *entries;
+	uint8_t *status;				// per-entry result: 0=ok, 1=failed, 2=unsupported method
+} verify_t;
+
+static void verifyWorker(void *context, int index)
+{
+	verify_t *verify = (verify_t *)context;
+	const zipentries_t *entries = verify->entries;
+	const unsigned char *content = verify->data + zipEntriesData(entries, index);
+	size_t compressedSize = entries->compressedSize[index];
+	size_t uncompressedSize = entries->uncompressedSize[index];
+	unsigned long crc;
+	if (entries->method[index] == 0)
+	{
+		if (compressedSize != uncompressedSize) { verify->status[index] = 1; return; }
+		crc = crc32(CRC32_INIT, content, compressedSize);
+	}
+	else if (entries->method[index] == 8)
+	{
+		unsigned char *uncompressed = (unsigned char *)malloc(uncompressedSize > 0 ? uncompressedSize : 1);
+		if (uncompressed == NULL || !inflateBuffer(content, compressedSize, uncompressed, uncompressedSize)) { free(uncompressed); verify->status[index] = 1; return; }
+		crc = crc32(CRC32_INIT, uncompressed, uncompressedSize);
+		free(uncompressed);
+	}
+	else
+	{
+		verify->status[index] = 2;
+		return;
+	}
+	verify->status[index] = (crc == entries->crc32[index]) ? 0 : 1;
+}
+
+// List ('verify'=false) or verify the CRC of every entry (in parallel)
+int verifyFile(const char *inputFile, bool verify, int threads)
+{
+	size_t length = 0;
+	unsigned char *data = readFile(inputFile, &length);
+	if (data == NULL) { return 1; }
+	zipentries_t entries;
+	if (!zipEntriesParse(data, length, &entries)) { BufferFree(data); return 1; }
+	if (!zipEntriesLocal(data, &entries)) { zipEntriesFree(&entries); BufferFree(data); return 1; }
+
+	int failed = 0, unsupported = 0;
+	if (!verify)
+	{
+		printf("%10s %10s %-7s %-8s %10s  %s\n", "Length", "Size", "Method", "CRC-32", "Offset", "Name");
+		for (int i = 0; i < entries.count; i++)
 		{
-			for (size_t i = 0; i < commentPad; i++)
-			{
-				comment[i] = commentString[i % commentStringLength] & 0x7f;	// clear top bit to allow easier control codes
-			}
+			const char *method = entries.method[i] == 0 ? "Stored" : entries.method[i] == 8 ? "Deflate" : "Other";
+			printf("%10lu %10lu %-7s %08lx %10lu  %.*s\n", (unsigned long)entries.uncompressedSize[i], (unsigned long)entries.compressedSize[i], method, (unsigned long)entries.crc32[i], (unsigned long)entries.localFile[i], (int)entries.nameLength[i], (const char *)(data + entries.cd + entries.entry[i] + 46));
 		}
-#if 0	// Fake central directory at end (7-Zip ignores, others do not?)
-		if (commentPad > 22)
+	}
+	else
+	{
+		verify_t context;
+		context.data = data;
+		context.entries = &entries;
+		context.status = (uint8_t *)malloc(entries.count > 0 ? entries.count : 1);
+		if (context.status == NULL) { perror("ERROR: Problem allocating verification status"); zipEntriesFree(&entries); BufferFree(data); return 1; }
+		uint64_t start = timeMicroseconds();
+		parallelFor(entries.count, threads, verifyWorker, &context);
+		uint64_t elapsed = timeMicroseconds() - start;
+		for (int i = 0; i < entries.count; i++)
 		{
-			unsigned char *eocd = comment + commentPad - 22;
-			memset(eocd, 0x00, 22);
-			eocd[0]  = 0x50; eocd[1]  = 0x4b; eocd[2] = 0x05; eocd[3] = 0x06;	// End of central directory signature
-			//eocd[4]  = 0x00; eocd[5]  = 0x00; // Number of this disk
-			//eocd[6]  = 0x00; eocd[7]  = 0x00; // Disk where central directory starts
-			//eocd[8]  = 0x00; eocd[9]  = 0x00; // Number of central directory records on this disk
-			//eocd[10] = 0x00; eocd[11] = 0x00; // Total number of central directory records
-			//eocd[12] = 0x00; eocd[13] = 0x00; eocd[14] = 0x00; eocd[15] = 0x00; // Size of central directory(bytes)
-			//eocd[16] = 0x00; eocd[17] = 0x00; eocd[18] = 0x00; eocd[19] = 0x00; // Offset of start of central directory, relative to start of archive
-			//eocd[20] = 0x00; eocd[21] = 0x00; // Comment length
+			if (context.status[i] == 0) continue;
+			if (context.status[i] == 1) failed++; else unsupported++;
+			fprintf(stderr, "%s: %.*s\n", context.status[i] == 1 ? "ERROR: Entry not valid" : "WARNING: Entry method not supported", (int)entries.nameLength[i], (const char *)(data + entries.cd + entries.entry[i] + 46));
 		}
-#endif
+		fprintf(stderr, "ZIPPAST: Verified %d/%d entries (%d failed, %d not supported) in %.3f s.\n", entries.count - failed - unsupported, entries.count, failed, unsupported, elapsed / 1000000.0);
+		free(context.status);
 	}
+	zipEntriesFree(&entries);
+	BufferFree(data);
+	return failed > 0 ? 1 : 0;
+}
 
-	// Generate required header
-	size_t headerSize = 0;
-	unsigned char *header = NULL;
-	if (mode == MODE_BMP)
+// Default output file extension for each mode
+const char *modeExtension(HeaderMode mode)
+{
+	if (mode == MODE_BMP) return ".bmp";
+	else if (mode == MODE_WAV) return ".wav";
+	else if (mode == MODE_EML) return ".eml";
+	else if (mode == MODE_MHTML) return ".mht";
+	else if (mode == MODE_HTML) return ".html";
+	else if (mode == MODE_STANDARD) return ".zip-email";
+	else if (mode == MODE_BYTE) return ".bin";
+	else return ".dat";	// MODE_NONE
+}
+
+
+// Direct API (e.g. exported from the WebAssembly build): processes an in-memory input without argument parsing or a file system.
+// The input buffer must come from zippast_malloc() and ownership passes to the call; the result is a single buffer to release with zippast_free().
+ZIPPAST_EXPORT void *zippast_malloc(size_t size)
+{
+	return BufferAlloc(size);
+}
+
+ZIPPAST_EXPORT void zippast_free(void *ptr)
+{
+	BufferFree(ptr);
+}
+
+ZIPPAST_EXPORT int zippast_threads(void)
+{
+	return ZIPPAST_THREADS ? cpuCount() : 1;
+}
+
+ZIPPAST_EXPORT const char *zippast_extension(int mode)
+{
+	return modeExtension((HeaderMode)mode);
+}
+
+ZIPPAST_EXPORT unsigned long zippast_crc32(const unsigned char *data, size_t length, int threads)
+{
+	return crc32Parallel(CRC32_INIT, data, length, threads);
+}
+
+ZIPPAST_EXPORT unsigned char *zippast_process(const char *filename, unsigned char *input, size_t inputLength, int mode, int commentPad, int convert, int threads, size_t *outLength)
+{
+	zippast_options_t options;
+	zippastDefaultOptions(&options);
+	options.mode = (HeaderMode)mode;
+	if (commentPad >= 0) options.commentPad = (size_t)commentPad;
+	options.convert = convert != 0;
+	if (threads > 0) options.threads = threads;
+
+	zippast_output_t output;
+	*outLength = 0;
+	if (!zippastGenerate(filename, input, inputLength, &options, &output)) { return NULL; }
+	size_t length = output.headerSize + output.contentsLength + output.commentPad;
+	unsigned char *buffer = (unsigned char *)BufferAlloc(length);
+	if (buffer != NULL)
+	{
+		if (output.headerSize > 0) memcpy(buffer, output.header, output.headerSize);
+		memcpy(buffer + output.headerSize, output.contents, output.contentsLength);
+		if (output.commentPad > 0) memcpy(buffer + output.headerSize + output.contentsLength, output.comment, output.commentPad);
+		*outLength = length;
+	}
+	zippastOutputFree(&output);
+	return buffer;
+}
+
+// Return a allocated string for the replacement of the extension for the specified file name.
+const char *replaceExtension(const char *inputFile, const char *newExt)
+{
+	char *outputFile = (char *)malloc(strlen(inputFile) + strlen(newExt) + 1);
+	if (outputFile == NULL)
+	{
+		perror("ERROR: Problem creating output file name");
+		return NULL;
+	}
+	strcpy(outputFile, inputFile);
+	for (char *p = outputFile + strlen(outputFile); p >= outputFile && *p != '\\' && *p != '/'; p--)
+	{
+		if (*p == '.') { *p = '\0'; break; }
+	}
+	strcat(outputFile, newExt);
+	return outputFile;
+}
+
+// Parse a size in bytes, with an optional K/M/G suffix
+uint64_t parseSize(const char *text)
+{
+	char *end = NULL;
+	uint64_t size = (uint64_t)strtoull(text, &end, 0);
+	if (end != NULL && (*end == 'k' || *end == 'K')) size <<= 10;
+	else if (end != NULL && (*end == 'm' || *end == 'M')) size <<= 20;
+	else if (end != NULL && (*end == 'g' || *end == 'G')) size <<= 30;
+	return size;
+}
+
+// Parse a processing option at argv[*index] (advancing past any value), returns false if it is not a processing option
+bool parseOption(int argc, char *argv[], int *index, zippast_options_t *options)
+{
+	const char *arg = argv[*index];
+	const char *value = (*index + 1 < argc) ? argv[*index + 1] : NULL;
+	if (!strcmp(arg, "-comment") && value != NULL)
+	{
+		options->commentPad = (size_t)strtoul(value, NULL, 0);
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-threads") && value != NULL)
+	{
+		options->threads = (int)strtol(value, NULL, 0);
+		if (options->threads <= 0) options->threads = cpuCount();
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-index") && value != NULL)
+	{
+		options->indexFile = value;
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-digest") && value != NULL)
+	{
+		options->digests = 0;
+		if (strstr(value, "sha256") != NULL || !strcmp(value, "all")) options->digests |= DIGEST_SHA256;
+		if (strstr(value, "xxh3") != NULL || !strcmp(value, "all")) options->digests |= DIGEST_XXH3;
+		if (options->digests == 0) { fprintf(stderr, "ERROR: Unsupported digest (sha256, xxh3, or all): %s\n", value); return false; }
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-digest-input"))
+	{
+		options->digestInput = true;
+	}
+	else if (!strcmp(arg, "-digest-file") && value != NULL)
+	{
+		options->digestFile = value;
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-align") && value != NULL)
+	{
+		options->alignment = (size_t)strtoul(value, NULL, 0);
+		(*index)++;
+	}
+	else if (!strcmp(arg, "-mode:none")) { options->mode = MODE_NONE; }
+	else if (!strcmp(arg, "-mode:bmp")) { options->mode = MODE_BMP; }
+	else if (!strcmp(arg, "-mode:wav")) { options->mode = MODE_WAV; }
+	else if (!strcmp(arg, "-mode:eml")) { options->mode = MODE_EML; }
+	else if (!strcmp(arg, "-mode:mhtml")) { options->mode = MODE_MHTML; }
+	else if (!strcmp(arg, "-mode:html")) { options->mode = MODE_HTML; }
+	else if (!strcmp(arg, "-mode:standard")) { options->mode = MODE_STANDARD; }
+	else if (!strcmp(arg, "-mode:byte")) { options->mode = MODE_BYTE; }
+	else if (!strcmp(arg, "-zip:keep")) { options->convert = false; }
+	else if (!strcmp(arg, "-zip:convert")) { options->convert = true; }
+	else if (!strcmp(arg, "-crc-cache")) { options->crcCache = true; }
+	else if (!strcmp(arg, "-repack") && value != NULL)
+	{
+		options->repackMin = (size_t)parseSize(value);
+		(*index)++;
+	}
+	else { return false; }
+	return true;
+}
+
+#ifdef ZIPPAST_DAEMON
+// Daemon mode: jobs are requested over a local (Unix domain) socket, and run on warm worker threads that reuse their buffers.
+// Request: the arguments for one job as on the command line (e.g. "-mode:bmp", "in.zip", "-out", "out.bmp"), each NUL-terminated, ending with an empty argument.
+// The input (and optionally the output) may be sent as open file descriptors (SCM_RIGHTS), in which case the input argument is only used as the name when wrapping.
+// The request "-stats" returns the queue depth and latency statistics instead.
+// Response: a single line "OK <output-bytes> <latency-us>" or "ERROR <message>".
+#define DAEMON_MAX_REQUEST 8192
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_MAX_PENDING 64					// connections whose requests are still being received
+#define DAEMON_RECEIVE_TIMEOUT (10 * 1000000)	// microseconds
+
+typedef struct
+{
+	int client;
+	int inputFd;
+	int outputFd;
+	uint64_t received;
+	size_t length;		// request bytes received so far
+	bool complete;		// received, waiting for space in the queue
+	int argc;
+	char *argv[DAEMON_MAX_ARGS];
+	char request[DAEMON_MAX_REQUEST];
+} daemon_job_t;
+
+typedef struct
+{
+	jobqueue_t queue;
+	zippast_options_t defaults;
+	zippast_mutex_t statsMutex;
+	int active;
+	unsigned long long completed;
+	unsigned long long failed;
+	unsigned long long waitTotal;
+	unsigned long long latencyTotal;
+	unsigned long long latencyMax;
+} daemon_t;
+
+static volatile sig_atomic_t daemonStop = 0;
+static void daemonSignal(int sig) { (void)sig; daemonStop = 1; }
+
+static void daemonRespond(int client, const char *format, ...)
+{
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (length > 0 && write(client, line, (size_t)length) != length) { perror("WARNING: Problem sending daemon response"); }
+}
+
+static void daemonJobFree(daemon_job_t *job)
+{
+	close(job->client);
+	if (job->inputFd >= 0) close(job->inputFd);
+	if (job->outputFd >= 0) close(job->outputFd);
+	free(job);
+}
+
+// Run a single job using (and keeping) the worker's reusable input buffer
+static bool daemonRunJob(daemon_t *daemon, daemon_job_t *job, unsigned char **buffer, size_t *capacity, size_t *outputLength)
+{
+	zippast_options_t options = daemon->defaults;
+	const char *inputFile = NULL;
+	const char *outputFile = NULL;
+	for (int i = 0; i < job->argc; i++)
+	{
+		if (!strcmp(job->argv[i], "-out") && i + 1 < job->argc) { outputFile = job->argv[++i]; }
+		else if (parseOption(job->argc, job->argv, &i, &options)) { ; }
+		else if (job->argv[i][0] != '-' && inputFile == NULL) { inputFile = job->argv[i]; }
+		else { fprintf(stderr, "ERROR: Daemon job has unsupported argument: %s\n", job->argv[i]); return false; }
+	}
+	if (inputFile == NULL)
+	{
+		if (job->inputFd < 0) { fprintf(stderr, "ERROR: Daemon job input not specified\n"); return false; }
+		inputFile = "input";
+	}
+
+	// Read input
+	FILE *fp = (job->inputFd >= 0) ? fdopen(dup(job->inputFd), "rb") : fopen(inputFile, "rb");
+	if (fp == NULL) { perror("ERROR: Problem opening input file"); return false; }
+	crc_cache_key_t crcKey;
+	bool crcKeyed = options.crcCache && crcCacheKey(fileno(fp), &crcKey);
+	size_t contentsLength = 0;
+	unsigned char *contents = readStream(fp, buffer, capacity, &contentsLength, NULL);
+	bool crcStore = contents != NULL && crcKeyed && !isZip(contents, contentsLength);
+	if (crcStore && crcCacheRead(fileno(fp), &crcKey, &options.inputCrc)) { options.inputCrcKnown = true; crcStore = false; }
+	if (!crcStore) { fclose(fp); fp = NULL; }
+	if (contents == NULL) { return false; }
+	digest_t inputDigest, outputDigest;
+	if (options.digests && options.digestInput)
+	{
+		DigestInit(&inputDigest, options.digests);
+		DigestUpdate(&inputDigest, contents, contentsLength);
+	}
+	if (options.digests) DigestInit(&outputDigest, options.digests);
+
+	// Generate (takes the buffer, which is recovered afterwards for reuse)
+	zippast_output_t output;
+	bool result = zippastGenerate(findFilename(inputFile), contents, contentsLength, &options, &output);
+	*buffer = NULL;
+	*capacity = 0;
+	if (fp != NULL)
 	{
-		header = generateBmp(contentsLength + commentPad, &headerSize);
+		// (the input is kept open to store its CRC)
+		if (result && output.entries.count == 1) crcCacheWrite(fileno(fp), &crcKey, output.entries.crc32[0]);
+		fclose(fp);
 	}
-	else if (mode == MODE_WAV)
+	if (!result) { return false; }
+
+	// Write output
+	const char *derivedFile = NULL;
+	if (job->outputFd >= 0) { fp = fdopen(dup(job->outputFd), "wb"); }
+	else
 	{
-		header = generateWav(contentsLength + commentPad, &headerSize);
+		if (outputFile == NULL) { outputFile = derivedFile = replaceExtension(inputFile, modeExtension(options.mode)); }
+		fp = (outputFile != NULL) ? fopen(outputFile, "wb") : NULL;
 	}
-	else if (mode == MODE_EML) {
-		const char *footer = NULL;
-		header = generateEml(contentsLength, &headerSize, comment, commentPad);
+	if (fp == NULL) { perror("ERROR: Problem opening output file"); result = false; }
+	else
+	{
+		result = writeOutput(fp, &output, options.digests ? &outputDigest : NULL, NULL);
+		if (fclose(fp) != 0) { result = false; }
 	}
-	else if (mode == MODE_MHTML) {
-		header = generateMhtml(contentsLength, &headerSize, comment, commentPad);
+	if (result && options.digests) { result = writeDigests(&options, options.digestInput ? &inputDigest : NULL, inputFile, &outputDigest, outputFile != NULL ? outputFile : "output", stderr); }
+	if (result && options.indexFile != NULL) { result = writeIndexFile(options.indexFile, &output); }
+	free((void *)derivedFile);
+	*outputLength = output.headerSize + output.contentsLength + output.commentPad;
+
+	// Keep the (possibly replaced) contents buffer for the next job (unless it is a mapped input file)
+	if (!BufferIsMapped(output.contents))
+	{
+		*buffer = output.contents;
+		*capacity = output.contentsLength;
+		output.contents = NULL;
 	}
-	else if (mode == MODE_HTML) {
-		header = generateHtml(contentsLength + commentPad, &headerSize);
+	zippastOutputFree(&output);
+	return result;
+}
+
+static void *DaemonWorker(void *arg)
+{
+	daemon_t *daemon = (daemon_t *)arg;
+	unsigned char *buffer = NULL;
+	size_t capacity = 0;
+	daemon_job_t *job;
+	while ((job = (daemon_job_t *)JobQueuePop(&daemon->queue)) != NULL)
+	{
+		uint64_t started = timeMicroseconds();
+		MutexLock(&daemon->statsMutex);
+		daemon->active++;
+		daemon->waitTotal += started - job->received;
+		MutexUnlock(&daemon->statsMutex);
+
+		size_t outputLength = 0;
+		bool result = daemonRunJob(daemon, job, &buffer, &capacity, &outputLength);
+		uint64_t latency = timeMicroseconds() - job->received;
+
+		MutexLock(&daemon->statsMutex);
+		daemon->active--;
+		if (result) { daemon->completed++; } else { daemon->failed++; }
+		daemon->latencyTotal += latency;
+		if (latency > daemon->latencyMax) { daemon->latencyMax = latency; }
+		MutexUnlock(&daemon->statsMutex);
+
+		if (result) { daemonRespond(job->client, "OK %llu %llu\n", (unsigned long long)outputLength, (unsigned long long)latency); }
+		else { daemonRespond(job->client, "ERROR Processing failed\n"); }
+		daemonJobFree(job);
 	}
-	else if (mode == MODE_STANDARD)
+	BufferFree(buffer);
+	return NULL;
+}
+
+static void daemonStats(daemon_t *daemon, char *line, size_t size)
+{
+	MutexLock(&daemon->statsMutex);
+	unsigned long long jobs = daemon->completed + daemon->failed;
+	snprintf(line, size, "queued=%d active=%d completed=%llu failed=%llu wait_avg_us=%llu latency_avg_us=%llu latency_max_us=%llu",
+		JobQueueDepth(&daemon->queue), daemon->active, daemon->completed, daemon->failed,
+		jobs ? daemon->waitTotal / jobs : 0, jobs ? daemon->latencyTotal / jobs : 0, daemon->latencyMax);
+	MutexUnlock(&daemon->statsMutex);
+}
+
+// Receive more of a request (and any file descriptors) from a connected client, without blocking: 1 when complete, 0 when more is expected, -1 on error, -2 if there are too many arguments
+static int daemonReceive(daemon_job_t *job)
+{
+	union { struct cmsghdr align; char buffer[CMSG_SPACE(2 * sizeof(int))]; } control;
+	struct iovec iov = { job->request + job->length, sizeof(job->request) - job->length };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	ssize_t received = recvmsg(job->client, &msg, MSG_DONTWAIT);
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return 0; }
+	if (received <= 0) { return -1; }
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
 	{
-		const char *data; // = "\x1A";	// DOS EOF
-		data = HEADER_STRING;
-		header = (unsigned char *)strdup(data);
-		for (unsigned char *p = header; *p != 0; p++) *p &= 0x7f;	// clear top bit to allow easier control codes from source
-		headerSize = strlen((char *)header);
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		int fds[2] = { -1, -1 };
+		memcpy(fds, CMSG_DATA(cmsg), (count < 2 ? count : 2) * sizeof(int));
+		for (int i = 2; i < count; i++) { int extra; memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int)); close(extra); }
+		if (job->inputFd < 0) { job->inputFd = fds[0]; job->outputFd = fds[1]; }
+		else { if (fds[0] >= 0) close(fds[0]); if (fds[1] >= 0) close(fds[1]); }
 	}
-	else if (mode == MODE_BYTE)
+	job->length += (size_t)received;
+
+	// Complete when the last argument is empty (i.e. ends with two NULs, or is just a single NUL)
+	size_t length = job->length;
+	if (!((length >= 2 && job->request[length - 1] == '\0' && job->request[length - 2] == '\0') || (length == 1 && job->request[0] == '\0')))
 	{
-		const char *data; // = "\x1A";	// DOS EOF
-		data = HEADER_STRING;
-		header = (unsigned char *)strdup(data);
-		for (unsigned char *p = header; *p != 0; p++) *p &= 0x7f;	// clear top bit to allow easier control codes from source
-		headerSize = strlen((char *)header);
+		return length >= sizeof(job->request) ? -1 : 0;
 	}
-	else  // mode == MODE_NONE
+
+	job->argc = 0;
+	for (char *p = job->request; *p != '\0'; p += strlen(p) + 1)
 	{
-		;
+		if (job->argc >= DAEMON_MAX_ARGS) { return -2; }
+		job->argv[job->argc++] = p;
 	}
-	if (header == NULL && mode != MODE_NONE)
+	return 1;
+}
+
+int runDaemon(const char *socketPath, const zippast_options_t *defaults, int workers, int queueSize)
+{
+	daemon_t daemon;
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.defaults = *defaults;
+	daemon.defaults.threads = 1;	// parallelism is across jobs
+	if (!JobQueueInit(&daemon.queue, queueSize > 0 ? queueSize : 1)) { perror("ERROR: Problem allocating daemon queue"); return 1; }
+	MutexInit(&daemon.statsMutex);
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path)) { fprintf(stderr, "ERROR: Socket path too long: %s\n", socketPath); return 1; }
+	strcpy(address.sun_path, socketPath);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) { perror("ERROR: Problem creating daemon socket"); return 1; }
+	struct stat st;
+	if (lstat(socketPath, &st) == 0)
+	{
+		// Only replace a stale socket (never another kind of file)
+		if (!S_ISSOCK(st.st_mode)) { fprintf(stderr, "ERROR: Daemon socket path exists and is not a socket: %s\n", socketPath); close(server); return 1; }
+		unlink(socketPath);
+	}
+	fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+	if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 128) != 0)
 	{
-		free(contents);
+		perror("ERROR: Problem listening on daemon socket");
+		close(server);
 		return 1;
 	}
 
-	// Patch ZIP file
-	if (!zipOffsets(&contents, &contentsLength, headerSize, commentPad))
+	// Workers must not receive the termination signals (so that accept() is interrupted instead)
+	sigset_t signals, previous;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	if (workers <= 0) workers = 1;
+	zippast_thread_t *threads = (zippast_thread_t *)malloc(workers * sizeof(zippast_thread_t));
+	int started = 0;
+	while (threads != NULL && started < workers && ThreadCreate(&threads[started], DaemonWorker, &daemon)) started++;
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = daemonSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "ZIPPAST: Daemon listening on %s (%d workers, queue %d)\n", socketPath, started, daemon.queue.capacity);
+	// Requests are received from every connected client in turn as their data arrives, so that a slow (or idle) client does not hold up the others.
+	// Received requests that do not fit in the queue are kept (in order, no longer polled) and retried, rather than waiting for a worker.
+	daemon_job_t *pending[DAEMON_MAX_PENDING];
+	struct pollfd fds[DAEMON_MAX_PENDING + 1];
+	int pendingCount = 0;
+	while (!daemonStop && started > 0)
 	{
-		fprintf(stderr, "ERROR: Problem offsetting ZIP file contents by %u\n", (unsigned int)headerSize);
-		free(contents);
-		return 1;
+		int count = 0;
+		bool waiting = false;
+		for (int i = 0; i < pendingCount; i++)
+		{
+			fds[count].fd = pending[i]->complete ? -1 : pending[i]->client;		// (negative descriptors are ignored)
+			fds[count].events = POLLIN;
+			fds[count].revents = 0;
+			if (pending[i]->complete) waiting = true;
+			count++;
+		}
+		int serverIndex = -1;
+		if (pendingCount < DAEMON_MAX_PENDING) { serverIndex = count; fds[count].fd = server; fds[count].events = POLLIN; fds[count].revents = 0; count++; }
+		if (poll(fds, (nfds_t)count, waiting ? 10 : 1000) < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("ERROR: Problem waiting for daemon connections");
+			break;
+		}
+		uint64_t now = timeMicroseconds();
+
+		int kept = 0;
+		for (int i = 0; i < pendingCount; i++)
+		{
+			daemon_job_t *job = pending[i];
+			if (job->complete)
+			{
+				if (!JobQueueTryPush(&daemon.queue, job)) pending[kept++] = job;
+				continue;
+			}
+			int status = (fds[i].revents != 0) ? daemonReceive(job) : 0;
+			if (status == 0 && now - job->received < DAEMON_RECEIVE_TIMEOUT) { pending[kept++] = job; continue; }
+			if (status == 0)
+			{
+				daemonRespond(job->client, "ERROR Request timed out\n");
+			}
+			else if (status == -2)
+			{
+				daemonRespond(job->client, "ERROR Too many arguments\n");
+			}
+			else if (status < 0)
+			{
+				daemonRespond(job->client, "ERROR Invalid request\n");
+			}
+			else if (job->argc == 1 && !strcmp(job->argv[0], "-stats"))
+			{
+				char line[256];
+				daemonStats(&daemon, line, sizeof(line));
+				daemonRespond(job->client, "OK %s\n", line);
+			}
+			else if (JobQueueTryPush(&daemon.queue, job))
+			{
+				continue;	// the worker owns the job now
+			}
+			else
+			{
+				job->complete = true;	// (queue full: retried)
+				pending[kept++] = job;
+				continue;
+			}
+			daemonJobFree(job);
+		}
+		pendingCount = kept;
+
+		if (serverIndex >= 0 && (fds[serverIndex].revents & POLLIN))
+		{
+			int client = accept(server, NULL, NULL);
+			if (client < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+				perror("ERROR: Problem accepting daemon connection");
+				break;
+			}
+			fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK);		// (inherited on some platforms; receives do not block regardless)
+			daemon_job_t *job = (daemon_job_t *)malloc(sizeof(daemon_job_t));
+			if (job == NULL) { daemonRespond(client, "ERROR Out of memory\n"); close(client); continue; }
+			job->client = client;
+			job->inputFd = job->outputFd = -1;
+			job->received = now;
+			job->length = 0;
+			job->complete = false;
+			pending[pendingCount++] = job;
+		}
 	}
+	for (int i = 0; i < pendingCount; i++) daemonJobFree(pending[i]);
 
-	// Write output
-	fprintf(stderr, "ZIPPAST: Writing: %s\n", outputFile);
-	FILE *fp = stdout;
-	if (outputFile[0] != '\0' || !strcmp(outputFile, "-")) fp = fopen(outputFile, "wb");
-	if (fp == NULL) { perror("ERROR: Problem opening output file"); free((void *)header); free(contents); return 1; }
-	size_t written = 0;
-	if (header != NULL)
+	// Finish queued jobs, then stop
+	close(server);
+	unlink(socketPath);
+	JobQueueClose(&daemon.queue);
+	for (int i = 0; i < started; i++) ThreadJoin(threads[i]);
+	free(threads);
+	char line[256];
+	daemonStats(&daemon, line, sizeof(line));
+	fprintf(stderr, "ZIPPAST: Daemon stopped: %s\n", line);
+	MutexDestroy(&daemon.statsMutex);
+	JobQueueDestroy(&daemon.queue);
+	return 0;
+}
+#endif
+
+#ifdef ZIPPAST_WATCH
+// Watch mode: new files in the watched directories (closed after writing, or moved in) are queued for a pool of workers.
+// Outputs are written to a hidden temporary file then renamed into place, so they only appear once complete.
+// The queue is bounded: when it is full, events are left in the kernel's inotify queue (and the directories are rescanned if that overflows).
+typedef struct
+{
+	char *inputFile;
+	char *outputFile;
+	uint64_t received;
+} watch_job_t;
+
+typedef struct
+{
+	jobqueue_t queue;
+	zippast_options_t options;
+	zippast_mutex_t statsMutex;
+	unsigned long long completed;
+	unsigned long long failed;
+	unsigned long long latencyTotal;
+	unsigned long long latencyMax;
+} watch_t;
+
+static void *WatchWorker(void *arg)
+{
+	watch_t *watch = (watch_t *)arg;
+	watch_job_t *job;
+	while ((job = (watch_job_t *)JobQueuePop(&watch->queue)) != NULL)
 	{
-fprintf(stderr, "OUTPUT: Header: %u\n", (unsigned int)headerSize);
-		written += fwrite(header, 1, headerSize, fp);
-		free(header);
+		// Temporary output alongside the final one (so the rename is atomic)
+		char *tempFile = (char *)malloc(strlen(job->outputFile) + 32);
+		bool result = (tempFile != NULL);
+		if (result)
+		{
+			const char *name = findFilename(job->outputFile);
+			sprintf(tempFile, "%.*s.%s.%lu.tmp", (int)(name - job->outputFile), job->outputFile, name, (unsigned long)getpid());
+			result = process(job->inputFile, tempFile, &watch->options) == 0;
+			if (result && rename(tempFile, job->outputFile) != 0) { perror("ERROR: Problem renaming output file"); result = false; }
+			if (!result) unlink(tempFile);
+		}
+		uint64_t latency = timeMicroseconds() - job->received;
+		fprintf(stderr, "ZIPPAST: Watch: %s %s -> %s (%.3f s)\n", result ? "Converted" : "Failed", job->inputFile, job->outputFile, latency / 1000000.0);
+
+		MutexLock(&watch->statsMutex);
+		if (result) { watch->completed++; } else { watch->failed++; }
+		watch->latencyTotal += latency;
+		if (latency > watch->latencyMax) { watch->latencyMax = latency; }
+		MutexUnlock(&watch->statsMutex);
+
+		free(tempFile);
+		free(job->inputFile);
+		free(job->outputFile);
+		free(job);
 	}
-fprintf(stderr, "OUTPUT: Contents: %u\n", (unsigned int)contentsLength);
-	written += fwrite(contents, 1, contentsLength, fp);
-	free(contents);
-fprintf(stderr, "OUTPUT: Comment: %u\n", (unsigned int)commentPad);
-	if (commentPad > 0)
+	return NULL;
+}
+
+// Queue a file for conversion (blocks while the queue is full), unless it is hidden (e.g. a temporary file) or already an output
+static void watchQueue(watch_t *watch, const char *dir, const char *name, const char *outputDir, bool existing)
+{
+	const char *extension = modeExtension(watch->options.mode);
+	size_t nameLength = strlen(name);
+	if (name[0] == '.' || (nameLength >= strlen(extension) && !strcmp(name + nameLength - strlen(extension), extension))) return;
+
+	watch_job_t *job = (watch_job_t *)calloc(1, sizeof(watch_job_t));
+	const char *outputName = replaceExtension(name, extension);
+	if (job != NULL) { job->inputFile = (char *)malloc(strlen(dir) + nameLength + 2); }
+	if (job != NULL && outputName != NULL) { job->outputFile = (char *)malloc(strlen(outputDir) + strlen(outputName) + 2); }
+	if (job == NULL || outputName == NULL || job->inputFile == NULL || job->outputFile == NULL)
 	{
-		written += fwrite(comment, 1, commentPad, fp);
-		free(comment);
+		perror("ERROR: Problem allocating watch job");
+		if (job != NULL) { free(job->inputFile); free(job->outputFile); }
+		free(job);
+		free((void *)outputName);
+		return;
 	}
-	if (fp != stdout) fclose(fp);
-	if (written != headerSize + contentsLength + commentPad)
+	sprintf(job->inputFile, "%s/%s", dir, name);
+	sprintf(job->outputFile, "%s/%s", outputDir, outputName);
+	free((void *)outputName);
+
+	// When rescanning, only files without an output
+	struct stat st;
+	if (existing && (stat(job->inputFile, &st) != 0 || !S_ISREG(st.st_mode) || stat(job->outputFile, &st) == 0))
 	{
-		fprintf(stderr, "ERROR: Problem writing file contents.\n");
-		return 1;
+		free(job->inputFile); free(job->outputFile); free(job);
+		return;
 	}
 
-	return 0;
+	job->received = timeMicroseconds();
+	if (JobQueueDepth(&watch->queue) >= watch->queue.capacity) { fprintf(stderr, "ZIPPAST: Watch: Queue full, waiting...\n"); }
+	if (!JobQueuePush(&watch->queue, job)) { free(job->inputFile); free(job->outputFile); free(job); }
 }
 
-// Return a allocated string for the replacement of the extension for the specified file name.
-const char *replaceExtension(const char *inputFile, const char *newExt)
+// Queue any files that do not yet have an output (after events were lost)
+static void watchRescan(watch_t *watch, const char *dir, const char *outputDir)
 {
-	char *outputFile = (char *)malloc(strlen(inputFile) + strlen(newExt) + 1);
-	if (outputFile == NULL)
+	DIR *d = opendir(dir);
+	if (d == NULL) { perror("ERROR: Problem rescanning watched directory"); return; }
+	struct dirent *entry;
+	while (!daemonStop && (entry = readdir(d)) != NULL) { watchQueue(watch, dir, entry->d_name, outputDir, true); }
+	closedir(d);
+}
+
+int runWatch(const char **dirs, int dirCount, const char *outputDir, const zippast_options_t *options, int workers, int queueSize)
+{
+	watch_t watch;
+	memset(&watch, 0, sizeof(watch));
+	watch.options = *options;
+	watch.options.threads = 1;	// parallelism is across files
+	if (!JobQueueInit(&watch.queue, queueSize > 0 ? queueSize : 1)) { perror("ERROR: Problem allocating watch queue"); return 1; }
+	MutexInit(&watch.statsMutex);
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) { perror("ERROR: Problem initializing inotify"); JobQueueDestroy(&watch.queue); return 1; }
+	int *watches = (int *)malloc(dirCount * sizeof(int));
+	for (int i = 0; watches != NULL && i < dirCount; i++)
 	{
-		perror("ERROR: Problem creating output file name");
-		return NULL;
+		watches[i] = inotify_add_watch(fd, dirs[i], IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (watches[i] < 0) { fprintf(stderr, "ERROR: Problem watching directory: %s (%s)\n", dirs[i], strerror(errno)); free(watches); watches = NULL; }
 	}
-	strcpy(outputFile, inputFile);
-	for (char *p = outputFile + strlen(outputFile); p >= outputFile && *p != '\\' && *p != '/'; p--)
+	if (watches == NULL) { close(fd); JobQueueDestroy(&watch.queue); return 1; }
+
+	// Workers must not receive the termination signals (so that read() is interrupted instead)
+	sigset_t signals, previous;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	if (workers <= 0) workers = 1;
+	zippast_thread_t *threads = (zippast_thread_t *)malloc(workers * sizeof(zippast_thread_t));
+	int started = 0;
+	while (threads != NULL && started < workers && ThreadCreate(&threads[started], WatchWorker, &watch)) started++;
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = daemonSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	fprintf(stderr, "ZIPPAST: Watching %d director%s (%d workers, queue %d)\n", dirCount, dirCount == 1 ? "y" : "ies", started, watch.queue.capacity);
+	union { struct inotify_event align; char buffer[64 * 1024]; } events;
+	while (!daemonStop && started > 0)
 	{
-		if (*p == '.') { *p = '\0'; break; }
+		ssize_t length = read(fd, events.buffer, sizeof(events.buffer));
+		if (length < 0)
+		{
+			if (errno == EINTR) continue;
+			perror("ERROR: Problem reading inotify events");
+			break;
+		}
+		for (char *p = events.buffer; p < events.buffer + length; )
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				fprintf(stderr, "WARNING: Watch: Events were lost, rescanning\n");
+				for (int i = 0; i < dirCount; i++) watchRescan(&watch, dirs[i], outputDir != NULL ? outputDir : dirs[i]);
+				continue;
+			}
+			if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+			for (int i = 0; i < dirCount; i++)
+			{
+				if (watches[i] != event->wd) continue;
+				watchQueue(&watch, dirs[i], event->name, outputDir != NULL ? outputDir : dirs[i], false);
+				break;
+			}
+		}
 	}
-	strcat(outputFile, newExt);
-	return outputFile;
+
+	// Finish queued files, then stop
+	close(fd);
+	free(watches);
+	JobQueueClose(&watch.queue);
+	for (int i = 0; i < started; i++) ThreadJoin(threads[i]);
+	free(threads);
+	unsigned long long jobs = watch.completed + watch.failed;
+	fprintf(stderr, "ZIPPAST: Watch stopped: completed=%llu failed=%llu latency_avg_us=%llu latency_max_us=%llu\n", watch.completed, watch.failed, jobs ? watch.latencyTotal / jobs : 0, watch.latencyMax);
+	MutexDestroy(&watch.statsMutex);
+	JobQueueDestroy(&watch.queue);
+	return 0;
+}
+#endif
+
+// Machine-readable progress lines for the command line (to standard error, or a status file descriptor)
+static bool cliProgress(void *context, const zippast_progress_t *progress)
+{
+	FILE *fp = (FILE *)context;
+	fprintf(fp, "PROGRESS stage=%s bytes=%llu/%llu entries=%u/%u rate=%llu elapsed=%llu\n", progress->stage, (unsigned long long)progress->bytes, (unsigned long long)progress->totalBytes, progress->entries, progress->totalEntries, (unsigned long long)progress->rate, (unsigned long long)(progress->elapsed / 1000));
+	fflush(fp);
+	return true;
 }
 
 int run(int argc, char *argv[])
 {
 	bool help = false;
-	bool convert = false;
 	int positional = 0;
 	const char *inputFile = NULL;
 	const char *outputFile = NULL;
-	size_t commentPad = (1<<13) - 22 + 1;		// To push EOCD out of last 8kB: default=8171
-	HeaderMode mode = MODE_STANDARD;
+	const char *daemonSocket = NULL;
+	const char **watchDirs = (const char **)malloc((argc > 0 ? argc : 1) * sizeof(const char *));
+	int watchCount = 0;
+	const char *watchOut = NULL;
+	bool memoryReport = false;
+	uint64_t ioRate = 0, ioOps = 0;
+	bool ioNoCache = false, ioReport = false;
+	int niceValue = 0, ioClass = 0, ioLevel = 0;
+	FILE *statusStream = NULL;
+	int queueSize = 64;
+	const char *appendArchive = NULL;
+	const char *extractDir = NULL;
+	const char *lookupName = NULL;
+	bool unwrap = false;
+	bool list = false;
+	bool verify = false;
+	bool plan = false;
+	bool merge = false;
+	const char *splitFileName = NULL;
+	int splitEntries = 0;
+	uint64_t splitBytes = 0;
+	const char **patterns = (const char **)malloc((argc > 0 ? argc : 1) * sizeof(const char *));
+	int patternCount = 0;
+	zippast_sink_t *tees = (zippast_sink_t *)malloc((argc > 0 ? argc : 1) * sizeof(zippast_sink_t));
+	int teeCount = 0;
+	const char **inputFiles = (const char **)malloc((argc > 0 ? argc : 1) * sizeof(const char *));
+	if (inputFiles == NULL) { perror("ERROR: Problem allocating arguments"); return 1; }
+	zippast_options_t options;
+	zippastDefaultOptions(&options);
+	uint64_t memoryLimit = 0;
+	bool prefault = true;
 
 	for (int i = 1; i < argc; i++)
 	{
@@ -1074,20 +6409,139 @@ int run(int argc, char *argv[])
 		{
 			outputFile = argv[++i];
 		}
-		else if (!strcmp(argv[i], "-comment"))
+		else if (!strcmp(argv[i], "-daemon") && i + 1 < argc)
+		{
+			daemonSocket = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-watch") && i + 1 < argc && watchDirs != NULL)
+		{
+			watchDirs[watchCount++] = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-max-memory") && i + 1 < argc)
+		{
+			memoryLimit = parseSize(argv[++i]);		// (0=unlimited, just report)
+			memoryReport = true;
+		}
+		else if (!strcmp(argv[i], "-no-prefault"))
+		{
+			prefault = false;
+		}
+		else if (!strcmp(argv[i], "-stats"))
+		{
+			memoryReport = true;
+			ioReport = true;
+		}
+		else if (!strcmp(argv[i], "-io-rate") && i + 1 < argc)
+		{
+			ioRate = parseSize(argv[++i]);		// bytes per second
+			ioReport = true;
+		}
+		else if (!strcmp(argv[i], "-io-ops") && i + 1 < argc)
+		{
+			ioOps = parseSize(argv[++i]);		// operations per second
+			ioReport = true;
+		}
+		else if (!strcmp(argv[i], "-io-nocache"))
+		{
+			ioNoCache = true;
+			ioReport = true;
+		}
+		else if (!strcmp(argv[i], "-io-stats"))
+		{
+			ioReport = true;
+		}
+		else if (!strcmp(argv[i], "-ioprio") && i + 1 < argc)
+		{
+			i++;
+			if (!strcmp(argv[i], "idle")) { ioClass = 1; }
+			else { ioClass = 2; ioLevel = (int)strtol(argv[i], NULL, 0); }
+		}
+		else if (!strcmp(argv[i], "-nice") && i + 1 < argc)
+		{
+			niceValue = (int)strtol(argv[++i], NULL, 0);
+		}
+		else if (!strcmp(argv[i], "-progress"))
+		{
+			statusStream = stderr;
+		}
+		else if (!strcmp(argv[i], "-status-fd") && i + 1 < argc)
+		{
+			statusStream = fdopen((int)strtol(argv[++i], NULL, 0), "w");
+			if (statusStream == NULL) { perror("ERROR: Problem opening status file descriptor"); return 1; }
+		}
+		else if (!strcmp(argv[i], "-checkpoint") && i + 1 < argc)
+		{
+			options.checkpointFile = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-checkpoint-interval") && i + 1 < argc)
+		{
+			options.checkpointInterval = parseSize(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-watch-out") && i + 1 < argc)
+		{
+			watchOut = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-lookup") && i + 1 < argc)
+		{
+			lookupName = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-unwrap"))
+		{
+			unwrap = true;
+		}
+		else if (!strcmp(argv[i], "-list"))
+		{
+			list = true;
+		}
+		else if (!strcmp(argv[i], "-verify"))
+		{
+			verify = true;
+		}
+		else if (!strcmp(argv[i], "-plan"))
+		{
+			plan = true;
+		}
+		else if (!strcmp(argv[i], "-merge"))
+		{
+			merge = true;
+		}
+		else if (!strcmp(argv[i], "-split") && i + 1 < argc)
+		{
+			splitFileName = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-split-entries") && i + 1 < argc)
+		{
+			splitEntries = (int)strtol(argv[++i], NULL, 0);
+		}
+		else if (!strcmp(argv[i], "-split-size") && i + 1 < argc)
+		{
+			splitBytes = parseSize(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-filter") && i + 1 < argc && patterns != NULL)
+		{
+			patterns[patternCount++] = argv[++i];
+		}
+		else if ((!strcmp(argv[i], "-tee") || !strcmp(argv[i], "-tee-optional")) && i + 1 < argc && tees != NULL)
+		{
+			tees[teeCount].optional = !strcmp(argv[i], "-tee-optional");
+			tees[teeCount++].path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-extract") && i + 1 < argc)
 		{
-			commentPad = (size_t)strtoul(argv[++i], NULL, 0);
+			extractDir = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-append") && i + 1 < argc)
+		{
+			appendArchive = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-queue") && i + 1 < argc)
+		{
+			queueSize = (int)strtol(argv[++i], NULL, 0);
+		}
+		else if (parseOption(argc, argv, &i, &options))
+		{
+			;
 		}
-		else if (!strcmp(argv[i], "-mode:none")) { mode = MODE_NONE; }
-		else if (!strcmp(argv[i], "-mode:bmp")) { mode = MODE_BMP; }
-		else if (!strcmp(argv[i], "-mode:wav")) { mode = MODE_WAV; }
-		else if (!strcmp(argv[i], "-mode:eml")) { mode = MODE_EML; }
-		else if (!strcmp(argv[i], "-mode:mhtml")) { mode = MODE_MHTML; }
-		else if (!strcmp(argv[i], "-mode:html")) { mode = MODE_HTML; }
-		else if (!strcmp(argv[i], "-mode:standard")) { mode = MODE_STANDARD; }
-		else if (!strcmp(argv[i], "-mode:byte")) { mode = MODE_BYTE; }
-		else if (!strcmp(argv[i], "-zip:keep")) { convert = false; }
-		else if (!strcmp(argv[i], "-zip:convert")) { convert = true; }
 		else if (argv[i][0] == '-')
 		{
 			fprintf(stderr, "ERROR: Unsupported argument: %s\n", argv[i]);
@@ -1099,15 +6553,46 @@ int run(int argc, char *argv[])
 			{
 				inputFile = argv[i];
 			}
-			else
-			{
-				fprintf(stderr, "ERROR: Unexpected positional argument: %s\n", argv[i]);
-				help = true;
-			}
-			positional++;
+			inputFiles[positional++] = argv[i];
 		}
 	}
 
+	// Priorities are set before any threads are created (which inherit them)
+	BufferInit(memoryLimit, prefault);
+	IoInit(ioRate, ioOps, ioNoCache);
+	if (niceValue != 0 || ioClass != 0) IoPriority(niceValue, ioClass, ioLevel);
+	if (ioReport) atexit(IoReport);		// (whichever operation is run)
+
+	if (positional > 1 && appendArchive == NULL && !merge)
+	{
+		fprintf(stderr, "ERROR: Unexpected positional argument: %s\n", inputFiles[1]);
+		help = true;
+	}
+
+	if (!help && daemonSocket != NULL)
+	{
+#ifdef ZIPPAST_DAEMON
+		return runDaemon(daemonSocket, &options, options.threads, queueSize);
+#else
+		(void)queueSize;
+		fprintf(stderr, "ERROR: Daemon mode is not supported on this platform\n");
+		return 1;
+#endif
+	}
+
+	if (!help && watchCount > 0)
+	{
+#ifdef ZIPPAST_WATCH
+		return runWatch(watchDirs, watchCount, watchOut, &options, options.threads, queueSize);
+#else
+		(void)watchOut; (void)queueSize;
+		fprintf(stderr, "ERROR: Watch mode is not supported on this platform\n");
+		return 1;
+#endif
+	}
+
+	if (!help && splitFileName != NULL) inputFile = splitFileName;
+
 	if (!help && (inputFile == NULL || strlen(inputFile) <= 0))
 	{
 		fprintf(stderr, "ERROR: Input file not specified\n");
@@ -1116,27 +6601,105 @@ int run(int argc, char *argv[])
 
 	if (help)
 	{
-		printf("Usage: zippast <file.{zip|*}> [-zip:<convert|keep>] [-mode:<standard|byte|none|bmp|wav>] [-comment <size=8171>] [-out <file.{bin|dat|bmp|wav|html}>]\n");
+		printf("Usage: zippast <file.{zip|*}> [-zip:<convert|keep>] [-crc-cache] [-repack <min-bytes>] [-mode:<standard|byte|none|bmp|wav>] [-comment <size=8171>] [-align <bytes>] [-plan] [-index <file.zpi>] [-digest <sha256,xxh3>] [-digest-input] [-digest-file <file>] [-max-memory <bytes[K|M|G]>] [-no-prefault] [-stats] [-checkpoint <journal> [-checkpoint-interval <bytes=256M>]] [-progress] [-status-fd <fd>] [-io-rate <bytes/s>] [-io-ops <ops/s>] [-io-nocache] [-io-stats] [-ioprio <idle|0-7>] [-nice <n>] [-threads <count>] [-out <file.{bin|dat|bmp|wav|html}>] [-tee <file|fd:n>...] [-tee-optional <file|fd:n>...]\n");
+		printf("       zippast -append <archive> <file>...\n");
+		printf("       zippast -lookup <name> <file.zpi>\n");
+		printf("       zippast -unwrap <file> [-out <file.zip>]\n");
+		printf("       zippast -merge <file>... -out <file.zip>\n");
+		printf("       zippast -split <file> [-split-entries <count>] [-split-size <bytes>] [-filter <pattern>...] [-out <prefix|file.zip>] [-threads <count>]\n");
+		printf("       zippast -list <file>\n");
+		printf("       zippast -verify <file> [-threads <count>]\n");
+		printf("       zippast -extract <directory> <file> [-threads <count>]\n");
+		printf("       zippast -watch <directory> [-watch <directory>...] [-watch-out <directory>] [-threads <workers>] [-queue <size=64>] [<options>...]\n");
+		printf("       zippast -daemon <socket> [-threads <workers>] [-queue <size=64>] [<default options>...]\n");
 		return 1;
 	}
 
+	if (appendArchive != NULL)
+	{
+		return appendFiles(appendArchive, inputFiles, positional, options.threads);
+	}
+
+	if (merge)
+	{
+		if (outputFile == NULL) { fprintf(stderr, "ERROR: Merge output not specified (-out <file.zip>)\n"); return 1; }
+		return mergeFiles(inputFiles, positional, outputFile);
+	}
+
+	if (splitFileName != NULL)
+	{
+		// Numbered archives after a prefix when splitting, otherwise one (filtered) archive
+		bool numbered = (splitEntries > 0 || splitBytes > 0);
+		if (outputFile == NULL) outputFile = replaceExtension(inputFile, numbered ? "" : "-filtered.zip");
+		if (outputFile == NULL) return 1;
+		return splitFile(inputFile, outputFile, numbered, splitEntries, splitBytes, patterns, patternCount, options.threads);
+	}
+
+	if (lookupName != NULL)
+	{
+		return lookupIndex(inputFile, lookupName);
+	}
+
+	if (list || verify)
+	{
+		return verifyFile(inputFile, verify, options.threads);
+	}
+
+	if (extractDir != NULL)
+	{
+		return extractFile(inputFile, extractDir, options.threads);
+	}
+
+	if (unwrap)
+	{
+		if (outputFile == NULL) outputFile = replaceExtension(inputFile, ".zip");
+		if (outputFile == NULL) return 1;
+		return unwrapFile(inputFile, outputFile);
+	}
+
 	// Generate an output file based on the input file name
 	if (outputFile == NULL)
 	{
-		const char *newExt;
-		if (mode == MODE_BMP) newExt = ".bmp";
-		else if (mode == MODE_WAV) newExt = ".wav";
-		else if (mode == MODE_EML) newExt = ".eml";
-		else if (mode == MODE_MHTML) newExt = ".mht";
-		else if (mode == MODE_HTML) newExt = ".html";
-		else if (mode == MODE_STANDARD) newExt = ".zip-email";
-		else if (mode == MODE_BYTE) newExt = ".bin";
-		else newExt = ".dat";	// MODE_NONE
-		outputFile = replaceExtension(inputFile, newExt);
+		outputFile = replaceExtension(inputFile, modeExtension(options.mode));
 		if (outputFile == NULL) return 1;
 	}
 
-	int returnValue = process(inputFile, outputFile, mode, commentPad, convert);
+	if (plan)
+	{
+		return planFile(inputFile, outputFile, &options);
+	}
+
+	if (options.checkpointFile != NULL && teeCount > 0)
+	{
+		fprintf(stderr, "ERROR: A checkpointed output cannot also be written to further destinations (-tee).\n");
+		return 1;
+	}
+	options.tees = tees;
+	options.teeCount = teeCount;
+
+	if (options.checkpointFile != NULL && (outputFile[0] == '\0' || !strcmp(outputFile, "-")))
+	{
+		fprintf(stderr, "ERROR: A checkpointed output must be a file.\n");
+		return 1;
+	}
+
+	// Progress lines, and cancellation (removing the incomplete output) on SIGINT/SIGTERM
+	if (statusStream != NULL)
+	{
+		options.progress = cliProgress;
+		options.progressContext = statusStream;
+	}
+	signal(SIGINT, cancelSignal);
+	signal(SIGTERM, cancelSignal);
+
+	int returnValue = process(inputFile, outputFile, &options);
+	if (s_cancel) fprintf(stderr, "ZIPPAST: Cancelled.\n");
+	if (statusStream != NULL)
+	{
+		fprintf(statusStream, "RESULT %s\n", returnValue == 0 ? "ok" : (s_cancel ? "cancelled" : "error"));
+		fflush(statusStream);
+	}
+	if (memoryReport) BufferReport();
 	return returnValue;
 }
 